@@ -18,6 +18,7 @@ with this program. If not, see <https://www.gnu.org/licenses/>
 
 #include "api.hpp"
 #include "downloader.h"
+#include "http-client.hpp"
 #include "util.h"
 #include "elgato-cloud-data.hpp"
 #include "platform.h"
@@ -33,6 +34,10 @@ with this program. If not, see <https://www.gnu.org/licenses/>
 
 using json = nlohmann::json;
 
+// Revalidate the cached avatar after this many seconds, unless the CDN says
+// otherwise
+#define AVATAR_MAX_AGE (24 * 60 * 60)
+
 namespace elgatocloud {
 
 MarketplaceApi *MarketplaceApi::_api = nullptr;
@@ -75,15 +80,32 @@ void MarketplaceApi::logOut()
 	std::string url = getAuthUrl(logoutEndpointSegments, {});
 	
 	auto ec = GetElgatoCloud();
+	// Taken now, the caller forgets them as soon as this returns
 	auto refreshToken = ec->GetRefreshToken();
 	auto accessToken = ec->GetAccessToken();
 	if (refreshToken != "") {
-		std::map<std::string, std::string> params = {
-			{ID_KEY, ID},
-			{REFRESH_KEY,  refreshToken}
-		};
-		std::string postData = postBody(params);
-		auto resp = fetch_string_from_post(url, postData, accessToken);
+		ec->RefreshAccessToken().Then(
+			HttpThread::MAIN,
+			[url, refreshToken, accessToken](const HttpResult &refresh) {
+				// A refresh that was due spent the tokens above and
+				// handed out the ones to end
+				std::string endToken = refreshToken;
+				std::string bearer = accessToken;
+				if (refresh.ok() && refresh.status == 200) {
+					try {
+						auto tokens = json::parse(refresh.body);
+						endToken = tokens.at("refresh_token");
+						bearer = tokens.at("access_token");
+					} catch (...) {
+					}
+				}
+				std::map<std::string, std::string> params = {
+					{ID_KEY, ID}, {REFRESH_KEY, endToken}};
+				std::string postData = postBody(params);
+				// Nothing waits for the answer
+				HttpClient::getInstance()->Post(url, postData,
+								bearer);
+			});
 	}
 	_loggedIn = false;
 	_hasAvatar = false;
@@ -170,13 +192,14 @@ void MarketplaceApi::setUserDetails(nlohmann::json &data)
 					avatarPath = avatarPath + "/" + filename;
 					std::lock_guard<std::mutex> lock(_mtx);
 					if (!_avatarDownloading) {
-						if (!os_file_exists(avatarPath.c_str())) {
-							_downloadAvatar();
-						}
-						else {
+						// Shown from the cache, refreshed in the background once stale
+						if (os_file_exists(avatarPath.c_str())) {
 							_avatarPath = avatarPath;
 							_avatarReady = true;
 						}
+						if (!Downloader::IsFresh(avatarPath, AVATAR_MAX_AGE)) {
+							_downloadAvatar(avatarPath);
+						}
 					}
 				}
 			}
@@ -188,15 +211,14 @@ void MarketplaceApi::setUserDetails(nlohmann::json &data)
 	}
 }
 
-void MarketplaceApi::_downloadAvatar()
+void MarketplaceApi::_downloadAvatar(const std::string &avatarPath)
 {
 	_avatarDownloading = true;
-	_avatarReady = false;
-	std::string savePath = QDir::homePath().toStdString();
-	savePath += getUserDataDir() + "/Thumbnails";
+	DownloadOptions options;
+	options.revalidate = true;
 	std::shared_ptr<Downloader> dl = Downloader::getInstance("");
-	dl->Enqueue(_avatarUrl, savePath, MarketplaceApi::AvatarProgress, MarketplaceApi::AvatarDownloadComplete,
-		this);
+	dl->Enqueue(_avatarUrl, avatarPath, MarketplaceApi::AvatarProgress, MarketplaceApi::AvatarDownloadComplete,
+		this, options);
 }
 
 void MarketplaceApi::AvatarDownloadComplete(std::string filename, void* data)
@@ -212,14 +234,16 @@ void MarketplaceApi::AvatarProgress(void* ptr, bool finished,
 	bool downloading, uint64_t fileSize,
 	uint64_t chunkSize, uint64_t downloaded)
 {
-	UNUSED_PARAMETER(ptr);
 	//UNUSED_PARAMETER(finished);
-	UNUSED_PARAMETER(downloading);
 	UNUSED_PARAMETER(fileSize);
 	UNUSED_PARAMETER(chunkSize);
 	UNUSED_PARAMETER(downloaded);
 	if (finished) {
 		obs_log(LOG_INFO, "Download of avatar finished.");
+	} else if (!downloading) {
+		// Failed, a cached avatar stays up and the next login retries
+		auto api = static_cast<MarketplaceApi *>(ptr);
+		api->_avatarDownloading = false;
 	}
 }
 
@@ -248,23 +272,28 @@ void MarketplaceApi::OpenStoreInBrowser() const
 void MarketplaceApi::OpenAccountInBrowser() const
 {
 	auto ec = GetElgatoCloud();
-	auto accessToken = ec->GetAccessToken();
-	std::string storeUrl =
-		_storeUrl +
-		"/account/personal?utm_source=mp_connect&utm_medium=direct_software&utm_campaign=v_1.0";
-	std::string url;
-	if (accessToken != "") {
-		std::string storeUrlEnc = url_encode(storeUrl);
-		url = _storeUrl + "/api/auth/login?token=" + accessToken + "&redirect=" + storeUrlEnc;
-	}
-	else {
-		url = storeUrl;
-	}
+	// The link signs the user in, which takes a current access token
+	ec->RefreshAccessToken().Then(HttpThread::MAIN, [this](
+								const HttpResult &refresh) {
+		auto ec = GetElgatoCloud();
+		auto accessToken = refresh.ok() ? ec->GetAccessToken() : "";
+		std::string storeUrl =
+			_storeUrl +
+			"/account/personal?utm_source=mp_connect&utm_medium=direct_software&utm_campaign=v_1.0";
+		std::string url;
+		if (accessToken != "") {
+			std::string storeUrlEnc = url_encode(storeUrl);
+			url = _storeUrl + "/api/auth/login?token=" + accessToken + "&redirect=" + storeUrlEnc;
+		}
+		else {
+			url = storeUrl;
+		}
 #ifdef WIN32
-	ShellExecuteA(NULL, NULL, url.c_str(), NULL, NULL, SW_SHOW);
+		ShellExecuteA(NULL, NULL, url.c_str(), NULL, NULL, SW_SHOW);
 #elif __APPLE__
-	openURL(url);
+		openURL(url);
 #endif
+	});
 }
 
 } // namespace elgatocloud
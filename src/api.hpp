@@ -101,7 +101,7 @@ private:
 	MarketplaceApi();
 	MarketplaceApi(const MarketplaceApi &cpy) = delete;
 
-	void _downloadAvatar();
+	void _downloadAvatar(const std::string &avatarPath);
 
 	std::string _gatewayUrl;
 	std::string _storeUrl;
@@ -0,0 +1,235 @@
+/*
+Elgato Deep-Linking OBS Plug-In
+Copyright (C) 2024 Corsair Memory Inc. oss.elgato@corsair.com
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program. If not, see <https://www.gnu.org/licenses/>
+*/
+
+#include "catalog-reader.hpp"
+
+#include <obs-module.h>
+
+namespace elgatocloud {
+
+static const char *product_fields[] = {"id", "name", "slug", "thumbnail_cdn"};
+static const char *total_fields[] = {"total", "count", "total_count"};
+
+CatalogReader::CatalogReader(CatalogPage &page) : _page(page) {}
+
+CatalogPage CatalogReader::Read(const std::string &body)
+{
+	CatalogPage page;
+	CatalogReader reader(page);
+	bool parsed = false;
+	try {
+		parsed = nlohmann::json::sax_parse(body, &reader);
+	} catch (...) {
+	}
+	if (!parsed) {
+		page.valid = false;
+		page.results = nlohmann::json::array();
+		return page;
+	}
+	for (auto total : reader._totals) {
+		if (total >= 0) {
+			page.total = total;
+			break;
+		}
+	}
+	return page;
+}
+
+CatalogReader::Role CatalogReader::_child(bool array)
+{
+	if (_levels.empty()) {
+		return array ? Role::OTHER : Role::ROOT;
+	}
+	auto &parent = _levels.back();
+	switch (parent.role) {
+	case Role::ROOT:
+		return array && parent.key == "results" ? Role::RESULTS
+							: Role::OTHER;
+	case Role::RESULTS:
+		return array ? Role::OTHER : Role::PRODUCT;
+	case Role::PRODUCT:
+		return array && parent.key == "variants" ? Role::VARIANTS
+							 : Role::OTHER;
+	case Role::VARIANTS:
+		return !array && parent.count == 0 ? Role::VARIANT
+						   : Role::OTHER;
+	default:
+		return Role::OTHER;
+	}
+}
+
+bool CatalogReader::_start(bool array)
+{
+	Role role = _child(array);
+	if (_levels.empty() && role != Role::ROOT) {
+		return false; // Not an object, so not a page
+	}
+	if (!_levels.empty()) {
+		auto &parent = _levels.back();
+		if (parent.role == Role::ROOT && parent.key == "error") {
+			_page.failed = true;
+			_page.error = "Unspecified Error";
+		}
+		parent.count++;
+	}
+	switch (role) {
+	case Role::ROOT:
+		_page.valid = true;
+		break;
+	case Role::PRODUCT:
+		_product = nlohmann::json::object();
+		break;
+	case Role::VARIANTS:
+		_product["variants"] = nlohmann::json::array();
+		break;
+	case Role::VARIANT:
+		_product["variants"].push_back(nlohmann::json::object());
+		break;
+	default:
+		break;
+	}
+	_levels.push_back({role, "", 0});
+	return true;
+}
+
+bool CatalogReader::_value(nlohmann::json value)
+{
+	if (_levels.empty()) {
+		return false;
+	}
+	auto &level = _levels.back();
+	level.count++;
+	switch (level.role) {
+	case Role::ROOT:
+		if (level.key == "error") {
+			_page.failed = true;
+			_page.error = value.is_string() ? value.get<std::string>()
+							: "Unspecified Error";
+			break;
+		}
+		for (size_t i = 0; i < 3; ++i) {
+			if (level.key == total_fields[i] &&
+			    value.is_number_integer()) {
+				_totals[i] = value.get<int64_t>();
+			}
+		}
+		break;
+	case Role::PRODUCT:
+		for (auto field : product_fields) {
+			if (level.key == field) {
+				_product[field] = std::move(value);
+				break;
+			}
+		}
+		break;
+	case Role::VARIANT:
+		if (level.key == "id") {
+			_product["variants"][0]["id"] = std::move(value);
+		}
+		break;
+	default:
+		break;
+	}
+	return true;
+}
+
+bool CatalogReader::null()
+{
+	return _value(nullptr);
+}
+
+bool CatalogReader::boolean(bool val)
+{
+	return _value(val);
+}
+
+bool CatalogReader::number_integer(number_integer_t val)
+{
+	return _value(val);
+}
+
+bool CatalogReader::number_unsigned(number_unsigned_t val)
+{
+	return _value(val);
+}
+
+bool CatalogReader::number_float(number_float_t val, const string_t &s)
+{
+	UNUSED_PARAMETER(s);
+	return _value(val);
+}
+
+bool CatalogReader::string(string_t &val)
+{
+	return _value(std::move(val));
+}
+
+bool CatalogReader::binary(binary_t &val)
+{
+	UNUSED_PARAMETER(val);
+	return _value(nullptr);
+}
+
+bool CatalogReader::start_object(std::size_t elements)
+{
+	UNUSED_PARAMETER(elements);
+	return _start(false);
+}
+
+bool CatalogReader::key(string_t &val)
+{
+	if (!_levels.empty()) {
+		_levels.back().key = val;
+	}
+	return true;
+}
+
+bool CatalogReader::end_object()
+{
+	Role role = _levels.back().role;
+	_levels.pop_back();
+	if (role == Role::PRODUCT) {
+		_page.results.push_back(std::move(_product));
+		_product = nullptr;
+	}
+	return true;
+}
+
+bool CatalogReader::start_array(std::size_t elements)
+{
+	UNUSED_PARAMETER(elements);
+	return _start(true);
+}
+
+bool CatalogReader::end_array()
+{
+	_levels.pop_back();
+	return true;
+}
+
+bool CatalogReader::parse_error(std::size_t position,
+				const std::string &last_token,
+				const nlohmann::detail::exception &ex)
+{
+	UNUSED_PARAMETER(position);
+	UNUSED_PARAMETER(last_token);
+	UNUSED_PARAMETER(ex);
+	return false;
+}
+
+} // namespace elgatocloud
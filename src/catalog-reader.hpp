@@ -0,0 +1,87 @@
+/*
+Elgato Deep-Linking OBS Plug-In
+Copyright (C) 2024 Corsair Memory Inc. oss.elgato@corsair.com
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program. If not, see <https://www.gnu.org/licenses/>
+*/
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <nlohmann/json.hpp>
+
+namespace elgatocloud {
+
+// What the plugin uses of a my-products page
+struct CatalogPage {
+	bool valid = false; // A JSON object
+	bool failed = false; // An {"error": ...} response
+	std::string error;
+	int64_t total = -1; // -1 if the page doesn't say
+	// One record per product, with only what ElgatoProduct reads: "id",
+	// "name", "slug", "thumbnail_cdn" and the "id" of the first variant
+	nlohmann::json results = nlohmann::json::array();
+};
+
+// Reads a my-products page with the SAX parser, so no document of the
+// whole response is built, only the records that are kept
+class CatalogReader : public nlohmann::json_sax<nlohmann::json> {
+public:
+	static CatalogPage Read(const std::string &body);
+
+	bool null() override;
+	bool boolean(bool val) override;
+	bool number_integer(number_integer_t val) override;
+	bool number_unsigned(number_unsigned_t val) override;
+	bool number_float(number_float_t val, const string_t &s) override;
+	bool string(string_t &val) override;
+	bool binary(binary_t &val) override;
+	bool start_object(std::size_t elements) override;
+	bool key(string_t &val) override;
+	bool end_object() override;
+	bool start_array(std::size_t elements) override;
+	bool end_array() override;
+	bool parse_error(std::size_t position, const std::string &last_token,
+			 const nlohmann::detail::exception &ex) override;
+
+private:
+	enum class Role : char {
+		ROOT,
+		RESULTS,
+		PRODUCT,
+		VARIANTS,
+		VARIANT, // The first one, the only one kept
+		OTHER
+	};
+	struct Level {
+		Role role;
+		std::string key; // Last one seen, for objects
+		size_t count = 0; // Values so far, for arrays
+	};
+
+	explicit CatalogReader(CatalogPage &page);
+	Role _child(bool array);
+	bool _start(bool array);
+	bool _value(nlohmann::json value);
+
+	CatalogPage &_page;
+	std::vector<Level> _levels;
+	nlohmann::json _product;
+	// "total", "count" and "total_count", in the order they are preferred
+	int64_t _totals[3] = {-1, -1, -1};
+};
+
+} // namespace elgatocloud
@@ -0,0 +1,377 @@
+/*
+Elgato Deep-Linking OBS Plug-In
+Copyright (C) 2024 Corsair Memory Inc. oss.elgato@corsair.com
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program. If not, see <https://www.gnu.org/licenses/>
+*/
+
+#include "downloader-bench.hpp"
+
+// Winsock has to come before anything that pulls in windows.h
+#ifdef WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+typedef SOCKET socket_t;
+#define close_socket closesocket
+#else
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+typedef int socket_t;
+#define INVALID_SOCKET -1
+#define close_socket close
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <obs-module.h>
+#include <plugin-support.h>
+#include <util/platform.h>
+
+#include "downloader.h"
+
+#ifdef MSG_NOSIGNAL
+#define SEND_FLAGS MSG_NOSIGNAL
+#else
+#define SEND_FLAGS 0
+#endif
+
+namespace elgatocloud {
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+const int BENCH_RUNS = 20;
+const size_t BENCH_BODY_SIZE = 64 * 1024;
+// Long enough for the worker to go back to waiting, which is the case
+// being measured
+const auto BENCH_IDLE = std::chrono::milliseconds(250);
+const auto BENCH_TIMEOUT = std::chrono::seconds(10);
+
+std::mutex benchLock; // Guards benchThread
+std::thread benchThread;
+std::atomic<bool> benchRunning = false;
+std::atomic<bool> benchStopping = false;
+
+// Answers every request on a loopback port with BENCH_BODY_SIZE bytes and
+// remembers when the last one arrived. One connection at a time is plenty,
+// the benchmark downloads one file at a time.
+class StandIn {
+public:
+	~StandIn() { Stop(); }
+
+	bool Start()
+	{
+		listener_ = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+		if (listener_ == INVALID_SOCKET) {
+			return false;
+		}
+		sockaddr_in addr = {};
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		addr.sin_port = 0;
+		socklen_t len = sizeof(addr);
+		if (bind(listener_, (sockaddr *)&addr, sizeof(addr)) != 0 ||
+		    listen(listener_, 8) != 0 ||
+		    getsockname(listener_, (sockaddr *)&addr, &len) != 0) {
+			close_socket(listener_);
+			listener_ = INVALID_SOCKET;
+			return false;
+		}
+		port_ = ntohs(addr.sin_port);
+		running_ = true;
+		thread_ = std::thread(&StandIn::serve, this);
+		return true;
+	}
+
+	void Stop()
+	{
+		if (!running_.exchange(false)) {
+			return;
+		}
+		thread_.join();
+		close_socket(listener_);
+		listener_ = INVALID_SOCKET;
+	}
+
+	uint16_t Port() const { return port_; }
+
+	Clock::time_point LastRequest()
+	{
+		std::lock_guard l(lock_);
+		return lastRequest_;
+	}
+
+private:
+	void serve()
+	{
+		std::string headers =
+			"HTTP/1.1 200 OK\r\n"
+			"Content-Type: application/octet-stream\r\n"
+			"Content-Length: " +
+			std::to_string(BENCH_BODY_SIZE) +
+			"\r\n"
+			"Connection: close\r\n\r\n";
+		std::string body(BENCH_BODY_SIZE, 'x');
+		while (running_) {
+			// Polled so Stop doesn't depend on closing a socket that
+			// another thread is blocked on
+			fd_set set;
+			FD_ZERO(&set);
+			FD_SET(listener_, &set);
+			timeval timeout = {0, 50000};
+			// The first argument is ignored on Windows
+			if (select((int)listener_ + 1, &set, nullptr, nullptr,
+				   &timeout) <= 0) {
+				continue;
+			}
+			socket_t client = accept(listener_, nullptr, nullptr);
+			if (client == INVALID_SOCKET) {
+				continue;
+			}
+#ifdef SO_NOSIGPIPE
+			int on = 1;
+			setsockopt(client, SOL_SOCKET, SO_NOSIGPIPE, &on,
+				   sizeof(on));
+#endif
+			respond(client, headers, body);
+			close_socket(client);
+		}
+	}
+
+	void respond(socket_t client, const std::string &headers,
+		     const std::string &body)
+	{
+		// Nothing in the request matters past the method
+		std::string request;
+		char buf[1024];
+		while (request.find("\r\n\r\n") == std::string::npos) {
+			int n = recv(client, buf, sizeof(buf), 0);
+			if (n <= 0 || request.size() > 16384) {
+				return;
+			}
+			request.append(buf, n);
+		}
+		{
+			std::lock_guard l(lock_);
+			lastRequest_ = Clock::now();
+		}
+		std::string response = headers;
+		if (request.rfind("HEAD ", 0) != 0) {
+			response += body;
+		}
+		size_t sent = 0;
+		while (sent < response.size()) {
+			int n = send(client, response.data() + sent,
+				     (int)(response.size() - sent), SEND_FLAGS);
+			if (n <= 0) {
+				return;
+			}
+			sent += n;
+		}
+	}
+
+	socket_t listener_ = INVALID_SOCKET;
+	uint16_t port_ = 0;
+	std::atomic<bool> running_ = false;
+	std::thread thread_;
+	std::mutex lock_;
+	Clock::time_point lastRequest_;
+};
+
+// One timed download, shared with the Downloader's callbacks
+struct BenchRun {
+	std::string url;
+	std::mutex lock;
+	std::condition_variable cv;
+	bool done = false;
+	bool failed = false;
+	double firstByteMs = -1.0; // Negative if the entry wasn't found
+	Clock::time_point completed;
+};
+
+void benchProgress(void *data, bool finished, bool downloading, uint64_t,
+		   uint64_t, uint64_t)
+{
+	if (finished || downloading) {
+		return;
+	}
+	auto run = static_cast<BenchRun *>(data);
+	std::lock_guard l(run->lock);
+	run->failed = true;
+	run->done = true;
+	run->cv.notify_all();
+}
+
+void benchComplete(std::string, void *data)
+{
+	auto run = static_cast<BenchRun *>(data);
+	auto completed = Clock::now();
+	// The finished entry stays listed until its callbacks have returned.
+	// Its timings were taken by write_data as the first byte came in.
+	double firstByteMs = -1.0;
+	for (auto &entry : Downloader::getInstance("")->Enumerate()) {
+		if (entry.url == run->url) {
+			firstByteMs = entry.timings.enqueueToFirstByte * 1000.0;
+			break;
+		}
+	}
+	std::lock_guard l(run->lock);
+	run->completed = completed;
+	run->firstByteMs = firstByteMs;
+	run->done = true;
+	run->cv.notify_all();
+}
+
+double elapsedMs(Clock::time_point from, Clock::time_point to)
+{
+	return std::chrono::duration<double, std::milli>(to - from).count();
+}
+
+void report(const char *what, std::vector<double> ms)
+{
+	if (ms.empty()) {
+		return;
+	}
+	std::sort(ms.begin(), ms.end());
+	obs_log(LOG_INFO,
+		"Downloader benchmark: enqueue to %s: min %.2f ms, median %.2f ms, p90 %.2f ms, max %.2f ms (%zu downloads)",
+		what, ms.front(), ms[ms.size() / 2], ms[ms.size() * 9 / 10],
+		ms.back(), ms.size());
+}
+
+void benchmark()
+{
+	StandIn server;
+	if (!server.Start()) {
+		obs_log(LOG_WARNING,
+			"Downloader benchmark: could not start the local server");
+		return;
+	}
+
+	char *path = obs_module_config_path("bench/");
+	std::string dir = path;
+	bfree(path);
+	os_mkdirs(dir.c_str());
+
+	auto dl = Downloader::getInstance("");
+	// Different every run so nothing resumes or merges with an earlier one
+	auto tag = std::to_string(Clock::now().time_since_epoch().count());
+	std::string base = "http://127.0.0.1:" + std::to_string(server.Port()) +
+			   "/";
+
+	std::vector<double> toRequest, toFirstByte, toComplete;
+	for (int i = 0; i < BENCH_RUNS; ++i) {
+		std::this_thread::sleep_for(BENCH_IDLE);
+
+		if (benchStopping) {
+			break;
+		}
+
+		auto run = std::make_shared<BenchRun>();
+		std::string name = "bench-" + tag + "-" + std::to_string(i) +
+				   ".bin";
+		run->url = base + name;
+		DownloadOptions options;
+		options.priority = DownloadPriority::INTERACTIVE;
+		options.owner = run;
+
+		auto start = Clock::now();
+		auto entry = dl->Enqueue(run->url, dir + name, benchProgress,
+					 benchComplete, run.get(), options);
+
+		// Woken regularly so unloading the module doesn't wait out
+		// the timeout
+		std::unique_lock l(run->lock);
+		auto deadline = start + BENCH_TIMEOUT;
+		while (!run->done && !benchStopping &&
+		       Clock::now() < deadline) {
+			run->cv.wait_for(l, std::chrono::milliseconds(100));
+		}
+		if (!run->done || run->failed) {
+			l.unlock();
+			// Don't leave it retrying against a server that is
+			// about to go away
+			entry.Remove();
+			if (!benchStopping) {
+				obs_log(LOG_WARNING,
+					"Downloader benchmark: download %d %s",
+					i, run->done ? "failed" : "timed out");
+			}
+			break;
+		}
+		auto request = server.LastRequest();
+		if (request >= start) {
+			toRequest.push_back(elapsedMs(start, request));
+		}
+		if (run->firstByteMs >= 0.0) {
+			toFirstByte.push_back(run->firstByteMs);
+		}
+		toComplete.push_back(elapsedMs(start, run->completed));
+	}
+	server.Stop();
+
+	std::error_code ec;
+	std::filesystem::remove_all(std::filesystem::u8path(dir), ec);
+
+	report("request", toRequest);
+	report("first byte", toFirstByte);
+	report("complete", toComplete);
+}
+
+} // namespace
+
+void RunDownloaderBenchmark()
+{
+	std::lock_guard l(benchLock);
+	if (benchRunning) {
+		obs_log(LOG_INFO, "Downloader benchmark: already running");
+		return;
+	}
+	if (benchThread.joinable()) {
+		// The previous run, already finished
+		benchThread.join();
+	}
+	obs_log(LOG_INFO, "Downloader benchmark: %d downloads of %zu bytes",
+		BENCH_RUNS, BENCH_BODY_SIZE);
+	benchRunning = true;
+	benchStopping = false;
+	benchThread = std::thread([]() {
+		benchmark();
+		benchRunning = false;
+	});
+}
+
+void StopDownloaderBenchmark()
+{
+	std::lock_guard l(benchLock);
+	if (!benchThread.joinable()) {
+		return;
+	}
+	benchStopping = true;
+	benchThread.join();
+}
+
+} // namespace elgatocloud
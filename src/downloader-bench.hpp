@@ -0,0 +1,32 @@
+/*
+Elgato Deep-Linking OBS Plug-In
+Copyright (C) 2024 Corsair Memory Inc. oss.elgato@corsair.com
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program. If not, see <https://www.gnu.org/licenses/>
+*/
+
+#pragma once
+
+namespace elgatocloud {
+
+// Maker tool. Times downloads through the shared Downloader against a local
+// HTTP stand-in, from Enqueue to the request reaching the server, to the
+// first byte of the response and to completion. Runs on its own thread and
+// writes the results to the log.
+void RunDownloaderBenchmark();
+// Ends a running benchmark early and waits for its thread, before the
+// Downloader is shut down
+void StopDownloaderBenchmark();
+
+} // namespace elgatocloud
@@ -21,33 +21,245 @@ with this program. If not, see <https://www.gnu.org/licenses/>
 #include "util.h"
 #include <plugin-support.h>
 #include "elgato-product.hpp"
+#include <algorithm>
+#include <cmath>
 #include <cstring>
+#include <fstream>
 #include <curl/curl.h>
 #include <util/platform.h>
+#include <nlohmann/json.hpp>
 
 #include <QApplication>
 #include <QThread>
 #include <QMetaObject>
-// TODO: Hash file downloads for safe resumes
+#include <QByteArray>
 
 std::shared_ptr<Downloader> Downloader::instance{nullptr};
 std::mutex Downloader::lock;
 
+// Progress is journaled at most once per this many bytes
+#define JOURNAL_PROGRESS_INTERVAL (8 * 1024 * 1024)
+// Compact the journal once it has grown by this many records
+#define JOURNAL_COMPACT_RECORDS 4096
+// Speed sampling, segment and hash upkeep run this often while transfers are
+// running. When idle the worker only wakes for commands.
+#define WORKER_TICK_MS 250
+#define WORKER_IDLE_MS 60000
+// Progress callbacks are batched and sent at most this often per download
+#define PROGRESS_INTERVAL_MS 50
+// Segmented downloads: files smaller than SEGMENT_MIN_FILE use one connection.
+// Chunks are sized to take about SEGMENT_TARGET_SECONDS each, and connections
+// are added one per probe interval while throughput keeps improving.
+#define SEGMENT_MIN_FILE (32 * 1024 * 1024)
+#define SEGMENT_MIN_CHUNK (4 * 1024 * 1024)
+#define SEGMENT_MAX_CHUNK (64 * 1024 * 1024)
+#define SEGMENT_TARGET_SECONDS 4
+#define SEGMENT_INITIAL_CONNECTIONS 2
+#define SEGMENT_MAX_CONNECTIONS 8
+#define SEGMENT_PROBE_SECONDS 3
+// Waiting this long promotes a queued download by one priority class
+#define SCHEDULER_AGING_SECONDS 10
+// Transfer slots only interactive downloads may take
+#define SCHEDULER_INTERACTIVE_RESERVE 1
+// How often the bandwidth limit is redistributed between downloads, and the
+// least any download is given so it keeps moving
+#define BANDWIDTH_REBALANCE_MS 1000
+#define BANDWIDTH_MIN_RATE (16 * 1024)
+// Ranges that arrived ahead of the hashed prefix are read back from disk, at
+// most this much per worker tick
+#define HASH_CATCHUP_PER_TICK (16 * 1024 * 1024)
+#define HASH_READ_SIZE (1024 * 1024)
+// Write-behind: each segment hands its buffer to the I/O thread once it holds
+// WRITE_BUFFER_SIZE bytes. Transfers pause while more than WRITE_QUEUE_LIMIT
+// bytes wait for the disk and continue once it is back under
+// WRITE_QUEUE_RESUME.
+#define WRITE_BUFFER_SIZE (1024 * 1024)
+#define WRITE_QUEUE_LIMIT (64 * 1024 * 1024)
+#define WRITE_QUEUE_RESUME (16 * 1024 * 1024)
+// Failed attempts are retried after RETRY_BASE_MS, doubling up to
+// RETRY_MAX_MS, with jitter. Attempts that made progress reset the count.
+#define RETRY_MAX_ATTEMPTS 5
+#define RETRY_BASE_MS 1000
+#define RETRY_MAX_MS 60000
+// A download that had to start over continues as a single stream without
+// ranges. One that still keeps starting over (the server ignores ranges or
+// flips its validator) fails the attempt after this many restarts.
+#define RESTART_MAX 3
+// Threads finishing downloads: flushing, verifying, moving, callbacks
+#define COMPLETION_THREADS 2
+// Time constant of the smoothed download speed
+#define SPEED_SMOOTHING_SECONDS 3.0
+
+// Free space left over after a download and its extraction, for everything
+// else writing to the disk meanwhile
+#define PREFLIGHT_MARGIN (64 * 1024 * 1024)
+
+static const char *status_name(Downloader::Status status)
+{
+	switch (status) {
+	case Downloader::Status::QUEUED:
+		return "queued";
+	case Downloader::Status::ERRORED:
+		return "errored";
+	case Downloader::Status::STOPPED:
+		return "stopped";
+	case Downloader::Status::DOWNLOADING:
+		return "downloading";
+	case Downloader::Status::FINISHED:
+		return "finished";
+	case Downloader::Status::FAILED:
+		return "failed";
+	case Downloader::Status::SUSPENDED:
+		return "suspended";
+	}
+	return "failed";
+}
+
 size_t Downloader::DownloadEntry::write_data(void *ptr, size_t size,
 					     size_t nmemb, void *userdata)
 {
-	DownloadEntry &self = *static_cast<DownloadEntry *>(userdata);
+	// Hot path, runs for every chunk libcurl receives. Segment, buffer and
+	// hash state are only touched on the worker thread, so the entry lock
+	// is only taken once per response. Progress is picked up from the
+	// atomic counter by publishProgress(), and the disk is written from
+	// the I/O thread.
+	Segment &segment = *static_cast<Segment *>(userdata);
+	DownloadEntry &self = *segment.owner;
 	//Sleep(100);
-	std::unique_lock l(self.lock);
-	//if (!self.file) {
-	//	return 0;
-	//}
-	self.downloaded += nmemb;
-	if (self.progressCallback) {
-		self.progressCallback(self.callbackData, false, true,
-				      self.fileSize, nmemb, self.downloaded);
+	if (self.cancel.load(std::memory_order_relaxed) ||
+	    self.ioFailed.load(std::memory_order_relaxed)) {
+		return 0;
+	}
+	if (self.parent->ioQueuedBytes.load(std::memory_order_relaxed) >
+	    WRITE_QUEUE_LIMIT) {
+		// libcurl hands us the same data again once unpaused
+		segment.paused = true;
+		segment.pausedAt = std::chrono::steady_clock::now();
+		return CURL_WRITEFUNC_PAUSE;
+	}
+	if (!segment.bodyStarted) {
+		std::unique_lock l(self.lock);
+		segment.bodyStarted = true;
+		if (!self.beginBody(segment)) {
+			return 0;
+		}
+		if (self.timings.enqueueToFirstByte == 0.0) {
+			self.timings.enqueueToFirstByte =
+				std::chrono::duration<double>(
+					std::chrono::steady_clock::now() -
+					self.requestedAt)
+					.count();
+		}
+	}
+	size_t bytes = size * nmemb;
+	uint64_t offset = segment.begin + segment.written;
+	if (segment.buffer.empty()) {
+		segment.bufferOffset = offset;
+	}
+	auto data = static_cast<const char *>(ptr);
+	segment.buffer.insert(segment.buffer.end(), data, data + bytes);
+	// In-order bytes are hashed straight away, anything else is caught
+	// up from disk once the gap before it is filled.
+	if (offset == self.hasher.Size()) {
+		self.hasher.Update(ptr, bytes);
+	}
+	segment.written += bytes;
+	self.downloaded.fetch_add(bytes, std::memory_order_relaxed);
+	if (segment.buffer.size() >= WRITE_BUFFER_SIZE) {
+		self.flushSegment(segment);
+	}
+	return bytes;
+}
+
+// Called on the first body chunk of a segment, once all headers of the final
+// response are in. Decides whether the bytes that follow belong where the
+// segment will put them.
+bool Downloader::DownloadEntry::beginBody(Segment &segment)
+{
+	if (segment.responseCode >= 400) {
+		// An error page, not the file. SegmentDone() picks up the
+		// status.
+		return false;
+	}
+	std::string current = segment.responseEtag != ""
+				      ? segment.responseEtag
+				      : segment.responseLastModified;
+	bool ranged = segment.begin > 0 || segment.end != 0;
+	if (ranged && segment.responseCode != 206) {
+		// Range ignored, or If-Range failed because the object
+		// changed. Either way we're receiving the full file.
+		if (segments.size() > 1) {
+			// Other segments hold ranges of the old object
+			obs_log(LOG_WARNING,
+				"Server stopped honoring ranges for %s, restarting download",
+				tmpTargetName.c_str());
+			restart = true;
+			return false;
+		}
+		if (resumeOffset > 0) {
+			obs_log(LOG_INFO,
+				"Server did not resume %s, restarting download",
+				tmpTargetName.c_str());
+		}
+		if (!truncatePartial(segment)) {
+			return false;
+		}
+	} else if (ranged && current != "" && validator != "" &&
+		   current != validator) {
+		// A range of a different object, can't splice it in.
+		obs_log(LOG_WARNING,
+			"Validator changed for %s, restarting download",
+			tmpTargetName.c_str());
+		restart = true;
+		return false;
+	}
+	if (segment.responseCode == 206) {
+		rangesConfirmed = true;
+	}
+	if (segment.responseDigest != "") {
+		announcedSha256 = segment.responseDigest;
+	}
+	fetched.etag = segment.responseEtag;
+	fetched.lastModified = segment.responseLastModified;
+	fetched.maxAge = segment.responseMaxAge;
+	// Ranged responses that omit the validator keep the one we have
+	if (segment.responseCode != 206 || current != "") {
+		validator = current;
+	}
+	// Reserve the whole file up front so parallel segments don't
+	// fragment it
+	if (!preflight()) {
+		// Nothing written yet, the worker suspends the entry
+		suspendRequested = true;
+		return false;
+	}
+	if (fileSize != 0 && fileSize != preallocatedSize) {
+		preallocatedSize = fileSize;
+		parent->submitIo({IoType::PREALLOCATE, this, file, fileSize, {}});
+	}
+	parent->journal(journalRecord());
+	return true;
+}
+
+// The server is sending the whole object, drop everything written so far and
+// continue as a single stream from the start.
+bool Downloader::DownloadEntry::truncatePartial(Segment &segment)
+{
+	drainIo();
+	if (!truncate_file(file, 0)) {
+		return false;
 	}
-	return fwrite(ptr, size, nmemb, self.file);
+	reportRange(RangeEvent::TRUNCATED, 0, 0);
+	downloaded = 0;
+	resumeOffset = 0;
+	completedRanges.clear();
+	hasher.Reset();
+	segment.begin = 0;
+	segment.end = 0;
+	segment.written = 0;
+	segmentable = false;
+	preallocatedSize = 0;
+	return true;
 }
 
 bool Downloader::DownloadEntry::handleContentDisposition(
@@ -80,26 +292,128 @@ bool Downloader::DownloadEntry::handleContentDisposition(
 	return true;
 }
 bool Downloader::DownloadEntry::handleContentLength(
-	const std::string &headerData)
+	Segment &segment, const std::string &headerData)
 {
 	auto size = std::atoll(headerData.c_str());
 	if (size < 0) {
 		return false;
 	}
-	fileSize = (size_t)size;
+	// A partial response only reports the length of its range, the total
+	// comes from Content-Range. Other segments may still be mid-redirect,
+	// so only final responses get to set the size.
+	if (segment.responseCode == 200) {
+		fileSize = (uint64_t)size;
+	} else if (segment.responseCode == 206 && segment.end == 0 &&
+		   fileSize == 0) {
+		fileSize = segment.begin + (uint64_t)size;
+	}
+	return true;
+}
+
+bool Downloader::DownloadEntry::handleContentRange(
+	const std::string &headerData)
+{
+	// e.g. "bytes 1000-4999/5000", total may be "*" if unknown
+	auto slashPos = headerData.find_last_of('/');
+	if (slashPos == std::string::npos || slashPos + 1 >= headerData.size() ||
+	    headerData[slashPos + 1] == '*') {
+		return false;
+	}
+	auto size = std::atoll(headerData.c_str() + slashPos + 1);
+	if (size <= 0) {
+		return false;
+	}
+	fileSize = (uint64_t)size;
+	return true;
+}
+
+// "Repr-Digest: sha-256=:<base64>:" describes the whole file even on partial
+// responses. The older "Digest: SHA-256=<base64>" is only trusted on a 200.
+bool Downloader::DownloadEntry::handleDigest(Segment &segment,
+					     const std::string &headerName,
+					     const std::string &headerData)
+{
+	if (headerName == "digest" && segment.responseCode != 200) {
+		return false;
+	}
+	std::string lower = headerData;
+	for (auto &c : lower) {
+		c = (char)tolower(c);
+	}
+	auto start = lower.find("sha-256=");
+	if (start == std::string::npos) {
+		return false;
+	}
+	start += 8;
+	auto end = headerData.find(',', start);
+	std::string value = headerData.substr(start, end == std::string::npos
+							     ? std::string::npos
+							     : end - start);
+	value.erase(std::remove_if(value.begin(), value.end(),
+				   [](char c) {
+					   return c == ':' || c == ' ' ||
+						  c == '\t';
+				   }),
+		    value.end());
+	auto digest = QByteArray::fromBase64(QByteArray::fromStdString(value));
+	if (digest.size() != 32) {
+		return false;
+	}
+	segment.responseDigest = digest.toHex().toStdString();
+	return true;
+}
+
+bool Downloader::DownloadEntry::handleStatusLine(Segment &segment,
+						 const std::string &headerLine)
+{
+	// e.g. "HTTP/1.1 206 Partial Content". Each response (redirects,
+	// 100-continue) starts with one, so reset per-response state here.
+	auto spacePos = headerLine.find_first_of(' ');
+	if (spacePos == std::string::npos) {
+		return false;
+	}
+	segment.responseCode = std::atol(headerLine.c_str() + spacePos + 1);
+	segment.responseEtag = "";
+	segment.responseLastModified = "";
+	segment.responseDigest = "";
+	segment.responseMaxAge = -1;
 	return true;
 }
 
+// Seconds a response may be reused for, from its Cache-Control header. -1 if
+// it doesn't say.
+static int64_t parse_max_age(const std::string &cacheControl)
+{
+	std::string value = cacheControl;
+	for (auto &c : value) {
+		c = (char)tolower(c);
+	}
+	if (value.find("no-cache") != std::string::npos ||
+	    value.find("no-store") != std::string::npos) {
+		return 0;
+	}
+	auto pos = value.find("max-age=");
+	if (pos == std::string::npos) {
+		return -1;
+	}
+	return std::atoll(value.c_str() + pos + 8);
+}
+
 size_t Downloader::DownloadEntry::handle_header(void *ptr, size_t size,
 						size_t nmemb, void *userdata)
 {
 	// Grab the filename sent from the server
 	// TODO: support extended tags? e.g. explicitly marked UTF-8?
 
-	DownloadEntry &self = *static_cast<DownloadEntry *>(userdata);
+	Segment &segment = *static_cast<Segment *>(userdata);
+	DownloadEntry &self = *segment.owner;
 	std::unique_lock l(self.lock);
 
 	std::string headerLine = std::string((char *)ptr, size * nmemb);
+	if (headerLine.rfind("HTTP/", 0) == 0) {
+		self.handleStatusLine(segment, headerLine);
+		return size * nmemb;
+	}
 	auto breakPos = headerLine.find_first_of(':');
 	if (breakPos == std::string::npos) {
 		return size * nmemb;
@@ -107,7 +421,12 @@ size_t Downloader::DownloadEntry::handle_header(void *ptr, size_t size,
 
 	auto headerName = headerLine.substr(0, breakPos);
 	breakPos = headerLine.find_first_not_of(" \t\n\r", breakPos + 1);
+	if (breakPos == std::string::npos) {
+		return size * nmemb;
+	}
 	auto headerContent = headerLine.substr(breakPos);
+	auto endPos = headerContent.find_last_not_of(" \t\n\r");
+	headerContent.resize(endPos + 1);
 
 	for (auto &c : headerName) {
 		c = (char)tolower(c);
@@ -117,7 +436,17 @@ size_t Downloader::DownloadEntry::handle_header(void *ptr, size_t size,
 	if (headerName == "content-disposition") {
 		result = self.handleContentDisposition(headerContent);
 	} else if (headerName == "content-length") {
-		result = self.handleContentLength(headerContent);
+		result = self.handleContentLength(segment, headerContent);
+	} else if (headerName == "content-range") {
+		result = self.handleContentRange(headerContent);
+	} else if (headerName == "etag") {
+		segment.responseEtag = headerContent;
+	} else if (headerName == "last-modified") {
+		segment.responseLastModified = headerContent;
+	} else if (headerName == "cache-control") {
+		segment.responseMaxAge = parse_max_age(headerContent);
+	} else if (headerName == "repr-digest" || headerName == "digest") {
+		result = self.handleDigest(segment, headerName, headerContent);
 	}
 
 	return size * nmemb;
@@ -128,49 +457,66 @@ size_t Downloader::DownloadEntry::handle_progress(void *ptr, curl_off_t dltotal,
 						  curl_off_t ultotal,
 						  curl_off_t ulnow)
 {
-	DownloadEntry &self = *static_cast<DownloadEntry *>(ptr);
-	std::unique_lock l(self.lock);
+	DownloadEntry &self = *static_cast<Segment *>(ptr)->owner;
 	UNUSED_PARAMETER(dltotal);
 	UNUSED_PARAMETER(dlnow);
 	UNUSED_PARAMETER(ultotal);
 	UNUSED_PARAMETER(ulnow);
 	//double pct = (int)((double)dlnow / (double)dltotal * 100.0);
-	return self.cancel;
+	return self.cancel.load(std::memory_order_relaxed);
 }
 
-Downloader::DownloadEntry::DownloadEntry(Downloader* parent, std::string url,
+Downloader::DownloadEntry::DownloadEntry(Downloader* parent, size_t id, std::string url,
 	std::string targetPath,
 	ProgressCallbackFn pc,
 	CompleteCallbackFn cc,
-	void* callbackDat)
-	: url(url),
+	void* callbackDat,
+	const DownloadOptions &options)
+	: id(id),
+	url(url),
+	targetPath(targetPath),
+	options(options),
 	file(nullptr),
-	fileSize(0),
+	fileSize(options.expectedSize),
 	downloaded(0),
+	publishedBytes(0),
+	resumeOffset(0),
+	restart(false),
+	notModified(false),
+	httpStatus(0),
+	attempts(0),
+	restarts(0),
+	attemptBytes(0),
+	preflightConfirmed(false),
+	suspendRequested(false),
+	preflightNeeded(0),
+	preflightAvailable(0),
+	journaledBytes(0),
+	requestedAt(std::chrono::steady_clock::now()),
+	allotment(0),
+	rateLimit(0),
+	rateSampleBytes(0),
+	speed(0.0),
+	speedSampleBytes(0),
 	status(Downloader::Status::QUEUED),
-	references(0),
 	removed(false),
+	segmentable(false),
+	rangesConfirmed(false),
+	preallocatedSize(0),
+	pendingIo(0),
+	ioFailed(false),
+	nextOffset(0),
+	chunkSize(SEGMENT_MIN_CHUNK),
+	connections(1),
+	probing(false),
+	probeRate(0.0),
+	probeBytes(0),
 	progressCallback(pc),
 	completeCallback(cc),
 	callbackData(callbackDat),
 	parent(parent),
 	cancel(0)
 {
-	handle = curl_easy_init();
-	curl_easy_setopt(handle, CURLOPT_URL, url.c_str());
-	curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, write_data);
-	curl_easy_setopt(handle, CURLOPT_WRITEDATA, static_cast<void*>(this));
-	curl_easy_setopt(handle, CURLOPT_XFERINFOFUNCTION, handle_progress);
-	curl_easy_setopt(handle, CURLOPT_XFERINFODATA, static_cast<void*>(this));
-	curl_easy_setopt(handle, CURLOPT_NOPROGRESS, 0L);
-	curl_easy_setopt(handle, CURLOPT_USERAGENT, "elgato-cloud 0.0");
-	curl_easy_setopt(handle, CURLOPT_HEADERFUNCTION, handle_header);
-	curl_easy_setopt(handle, CURLOPT_HEADERDATA, static_cast<void *>(this));
-	curl_easy_setopt(handle, CURLOPT_PRIVATE, static_cast<void *>(this));
-
-	file = open_tmp_file("wb", tmpTargetName);
-	status = Downloader::Status::DOWNLOADING;
-
 	if (!targetPath.empty()) {
 		auto slashPos = targetPath.find_last_of("\\/");
 		if (slashPos != std::string::npos) {
@@ -202,305 +548,2280 @@ Downloader::DownloadEntry::DownloadEntry(Downloader* parent, std::string url,
 			detectedFileName = url.substr(start, count);
 		}
 	}
+}
 
-	curl_multi_add_handle(parent->handle, handle);
+Downloader::DownloadEntry::DownloadEntry(Downloader *parent, size_t id)
+	: id(id),
+	  file(nullptr),
+	  fileSize(0),
+	  downloaded(0),
+	  publishedBytes(0),
+	  resumeOffset(0),
+	  restart(false),
+	  notModified(false),
+	  httpStatus(0),
+	  attempts(0),
+	  restarts(0),
+	  attemptBytes(0),
+	  preflightConfirmed(false),
+	  suspendRequested(false),
+	  preflightNeeded(0),
+	  preflightAvailable(0),
+	  journaledBytes(0),
+	  allotment(0),
+	  rateLimit(0),
+	  rateSampleBytes(0),
+	  speed(0.0),
+	  speedSampleBytes(0),
+	  status(Downloader::Status::STOPPED),
+	  removed(false),
+	  segmentable(false),
+	  rangesConfirmed(false),
+	  preallocatedSize(0),
+	  pendingIo(0),
+	  ioFailed(false),
+	  nextOffset(0),
+	  chunkSize(SEGMENT_MIN_CHUNK),
+	  connections(1),
+	  probing(false),
+	  probeRate(0.0),
+	  probeBytes(0),
+	  parent(parent),
+	  progressCallback(nullptr),
+	  completeCallback(nullptr),
+	  cancel(0),
+	  callbackData(nullptr)
+{
 }
 
 Downloader::DownloadEntry::~DownloadEntry()
 {
 
 	std::unique_lock l(lock);
-	if (status == Status::DOWNLOADING) {
-		curl_multi_remove_handle(parent->handle, handle);
-		curl_easy_cleanup(handle);
+	releaseSegments();
+	drainIo();
+	if (file) {
+		fclose(file);
+	}
+	// Partial files are kept for resuming unless the entry was removed
+	if (removed && status != Status::FINISHED) {
+		os_unlink(tmpTargetName.c_str());
 	}
 }
 
-void Downloader::DownloadEntry::Finish()
+void Downloader::DownloadEntry::addSegment(uint64_t begin, uint64_t end)
 {
-	std::unique_lock l(lock);
-	status = status == Status::STOPPED ? Status::STOPPED : Status::FINISHED;
-	curl_multi_remove_handle(parent->handle, handle);
-	curl_easy_cleanup(handle);
-	fclose(file);
+	auto segment = std::make_unique<Segment>();
+	segment->owner = this;
+	segment->begin = begin;
+	segment->end = end;
+	segments.push_back(std::move(segment));
+	startSegment(*segments.back());
+}
 
-	if (status == Status::STOPPED) { // User cancelled the download
-		os_unlink(tmpTargetName.c_str());
-		return;
+// (Re)issues the request for the segment's range. The easy handle is reused
+// between chunks so the connection stays warm. Ranges past the start of an
+// object are conditional on it still matching the validator we've seen.
+void Downloader::DownloadEntry::startSegment(Segment &segment)
+{
+	if (segment.handle) {
+		curl_multi_remove_handle(parent->handle, segment.handle);
+	} else {
+		segment.handle = curl_easy_init();
+		void *data = static_cast<void *>(&segment);
+		// DNS and TLS sessions are shared with the API requests
+		curl_easy_setopt(segment.handle, CURLOPT_SHARE,
+				 get_curl_share());
+		curl_easy_setopt(segment.handle, CURLOPT_WRITEFUNCTION,
+				 write_data);
+		curl_easy_setopt(segment.handle, CURLOPT_WRITEDATA, data);
+		curl_easy_setopt(segment.handle, CURLOPT_XFERINFOFUNCTION,
+				 handle_progress);
+		curl_easy_setopt(segment.handle, CURLOPT_XFERINFODATA, data);
+		curl_easy_setopt(segment.handle, CURLOPT_NOPROGRESS, 0L);
+		curl_easy_setopt(segment.handle, CURLOPT_USERAGENT,
+				 "elgato-cloud 0.0");
+		curl_easy_setopt(segment.handle, CURLOPT_HEADERFUNCTION,
+				 handle_header);
+		curl_easy_setopt(segment.handle, CURLOPT_HEADERDATA, data);
+		curl_easy_setopt(segment.handle, CURLOPT_PRIVATE, data);
 	}
+	curl_easy_setopt(segment.handle, CURLOPT_URL, url.c_str());
 
-	if (fileName == "") {
-		fileName = detectedFileName;
+	if (segment.headers) {
+		curl_slist_free_all(segment.headers);
+		segment.headers = nullptr;
 	}
-
-	if (targetDirectory != "") {
-		if (fileName == "") {
-			fileName = random_name();
-		}
-		std::string target = targetDirectory + fileName;
-		obs_log(LOG_INFO, "donwloader target: %s", target.c_str());
-#ifdef WIN32
-		char *absPath = os_get_abs_path_ptr(target.c_str());
-		target = std::string(absPath, strlen(absPath));
-		bfree(absPath);
-#endif
-		parent->moveRequests.push_back(
-			{tmpTargetName, target.c_str(), callbackData, completeCallback});
+	std::string range;
+	if (segment.end != 0) {
+		range = std::to_string(segment.begin) + "-" +
+			std::to_string(segment.end - 1);
+	} else if (segment.begin > 0) {
+		range = std::to_string(segment.begin) + "-";
 	}
-	if (progressCallback) {
-		progressCallback(callbackData, true, false, fileSize, 0,
-				 fileSize);
+	if (range != "" && validator != "") {
+		std::string ifRange = "If-Range: " + validator;
+		segment.headers =
+			curl_slist_append(segment.headers, ifRange.c_str());
+	}
+	if (range == "" && cached.etag != "") {
+		std::string ifNoneMatch = "If-None-Match: " + cached.etag;
+		segment.headers = curl_slist_append(segment.headers,
+						    ifNoneMatch.c_str());
 	}
+	if (range == "" && cached.lastModified != "") {
+		std::string ifModifiedSince =
+			"If-Modified-Since: " + cached.lastModified;
+		segment.headers = curl_slist_append(segment.headers,
+						    ifModifiedSince.c_str());
+	}
+	curl_easy_setopt(segment.handle, CURLOPT_HTTPHEADER, segment.headers);
+	curl_easy_setopt(segment.handle, CURLOPT_RANGE,
+			 range != "" ? range.c_str() : nullptr);
+	curl_easy_setopt(segment.handle, CURLOPT_MAX_RECV_SPEED_LARGE,
+			 (curl_off_t)rateLimit);
+
+	segment.written = 0;
+	segment.responseCode = 0;
+	segment.responseEtag = "";
+	segment.responseLastModified = "";
+	segment.responseDigest = "";
+	segment.responseMaxAge = -1;
+	segment.bodyStarted = false;
+	segment.paused = false;
+	segment.started = std::chrono::steady_clock::now();
+	curl_multi_add_handle(parent->handle, segment.handle);
 }
-void Downloader::DownloadEntry::updateDownloadedHistory()
+
+void Downloader::DownloadEntry::removeSegment(Segment *segment)
 {
-	std::unique_lock l(lock);
-	auto threshold =
-		std::chrono::steady_clock::now() - std::chrono::seconds(5);
-	while (downloadedHistory.size() > 4 &&
-	       downloadedHistory.front().first < threshold) {
-		downloadedHistory.pop_front();
+	flushSegment(*segment);
+	curl_multi_remove_handle(parent->handle, segment->handle);
+	curl_easy_cleanup(segment->handle);
+	if (segment->headers) {
+		curl_slist_free_all(segment->headers);
 	}
-	downloadedHistory.push_back(
-		{std::chrono::steady_clock::now(), downloaded});
+	segments.erase(std::remove_if(segments.begin(), segments.end(),
+				      [segment](auto &s) {
+					      return s.get() == segment;
+				      }),
+		       segments.end());
 }
 
-void Downloader::loadConfig()
+// Stops all transfers, passing on whatever they received. The bytes count as
+// completed once the I/O thread has written them.
+void Downloader::DownloadEntry::releaseSegments()
 {
-	// TODO: Implement
+	for (auto &segment : segments) {
+		flushSegment(*segment);
+		curl_multi_remove_handle(parent->handle, segment->handle);
+		curl_easy_cleanup(segment->handle);
+		if (segment->headers) {
+			curl_slist_free_all(segment->headers);
+		}
+	}
+	segments.clear();
 }
-void Downloader::dumpConfig()
+
+// Queues the segment's buffered bytes for writing
+void Downloader::DownloadEntry::flushSegment(Segment &segment)
 {
-	// TODO: Implement
+	if (segment.buffer.empty()) {
+		return;
+	}
+	parent->submitIo({IoType::WRITE, this, file, segment.bufferOffset,
+			  std::move(segment.buffer)});
+	segment.buffer.clear();
+	segment.buffer.reserve(WRITE_BUFFER_SIZE);
 }
-Downloader::Downloader(std::string configLocation)
-	: idCounter(1),
-	  concurrentLimit(10),
-	  configLocation(configLocation),
-	  working(true)
+
+// Waits for this entry's queued I/O and applies the results. Call with the
+// entry lock held, before the file is truncated, closed or handed on.
+void Downloader::DownloadEntry::drainIo()
 {
-	loadConfig();
-	handle = curl_multi_init();
-	workerThread = std::thread{&Downloader::workerJob, this};
+	parent->waitForIo(this);
+	std::vector<IoResult> results;
+	{
+		std::unique_lock l(parent->ioLock);
+		auto &all = parent->ioResults;
+		auto mine = std::stable_partition(
+			all.begin(), all.end(),
+			[this](const IoResult &r) { return r.entry != this; });
+		results.assign(mine, all.end());
+		all.erase(mine, all.end());
+	}
+	for (auto &result : results) {
+		markCompleted(result.offset, result.offset + result.size);
+	}
 }
-Downloader::~Downloader()
-{
-	std::unique_lock lockerA(lock);
-	working = false;
-	lockerA.unlock();
 
-	workerThread.join();
-
-	curl_multi_cleanup(handle);
+// Hands out the next range to fetch, or an empty range when everything has
+// been assigned. The tail is split so the last connections finish together.
+std::pair<uint64_t, uint64_t> Downloader::DownloadEntry::nextChunk()
+{
+	if (fileSize == 0 || nextOffset >= fileSize) {
+		return {0, 0};
+	}
+	uint64_t remaining = fileSize - nextOffset;
+	uint64_t size = std::min(
+		chunkSize, std::max(remaining / connections,
+				    (uint64_t)SEGMENT_MIN_CHUNK));
+	size = std::min(size, remaining);
+	std::pair<uint64_t, uint64_t> range = {nextOffset, nextOffset + size};
+	nextOffset += size;
+	return range;
 }
 
-std::shared_ptr<Downloader> Downloader::getInstance(std::string configLocation)
+void Downloader::DownloadEntry::markCompleted(uint64_t first, uint64_t last)
 {
-	std::lock_guard<std::mutex> l(lock);
-	if (instance == nullptr) {
-		std::shared_ptr<Downloader> newInstance(
-			new Downloader(configLocation));
-		newInstance.swap(instance);
+	if (last <= first) {
+		return;
 	}
-	return instance;
+	reportRange(RangeEvent::WRITTEN, first, last);
+	auto iter = completedRanges.upper_bound(first);
+	if (iter != completedRanges.begin()) {
+		auto prev = std::prev(iter);
+		if (prev->second >= first) {
+			first = prev->first;
+			last = std::max(last, prev->second);
+			completedRanges.erase(prev);
+		}
+	}
+	while (iter != completedRanges.end() && iter->first <= last) {
+		last = std::max(last, iter->second);
+		iter = completedRanges.erase(iter);
+	}
+	completedRanges[first] = last;
 }
 
-Downloader::Entry Downloader::Enqueue(std::string url, std::string targetPath,
-				      ProgressCallbackFn pc, CompleteCallbackFn cc, void *callbackDat)
+void Downloader::DownloadEntry::reportRange(RangeEvent event, uint64_t begin,
+					   uint64_t end)
 {
-	std::unique_lock l(lock);
-
-	auto dlentry = std::make_shared<DownloadEntry>(this, url, targetPath,
-						       pc, cc, callbackDat);
-	auto result = queue.emplace(idCounter++, dlentry);
-	if (result.first == queue.end() || result.second == false) {
-		throw "TODO";
+	if (options.rangeCallback) {
+		options.rangeCallback(callbackData, event, tmpTargetName, begin,
+				      end);
 	}
-
-	Entry e{};
-	e.id = result.first->first;
-	e.parent = this;
-	fillEntry(e, *result.first->second);
-	result.first->second->references++;
-	l.unlock();
-	return e;
 }
-Downloader::Entry Downloader::Lookup(size_t id)
+
+// Length of the gap-free prefix of the temp file, the part a later resume can
+// trust.
+uint64_t Downloader::DownloadEntry::contiguousOffset() const
 {
-	std::unique_lock l(lock);
-	auto dle = queue.find(id);
-	Entry result{};
-	if (dle != queue.end()) {
-		if (dle->second->removed) {
-			return result;
+	uint64_t offset = 0;
+	for (auto &[first, last] : completedRanges) {
+		if (first > offset) {
+			break;
 		}
-		fillEntry(result, *dle->second);
-		dle->second->references++;
+		offset = std::max(offset, last);
 	}
-	l.unlock();
-	return result;
+	return offset;
 }
-std::vector<Downloader::Entry> Downloader::Enumerate(size_t limit)
-{
 
-	std::unique_lock l(lock);
-	std::vector<Entry> result;
-	for (auto &e : queue) {
-		if (e.second->removed) {
+// Partial downloads are staged next to their target, so finishing one is a
+// rename on the same volume rather than a copy out of the temp directory.
+// Returns nullptr if the directory isn't writable.
+static FILE *open_staging_file(const std::string &directory,
+			       const std::string &name,
+			       std::string &outFilename)
+{
+	std::string safe;
+	if (name == "" || !generate_safe_path(name, safe)) {
+		safe = "download";
+	}
+	for (int tries = 0; tries < 20; ++tries) {
+		std::string path =
+			directory + safe + "-" + random_name() + ".part";
+		if (os_file_exists(path.c_str())) {
 			continue;
 		}
-		result.push_back({});
-		auto &entry = result.back();
-		entry.id = e.first;
-		entry.parent = this;
-		fillEntry(entry, *e.second);
-		e.second->references++;
-		if (limit-- == 0) {
-			break;
+		FILE *file = os_fopen(path.c_str(), "w+b");
+		if (file) {
+			outFilename = path;
 		}
+		return file;
 	}
-	l.unlock();
-	return result;
+	return nullptr;
 }
 
-void Downloader::workerJob()
+// Starts or reissues the transfer. Bytes already in the temp file are kept as
+// long as we know which object they came from, otherwise the download starts
+// over. Worker thread only.
+bool Downloader::DownloadEntry::Resume(const std::string &newUrl)
 {
-	int active_transfers;
-	do {
-		curl_multi_wait(handle, NULL, 0, 1000, NULL);
-		curl_multi_perform(handle, &active_transfers);
-		std::unique_lock l(lock);
-		for (auto &entry : queue) {
-			entry.second->updateDownloadedHistory();
+	std::unique_lock l(lock);
+	if (!newUrl.empty()) {
+		url = newUrl;
+	}
+	releaseSegments();
+	drainIo();
+	if (file) {
+		fclose(file);
+		file = nullptr;
+	}
+	ioFailed = false;
+	preallocatedSize = 0;
+
+	// Positioned writes, so never open in append mode
+	resumeOffset = 0;
+	if (tmpTargetName == "") {
+		if (targetDirectory != "") {
+			file = open_staging_file(
+				targetDirectory,
+				fileName != "" ? fileName : detectedFileName,
+				tmpTargetName);
 		}
-		int msgs = 0;
-		CURLMsg *msg = nullptr;
-		while (true) {
-			msg = curl_multi_info_read(handle, &msgs);
-			if (!msg) {
-				break;
-			}
-			if (msg->msg == CURLMSG_DONE) {
-				void *info;
-				curl_easy_getinfo(msg->easy_handle,
-						  CURLINFO_PRIVATE, &info);
-				if (info == nullptr) {
-					continue;
-				}
-				DownloadEntry &dle = *(DownloadEntry *)info;
-				dle.Finish();
-			}
+		if (!file) {
+			file = open_tmp_file("w+b", tmpTargetName);
 		}
-		auto newMoveRequests = std::move(moveRequests);
-		l.unlock();
-		for (auto &mr : newMoveRequests) {
-			std::string file = move_file_safe(mr.first, mr.second);
-			auto pos = file.rfind(".");
-			if (pos != std::string::npos &&
-			    file.substr(pos + 1) == "elgatoscene") {
-				QMetaObject::invokeMethod(
-					QCoreApplication::instance()->thread(),
-					[file, mr]() {
-						elgatocloud::ElgatoProduct::
-							Install(file, mr.data,
-								true);
-					});
-			} else {
-				// We are downloading a thumbnail.
-				if (mr.callback) {
-					mr.callback(file, mr.data);
-				}
-			}
+	} else {
+		if (!restart && validator != "") {
+			auto size = os_get_file_size(tmpTargetName.c_str());
+			resumeOffset = size > 0 ? (uint64_t)size : 0;
 		}
-	} while (working);
-}
+		file = os_fopen(tmpTargetName.c_str(),
+				resumeOffset > 0 ? "r+b" : "w+b");
+	}
+	if (resumeOffset == 0) {
+		validator = "";
+		announcedSha256 = "";
+	}
+	if (hasher.Size() > resumeOffset) {
+		hasher.Reset();
+	}
+	verification = "";
+	if (!file) {
+		obs_log(LOG_ERROR, "Could not open download file %s",
+			tmpTargetName.c_str());
+		status = Status::FAILED;
+		return false;
+	}
+	if (resumeOffset > 0) {
+		obs_log(LOG_INFO, "Resuming %s at %llu bytes",
+			tmpTargetName.c_str(),
+			(unsigned long long)resumeOffset);
+	}
+	downloaded = resumeOffset;
+	publishedBytes = resumeOffset;
+	journaledBytes = resumeOffset;
+	completedRanges.clear();
+	reportRange(RangeEvent::TRUNCATED, resumeOffset, 0);
+	markCompleted(0, resumeOffset);
+	cancel = 0;
+	restart = false;
+	httpStatus = 0;
+	status = Status::DOWNLOADING;
+	notModified = false;
+	cached = CacheMetadata();
+	fetched = CacheMetadata();
+	if (options.revalidate && resumeOffset == 0 && fileName != "") {
+		std::string target = targetDirectory + fileName;
+		if (os_file_exists(target.c_str())) {
+			loadCacheMetadata(target, cached);
+		}
+	}
 
-void Downloader::fillEntry(Downloader::Entry &dst,
-			   Downloader::DownloadEntry &src)
-{
-	dst.fileName = src.fileName;
-	dst.url = src.url;
-	dst.fileSize = src.fileSize;
-	dst.downloaded = src.downloaded;
-	dst.status = src.status;
-	dst.parent = src.parent;
+	// Large files start with one ranged request. Once the server has
+	// shown it honors ranges, Rebalance() opens more connections.
+	segmentable = options.segmented && restarts == 0 &&
+		      (fileSize == 0 ||
+		       fileSize >= resumeOffset + SEGMENT_MIN_FILE);
+	rangesConfirmed = false;
+	chunkSize = SEGMENT_MIN_CHUNK;
+	connections = SEGMENT_INITIAL_CONNECTIONS;
+	probing = true;
+	probeRate = 0.0;
+	probeBytes = downloaded;
+	probeStart = std::chrono::steady_clock::now();
+	nextOffset = resumeOffset;
+	speed = 0.0;
+	speedSampleBytes = resumeOffset;
+	speedSampleTime = probeStart;
 
-	if (src.downloadedHistory.size() > 1) {
-		auto first = src.downloadedHistory.front();
-		auto last = src.downloadedHistory.back();
-		auto interval =
-			std::chrono::duration_cast<std::chrono::seconds>(
-				last.first - first.first)
-				.count();
-		auto bytesDownloaded = last.second - first.second;
-		dst.speedBps = interval != 0 ? bytesDownloaded / interval : 0;
+	parent->journal(journalRecord());
+	if (segmentable) {
+		nextOffset += chunkSize;
+		addSegment(resumeOffset, nextOffset);
+	} else {
+		addSegment(resumeOffset, 0);
 	}
+	return true;
 }
 
-void Downloader::Entry::Update()
+// Worker thread only. A failed segment fails the whole attempt, the bytes that
+// did arrive are kept for the next resume.
+bool Downloader::DownloadEntry::SegmentDone(Segment *segment, CURLcode result,
+					    CURLcode &entryResult)
 {
-	std::unique_lock l(parent->lock);
-	auto dle = parent->queue.find(id);
-	if (dle != parent->queue.end()) {
-		parent->fillEntry(*this, *dle->second);
+	std::unique_lock l(lock);
+	flushSegment(*segment);
+	recordTimings(*segment);
+	entryResult = result;
+	long code = 0;
+	curl_easy_getinfo(segment->handle, CURLINFO_RESPONSE_CODE, &code);
+	if (code == 416 && segment->begin > 0) {
+		// The range is past the end, the object must have shrunk
+		obs_log(LOG_WARNING,
+			"Range not satisfiable for %s, restarting download",
+			tmpTargetName.c_str());
+		restart = true;
+	} else if (code >= 400) {
+		httpStatus = code;
+		entryResult = CURLE_HTTP_RETURNED_ERROR;
+	} else if (code == 304 && options.revalidate) {
+		// Validators may be left out of a 304, the old ones still hold
+		notModified = true;
+		fetched.etag = segment->responseEtag != "" ? segment->responseEtag
+							   : cached.etag;
+		fetched.lastModified = segment->responseLastModified != ""
+					       ? segment->responseLastModified
+					       : cached.lastModified;
+		fetched.maxAge = segment->responseMaxAge;
+	}
+	if (restart || entryResult != CURLE_OK) {
+		return true;
+	}
+	if (segment->end == 0) {
+		// Single stream, the transfer ending means the file is done
+		removeSegment(segment);
+		return segments.empty();
+	}
+
+	uint64_t reached = segment->begin + segment->written;
+	if (fileSize == 0) {
+		// No total in Content-Range, read the rest in one go
+		segmentable = false;
+		segment->begin = reached;
+		segment->end = 0;
+		startSegment(*segment);
+		return false;
+	}
+	uint64_t last = std::min(segment->end, fileSize);
+	if (reached < last) {
+		if (segment->written == 0) {
+			entryResult = CURLE_PARTIAL_FILE;
+			return true;
+		}
+		// Short response, fetch what's missing
+		segment->begin = reached;
+		segment->end = last;
+		startSegment(*segment);
+		return false;
+	}
+
+	// Size chunks so each request runs for a few seconds at the rate this
+	// connection just achieved.
+	double seconds = std::chrono::duration<double>(
+				 std::chrono::steady_clock::now() -
+				 segment->started)
+				 .count();
+	if (seconds > 0.1) {
+		double target = (double)segment->written / seconds *
+				SEGMENT_TARGET_SECONDS;
+		chunkSize = std::clamp((uint64_t)target,
+				       (uint64_t)SEGMENT_MIN_CHUNK,
+				       (uint64_t)SEGMENT_MAX_CHUNK);
+	}
+
+	if (segmentable && segments.size() <= connections) {
+		auto range = nextChunk();
+		if (range.second != 0) {
+			segment->begin = range.first;
+			segment->end = range.second;
+			startSegment(*segment);
+			return false;
+		}
 	}
+	removeSegment(segment);
+	return segments.empty();
 }
 
-void Downloader::Entry::Stop()
+// Worker tick. Opens more connections while each added one still raises the
+// aggregate rate, and backs off by one when it didn't.
+void Downloader::DownloadEntry::Rebalance()
 {
-	if (!parent) {
+	std::unique_lock l(lock);
+	if (!segmentable || !rangesConfirmed || validator == "" ||
+	    status != Status::DOWNLOADING || cancel) {
 		return;
 	}
-	std::unique_lock l(parent->lock);
-	auto dlentry = parent->queue.find(id);
-	if (dlentry != parent->queue.end()) {
-		if (dlentry->second->status == Status::DOWNLOADING) {
-			dlentry->second->progressCallback = nullptr;
-			dlentry->second->completeCallback = nullptr;
-			dlentry->second->cancel = 1;
-			//curl_multi_remove_handle(parent->handle,
-			//			 dlentry->second->handle);
-			dlentry->second->status = Status::STOPPED;
+	auto now = std::chrono::steady_clock::now();
+	if (probing &&
+	    now - probeStart >= std::chrono::seconds(SEGMENT_PROBE_SECONDS)) {
+		double seconds =
+			std::chrono::duration<double>(now - probeStart).count();
+		double rate = (double)(downloaded - probeBytes) / seconds;
+		if (rate > probeRate * 1.1 &&
+		    connections < SEGMENT_MAX_CONNECTIONS) {
+			connections++;
+		} else {
+			if (rate < probeRate && connections > 1) {
+				connections--;
+			}
+			probing = false;
 		}
+		probeRate = std::max(probeRate, rate);
+		probeBytes = downloaded;
+		probeStart = now;
 	}
-}
-void Downloader::Entry::Start()
-{
-	std::unique_lock l(parent->lock);
-	auto dlentry = parent->queue.find(id);
-	if (dlentry != parent->queue.end()) {
-		if (dlentry->second->status == Status::STOPPED) {
-			curl_multi_add_handle(parent->handle,
-					      dlentry->second->handle);
-			dlentry->second->status = Status::DOWNLOADING;
+	while (segments.size() < connections) {
+		auto range = nextChunk();
+		if (range.second == 0) {
+			break;
 		}
+		addSegment(range.first, range.second);
 	}
 }
-void Downloader::Entry::Remove()
+
+static std::string url_without_query(const std::string &url)
 {
-	std::unique_lock l(parent->lock);
-	auto dlentry = parent->queue.find(id);
-	if (dlentry != parent->queue.end()) {
-		dlentry->second->removed = true;
+	return url.substr(0, url.find_first_of('?'));
+}
+
+// Signed CDN links change their query string on every request, so only the
+// path is compared.
+bool Downloader::DownloadEntry::Matches(const std::string &otherUrl,
+					const std::string &otherTargetPath) const
+{
+	return targetPath == otherTargetPath &&
+	       url_without_query(url) == url_without_query(otherUrl);
+}
+
+CURLcode Downloader::DownloadEntry::settle(CURLcode result)
+{
+	releaseSegments();
+	drainIo();
+	if (result == CURLE_OK && ioFailed) {
+		result = CURLE_WRITE_ERROR;
+	} else if (result == CURLE_OK && rangesConfirmed && fileSize != 0 &&
+		   contiguousOffset() < fileSize) {
+		// Every segment ended, but the ranges don't add up
+		result = CURLE_PARTIAL_FILE;
 	}
+	return result;
 }
 
-void Downloader::tryDelete(decltype(Downloader::queue)::iterator iter)
+// Keeps the partial file so the download can be resumed, cut back to the
+// part without holes
+void Downloader::DownloadEntry::closePartial()
 {
-	if (iter->second->references <= 0 && iter->second->removed) {
-		queue.erase(iter);
+	if (file) {
+		downloaded = contiguousOffset();
+		truncate_file(file, downloaded);
+		reportRange(RangeEvent::TRUNCATED, downloaded, 0);
+		fclose(file);
+		file = nullptr;
+	}
+	if (validator == "") {
+		os_unlink(tmpTargetName.c_str());
+		reportRange(RangeEvent::TRUNCATED, 0, 0);
+	}
+}
+
+Downloader::Failure Downloader::DownloadEntry::classify(CURLcode result) const
+{
+	if (httpStatus == 401 || httpStatus == 403 || httpStatus == 410) {
+		// Signed links answer like this once they expire
+		return options.refreshUrl ? Failure::EXPIRED
+					  : Failure::PERMANENT;
+	}
+	if (httpStatus == 408 || httpStatus == 429 || httpStatus >= 500) {
+		return Failure::TRANSIENT;
+	}
+	if (httpStatus >= 400) {
+		return Failure::PERMANENT;
+	}
+	switch (result) {
+	case CURLE_COULDNT_RESOLVE_PROXY:
+	case CURLE_COULDNT_RESOLVE_HOST:
+	case CURLE_COULDNT_CONNECT:
+	case CURLE_PARTIAL_FILE:
+	case CURLE_OPERATION_TIMEDOUT:
+	case CURLE_SSL_CONNECT_ERROR:
+	case CURLE_GOT_NOTHING:
+	case CURLE_SEND_ERROR:
+	case CURLE_RECV_ERROR:
+	case CURLE_HTTP2:
+	case CURLE_HTTP2_STREAM:
+	case CURLE_RANGE_ERROR: // Restarted too often, see RESTART_MAX
+		return Failure::TRANSIENT;
+	default:
+		return Failure::PERMANENT;
+	}
+}
+
+// Free space of the volume path is on. Walks up to the nearest directory that
+// exists, the install location may not have been created yet. 0 if unknown.
+static uint64_t free_space_for(std::string path)
+{
+	while (!path.empty() && !os_file_exists(path.c_str())) {
+		auto slashPos = path.find_last_of("\\/", path.size() - 2);
+		if (path.size() < 2 || slashPos == std::string::npos) {
+			return 0;
+		}
+		path.resize(slashPos + 1);
+	}
+	return path.empty() ? 0 : os_get_free_disk_space(path.c_str());
+}
+
+// Returns false if the download should wait for the user: it is larger than
+// the configured threshold, or it and its extracted copy won't fit. Runs
+// before the first byte is written, once the size is known.
+bool Downloader::DownloadEntry::preflight()
+{
+	preflightNeeded = 0;
+	preflightAvailable = 0;
+	if (preflightConfirmed || !options.suspendCallback || fileSize == 0) {
+		return true;
+	}
+	if (options.suspendAbove != 0 && fileSize > options.suspendAbove) {
+		obs_log(LOG_INFO,
+			"Download of %s is %llu bytes, waiting for confirmation",
+			url_without_query(url).c_str(),
+			(unsigned long long)fileSize);
+		return false;
+	}
+
+	std::string staging = targetDirectory;
+	if (tmpTargetName != "") {
+		auto slashPos = tmpTargetName.find_last_of("\\/");
+		if (slashPos != std::string::npos) {
+			staging = tmpTargetName.substr(0, slashPos + 1);
+		}
+	}
+	uint64_t onDisk = contiguousOffset();
+	uint64_t stagingNeed = (fileSize > onDisk ? fileSize - onDisk : 0) +
+			       PREFLIGHT_MARGIN;
+	uint64_t installNeed = 0;
+	if (options.installDirectory != "") {
+		installNeed = (options.installSize ? options.installSize
+						   : fileSize) +
+			      PREFLIGHT_MARGIN;
+	}
+	// Both land on the same volume, they have to fit together
+	if (installNeed && staging != "" &&
+	    same_volume(staging, options.installDirectory)) {
+		stagingNeed += installNeed - PREFLIGHT_MARGIN;
+		installNeed = 0;
+	}
+	// Free space we can't find out doesn't hold the download up
+	auto check = [this](const std::string &directory, uint64_t need) {
+		uint64_t available = free_space_for(directory);
+		if (available == 0 || available >= need) {
+			return true;
+		}
+		obs_log(LOG_WARNING,
+			"Not enough space for %s in %s: %llu bytes needed, %llu available",
+			url_without_query(url).c_str(), directory.c_str(),
+			(unsigned long long)need,
+			(unsigned long long)available);
+		preflightNeeded = need;
+		preflightAvailable = available;
+		return false;
+	};
+	return (staging == "" || check(staging, stagingNeed)) &&
+	       (!installNeed || check(options.installDirectory, installNeed));
+}
+
+// Parks the entry until Entry::Start() confirms it. The partial file is kept,
+// like for a stopped download. Call with the lock held.
+void Downloader::DownloadEntry::suspend()
+{
+	settle(CURLE_OK);
+	closePartial();
+	status = Status::SUSPENDED;
+	suspendRequested = false;
+	parent->journal(journalRecord());
+	options.suspendCallback(callbackData, id, fileSize, preflightNeeded,
+				preflightAvailable);
+}
+
+// Worker thread. Detaches the transfers, the rest of a successful download
+// (flushing, hashing, moving, callbacks) can wait for the disk and runs on
+// the completion executor.
+void Downloader::DownloadEntry::Finish(CURLcode result)
+{
+	std::unique_lock l(lock);
+	releaseSegments();
+	if (status != Status::STOPPED && result == CURLE_OK) {
+		auto self = shared_from_this();
+		parent->complete(id, [self]() { self->finalize(); });
+		return;
+	}
+	fail(settle(result));
+}
+
+// Worker thread. Stops the transfers of a download the user stopped or
+// removed.
+void Downloader::DownloadEntry::Abort()
+{
+	std::unique_lock l(lock);
+	status = Status::STOPPED;
+	releaseSegments();
+	fail(settle(CURLE_ABORTED_BY_CALLBACK));
+}
+
+// User cancelled the download, or the connection dropped and retrying didn't
+// help. Call with the entry lock held.
+void Downloader::DownloadEntry::fail(CURLcode result)
+{
+	bool permanent = classify(result) == Failure::PERMANENT;
+	if (status != Status::STOPPED) {
+		if (httpStatus != 0) {
+			obs_log(LOG_WARNING,
+				"Download of %s failed: HTTP %ld",
+				url_without_query(url).c_str(),
+				httpStatus);
+		} else {
+			obs_log(LOG_WARNING,
+				"Download of %s interrupted: %s",
+				url_without_query(url).c_str(),
+				curl_easy_strerror(result));
+		}
+		status = permanent ? Status::FAILED : Status::ERRORED;
+	}
+	closePartial();
+	if (status == Status::FAILED) {
+		// Won't be resumed
+		os_unlink(tmpTargetName.c_str());
+		reportRange(RangeEvent::TRUNCATED, 0, 0);
+	}
+	if (status != Status::STOPPED) {
+		notifyProgress(false, false, 0, downloaded);
+	}
+	parent->journal(journalRecord());
+}
+
+// Completion executor
+void Downloader::DownloadEntry::finalize()
+{
+	std::unique_lock l(lock);
+	CURLcode result = settle(CURLE_OK);
+	if (result == CURLE_OK && status != Status::STOPPED &&
+	    options.durable && file) {
+		// Queued behind the last writes
+		parent->submitIo({IoType::SYNC, this, file, 0, {}});
+		drainIo();
+		if (ioFailed) {
+			result = CURLE_WRITE_ERROR;
+		}
+	}
+	if (status == Status::STOPPED || result != CURLE_OK) {
+		fail(result);
+		l.unlock();
+		parent->republish();
+		return;
+	}
+	if (!notModified && !verify()) {
+		// Corrupt, there's nothing worth resuming
+		fclose(file);
+		file = nullptr;
+		os_unlink(tmpTargetName.c_str());
+		reportRange(RangeEvent::TRUNCATED, 0, 0);
+		validator = "";
+		hasher.Reset();
+		status = Status::FAILED;
+		notifyProgress(false, false, 0, downloaded);
+		parent->journal(journalRecord());
+		l.unlock();
+		parent->republish();
+		return;
+	}
+	fclose(file);
+	file = nullptr;
+	if (notModified) {
+		// Nothing was sent, the copy at the target is current
+		os_unlink(tmpTargetName.c_str());
+	}
+	status = Status::FINISHED;
+	parent->journal(journalRecord());
+	// For support logs: slow first byte points at the server, disk stalls
+	// at the machine
+	obs_log(LOG_INFO,
+		"Download of %s: %u requests, last took %.2fs (dns %.2fs, connect %.2fs, tls %.2fs, first byte %.2fs), disk stalls %.2fs",
+		url_without_query(url).c_str(), timings.requests, timings.total,
+		timings.dns, timings.connect, timings.tls, timings.firstByte,
+		timings.diskStall);
+
+	if (fileName == "") {
+		fileName = detectedFileName;
+	}
+
+	MoveRequestData move{};
+	if (targetDirectory != "") {
+		if (fileName == "") {
+			fileName = random_name();
+		}
+		std::string target = targetDirectory + fileName;
+		obs_log(LOG_INFO, "donwloader target: %s", target.c_str());
+#ifdef WIN32
+		char *absPath = os_get_abs_path_ptr(target.c_str());
+		target = std::string(absPath, strlen(absPath));
+		bfree(absPath);
+#endif
+		move = {notModified ? "" : tmpTargetName, target.c_str(),
+			callbackData, completeCallback, subscribers,
+			options.revalidate, options.owner};
+		if (options.revalidate) {
+			fetched.fetchedAt =
+				std::chrono::duration_cast<std::chrono::seconds>(
+					std::chrono::system_clock::now()
+						.time_since_epoch())
+					.count();
+			saveCacheMetadata(target, fetched);
+		}
+	}
+	notifyProgress(true, false, 0, fileSize);
+	auto rangeCallback = notModified ? nullptr : options.rangeCallback;
+	std::string partial = tmpTargetName;
+	void *data = callbackData;
+	uint64_t size = fileSize;
+	move.rangeCallback = rangeCallback;
+	l.unlock();
+
+	parent->republish();
+	if (rangeCallback) {
+		// Outside the lock, the reader may take a moment to let go
+		rangeCallback(data, RangeEvent::FINISHED, partial, size, size);
+	}
+	if (move.second != "") {
+		moveIntoPlace(move);
+	} else {
+		if (rangeCallback) {
+			rangeCallback(data, RangeEvent::MOVED, partial, 0, 0);
+		}
+		parent->release(id);
+	}
+}
+
+// Moves a finished download to its target, which may be a full copy when it
+// crosses volumes, then hands it to whoever asked for it. The entry is
+// released once they have it.
+void Downloader::DownloadEntry::moveIntoPlace(const MoveRequestData &mr)
+{
+	std::weak_ptr<Downloader> weak = instance;
+	size_t entryId = id;
+	std::string file = mr.second;
+	if (mr.first == "") {
+		// Revalidated, nothing to move
+	} else if (!mr.replace ||
+		   os_safe_replace(mr.second.c_str(), mr.first.c_str(),
+				   nullptr) != 0) {
+		file = move_file_safe(mr.first, mr.second);
+	}
+	if (mr.rangeCallback) {
+		mr.rangeCallback(mr.data, RangeEvent::MOVED, file, 0, 0);
+	}
+	auto pos = file.rfind(".");
+	if (pos != std::string::npos &&
+	    file.substr(pos + 1) == "elgatoscene") {
+		// Only the first installs the pack, the others just reset
+		// their download state.
+		QMetaObject::invokeMethod(
+			QCoreApplication::instance()->thread(),
+			[file, mr, weak, entryId]() {
+				elgatocloud::ElgatoProduct::Install(
+					file, mr.data, true);
+				for (auto &s : mr.subscribers) {
+					elgatocloud::ElgatoProduct::
+						DownloadShared(s.data);
+				}
+				if (auto self = weak.lock()) {
+					self->release(entryId);
+				}
+			});
+	} else {
+		// We are downloading a thumbnail.
+		if (mr.callback) {
+			mr.callback(file, mr.data);
+		}
+		for (auto &s : mr.subscribers) {
+			if (s.completeCallback) {
+				s.completeCallback(file, s.data);
+			}
+		}
+		parent->release(id);
+	}
+}
+// Hashes whatever has been written contiguously past the hashed prefix.
+// Reads bypass stdio, the data was usually written moments ago and is still
+// in the page cache.
+void Downloader::DownloadEntry::catchUpHash(uint64_t maxBytes)
+{
+	uint64_t target = contiguousOffset();
+	if (!file || hasher.Size() >= target) {
+		return;
+	}
+	std::vector<char> buffer((size_t)std::min(
+		(uint64_t)HASH_READ_SIZE, target - hasher.Size()));
+	while (hasher.Size() < target && maxBytes > 0) {
+		uint64_t size = std::min({(uint64_t)buffer.size(),
+					  target - hasher.Size(), maxBytes});
+		if (!read_file_at(file, hasher.Size(), buffer.data(),
+				  (size_t)size)) {
+			return;
+		}
+		hasher.Update(buffer.data(), (size_t)size);
+		maxBytes -= size;
+	}
+}
+
+// Compares the finished file against the checksum the caller or server gave
+// us. Returns false only on a mismatch, files without a known checksum pass
+// unverified.
+bool Downloader::DownloadEntry::verify()
+{
+	catchUpHash(UINT64_MAX);
+	std::string expected = options.sha256 != "" ? options.sha256
+						    : announcedSha256;
+	for (auto &c : expected) {
+		c = (char)tolower(c);
+	}
+	if (fileSize != 0 && hasher.Size() != fileSize) {
+		obs_log(LOG_WARNING, "Could not hash %s, skipping verification",
+			tmpTargetName.c_str());
+		verification = "unverified";
+		return true;
+	}
+	std::string digest = hasher.Digest();
+	if (expected == "") {
+		obs_log(LOG_INFO, "Downloaded %s, sha256 %s (unverified)",
+			url_without_query(url).c_str(), digest.c_str());
+		verification = "unverified";
+		return true;
+	}
+	if (digest != expected) {
+		obs_log(LOG_ERROR,
+			"Checksum mismatch for %s: expected %s, got %s",
+			url_without_query(url).c_str(), expected.c_str(),
+			digest.c_str());
+		verification = "mismatch";
+		return false;
+	}
+	verification = "verified";
+	return true;
+}
+
+// Worker thread. Sends everything that arrived since the last call as one
+// progress update.
+void Downloader::DownloadEntry::publishProgress()
+{
+	std::unique_lock l(lock);
+	uint64_t current = downloaded.load(std::memory_order_relaxed);
+	if (current == publishedBytes || status != Status::DOWNLOADING) {
+		return;
+	}
+	uint64_t chunk = current > publishedBytes ? current - publishedBytes
+						  : 0;
+	publishedBytes = current;
+	notifyProgress(false, true, chunk, current);
+}
+
+void Downloader::DownloadEntry::notifyProgress(bool finished, bool downloading,
+					       uint64_t chunk, uint64_t current)
+{
+	if (progressCallback) {
+		progressCallback(callbackData, finished, downloading, fileSize,
+				 chunk, current);
+	}
+	for (auto &subscriber : subscribers) {
+		if (subscriber.progressCallback) {
+			subscriber.progressCallback(subscriber.data, finished,
+						    downloading, fileSize,
+						    chunk, current);
+		}
+	}
+}
+
+void Downloader::DownloadEntry::updateDownloadedHistory()
+{
+	std::unique_lock l(lock);
+	catchUpHash(HASH_CATCHUP_PER_TICK);
+
+	// Exponentially weighted, so the estimate settles within a few ticks
+	// instead of waiting for whole seconds of history
+	auto now = std::chrono::steady_clock::now();
+	uint64_t current = downloaded;
+	double seconds =
+		std::chrono::duration<double>(now - speedSampleTime).count();
+	if (current < speedSampleBytes) {
+		// Started over
+		speed = 0.0;
+	} else if (seconds > 0.0) {
+		double rate = (double)(current - speedSampleBytes) / seconds;
+		double alpha = 1.0 - std::exp(-seconds / SPEED_SMOOTHING_SECONDS);
+		speed = speed == 0.0 ? rate : speed + alpha * (rate - speed);
+	}
+	speedSampleBytes = current;
+	speedSampleTime = now;
+
+	if (status == Status::DOWNLOADING &&
+	    downloaded >= journaledBytes + JOURNAL_PROGRESS_INTERVAL) {
+		journaledBytes = downloaded;
+		parent->journal(journalRecord());
+	}
+}
+
+// Keeps the phase timings of the request the segment just completed
+void Downloader::DownloadEntry::recordTimings(Segment &segment)
+{
+	auto seconds = [&segment](CURLINFO info) {
+		curl_off_t us = 0;
+		curl_easy_getinfo(segment.handle, info, &us);
+		return (double)us / 1000000.0;
+	};
+	timings.dns = seconds(CURLINFO_NAMELOOKUP_TIME_T);
+	timings.connect = seconds(CURLINFO_CONNECT_TIME_T);
+	timings.tls = seconds(CURLINFO_APPCONNECT_TIME_T);
+	timings.firstByte = seconds(CURLINFO_STARTTRANSFER_TIME_T);
+	timings.total = seconds(CURLINFO_TOTAL_TIME_T);
+	timings.requests++;
+}
+
+std::string Downloader::DownloadEntry::journalRecord() const
+{
+	nlohmann::json record = {{"id", id},
+				 {"url", url},
+				 {"target", targetPath},
+				 {"file_name", fileName},
+				 {"target_directory", targetDirectory},
+				 {"detected_file_name", detectedFileName},
+				 {"tmp", tmpTargetName},
+				 {"size", fileSize},
+				 {"bytes", downloaded.load()},
+				 {"contiguous", contiguousOffset()},
+				 {"segmented", options.segmented},
+				 {"revalidate", options.revalidate},
+				 {"validator", validator},
+				 {"sha256", options.sha256},
+				 {"announced_sha256", announcedSha256},
+				 {"hash_state", hasher.Save()},
+				 {"verification", verification},
+				 {"status", status_name(status)}};
+	return record.dump();
+}
+
+// Replays the journal. Unfinished downloads whose partial file survived come
+// back as stopped entries that Enqueue/Start can resume.
+void Downloader::loadConfig()
+{
+	std::map<size_t, nlohmann::json> records;
+	std::ifstream f(configLocation);
+	std::string line;
+	while (std::getline(f, line)) {
+		try {
+			auto record = nlohmann::json::parse(line);
+			size_t id = record.at("id");
+			if (record.value("removed", false)) {
+				records.erase(id);
+			} else {
+				records[id] = record;
+			}
+		} catch (...) {
+			// Torn trailing write from a crash, skip it
+		}
+	}
+	f.close();
+
+	// Restored entries get new ids, the journal is rewritten below
+	for (auto &[id, record] : records) {
+		std::string tmp = record.value("tmp", "");
+		std::string status = record.value("status", "");
+		std::string validator = record.value("validator", "");
+		if (status == "finished" || tmp == "" ||
+		    !os_file_exists(tmp.c_str())) {
+			continue;
+		}
+		if (validator == "") {
+			os_unlink(tmp.c_str());
+			continue;
+		}
+		auto dle = std::make_shared<DownloadEntry>(this, allocateId());
+		dle->url = record.value("url", "");
+		dle->targetPath = record.value("target", "");
+		dle->fileName = record.value("file_name", "");
+		dle->targetDirectory = record.value("target_directory", "");
+		dle->detectedFileName = record.value("detected_file_name", "");
+		dle->tmpTargetName = tmp;
+		dle->fileSize = record.value("size", (uint64_t)0);
+		dle->options.expectedSize = dle->fileSize;
+		dle->options.segmented = record.value("segmented", false);
+		dle->options.revalidate = record.value("revalidate", false);
+		uint64_t contiguous = record.value("contiguous", (uint64_t)0);
+		if (record.contains("contiguous") &&
+		    (uint64_t)os_get_file_size(tmp.c_str()) > contiguous) {
+			// Past this point segments may have left holes, and
+			// the tail of a single stream may not have reached
+			// the disk before a crash. Fetch it again.
+			FILE *partial = os_fopen(tmp.c_str(), "r+b");
+			if (partial) {
+				truncate_file(partial, contiguous);
+				fclose(partial);
+			}
+		}
+		dle->downloaded = (uint64_t)os_get_file_size(tmp.c_str());
+		dle->options.sha256 = record.value("sha256", "");
+		dle->announcedSha256 = record.value("announced_sha256", "");
+		if (!dle->hasher.Restore(record.value("hash_state", "")) ||
+		    dle->hasher.Size() > dle->downloaded) {
+			dle->hasher.Reset();
+		}
+		dle->journaledBytes = dle->downloaded;
+		dle->validator = validator;
+		dle->status = status == "stopped"     ? Status::STOPPED
+			      : status == "suspended" ? Status::SUSPENDED
+						      : Status::ERRORED;
+		slots[slotIndex(dle->id)].entry = dle;
+		obs_log(LOG_INFO, "Restored download of %s (%llu bytes)",
+			dle->targetPath.c_str(),
+			(unsigned long long)dle->downloaded);
+	}
+	dumpConfig();
+	publishSnapshot();
+}
+
+// Rewrites the journal with one record per live entry
+void Downloader::dumpConfig()
+{
+	std::string contents;
+	for (auto &slot : slots) {
+		if (!slot.entry) {
+			continue;
+		}
+		std::unique_lock l(slot.entry->lock);
+		if (slot.entry->removed ||
+		    slot.entry->status == Status::FINISHED) {
+			continue;
+		}
+		contents += slot.entry->journalRecord() + "\n";
+	}
+
+	std::unique_lock l(journalLock);
+	if (journalFile) {
+		fclose(journalFile);
+		journalFile = nullptr;
+	}
+	if (!os_quick_write_utf8_file_safe(configLocation.c_str(),
+					   contents.c_str(), contents.size(),
+					   false, "tmp", "bak")) {
+		obs_log(LOG_WARNING, "Could not write download journal %s",
+			configLocation.c_str());
+	}
+	journalFile = os_fopen(configLocation.c_str(), "ab");
+	journalRecords = 0;
+}
+
+void Downloader::journal(const std::string &record)
+{
+	std::unique_lock l(journalLock);
+	if (!journalFile) {
+		return;
+	}
+	fwrite(record.c_str(), 1, record.size(), journalFile);
+	fputc('\n', journalFile);
+	fflush(journalFile);
+	journalRecords++;
+}
+
+Downloader::Downloader(std::string configLocation)
+	: retryJitter(std::random_device{}()),
+	  concurrentLimit(10),
+	  configLocation(configLocation),
+	  journalFile(nullptr),
+	  journalRecords(0),
+	  ioQueuedBytes(0),
+	  ioRunning(true),
+	  completionRunning(true),
+	  bandwidthLimit(0),
+	  bandwidthDirty(false),
+	  working(true),
+	  snapshotDirty(false)
+{
+	if (this->configLocation.empty()) {
+		char *path = obs_module_config_path("downloads.journal");
+		this->configLocation = path;
+		bfree(path);
+	}
+	handle = curl_multi_init();
+	loadConfig();
+	ioThread = std::thread{&Downloader::ioJob, this};
+	for (int i = 0; i < COMPLETION_THREADS; ++i) {
+		completionThreads.emplace_back(&Downloader::completionJob,
+					       this);
+	}
+	workerThread = std::thread{&Downloader::workerJob, this};
+}
+Downloader::~Downloader()
+{
+	std::unique_lock lockerA(lock);
+	working = false;
+	lockerA.unlock();
+
+	curl_multi_wakeup(handle);
+	workerThread.join();
+	// Finish pending moves and callbacks
+	{
+		std::unique_lock l(completionLock);
+		completionRunning = false;
+	}
+	completionWake.notify_all();
+	for (auto &thread : completionThreads) {
+		thread.join();
+	}
+
+	active.clear();
+	pending.clear();
+	retrying.clear();
+	dumpConfig();
+	if (journalFile) {
+		fclose(journalFile);
+	}
+	// Entries detach their easy handles from the multi handle and flush
+	// their buffers
+	slots.clear();
+	{
+		std::unique_lock l(ioLock);
+		ioRunning = false;
+	}
+	ioWake.notify_all();
+	ioThread.join();
+	curl_multi_cleanup(handle);
+}
+
+std::shared_ptr<Downloader> Downloader::getInstance(std::string configLocation)
+{
+	std::lock_guard<std::mutex> l(lock);
+	if (instance == nullptr) {
+		std::shared_ptr<Downloader> newInstance(
+			new Downloader(configLocation));
+		newInstance.swap(instance);
+	}
+	return instance;
+}
+
+Downloader::Entry Downloader::Enqueue(std::string url, std::string targetPath,
+				      ProgressCallbackFn pc, CompleteCallbackFn cc, void *callbackDat,
+				      const DownloadOptions &options)
+{
+	std::unique_lock l(lock);
+	Entry e{};
+
+	// Share a transfer of the same file that is already on its way, so
+	// the target directory doesn't end up with name(2).ext copies
+	for (auto &slot : slots) {
+		if (!slot.entry) {
+			continue;
+		}
+		auto &dle = *slot.entry;
+		{
+			// Checked under the entry's lock, finalize() copies the
+			// subscribers under it once the entry is FINISHED
+			std::unique_lock el(dle.lock);
+			if (dle.removed || dle.cancel ||
+			    (dle.status != Status::QUEUED &&
+			     dle.status != Status::DOWNLOADING) ||
+			    !dle.Matches(url, targetPath)) {
+				continue;
+			}
+			dle.subscribers.push_back(
+				{pc, cc, callbackDat, options.owner});
+			if (options.priority < dle.options.priority) {
+				dle.options.priority = options.priority;
+				bandwidthDirty = bandwidthLimit != 0;
+			}
+			if (dle.options.sha256 == "") {
+				dle.options.sha256 = options.sha256;
+			}
+			dle.options.durable =
+				dle.options.durable || options.durable;
+			fillEntry(e, dle);
+		}
+		publishSnapshot();
+		return e;
+	}
+
+	// Pick up where a stopped or interrupted download of the same file left off
+	for (auto &slot : slots) {
+		if (!slot.entry) {
+			continue;
+		}
+		auto &dle = *slot.entry;
+		{
+			std::unique_lock el(dle.lock);
+			if (dle.removed ||
+			    (dle.status != Status::STOPPED &&
+			     dle.status != Status::ERRORED &&
+			     dle.status != Status::SUSPENDED) ||
+			    !dle.Matches(url, targetPath)) {
+				continue;
+			}
+			dle.progressCallback = pc;
+			dle.completeCallback = cc;
+			dle.callbackData = callbackDat;
+			dle.subscribers.clear();
+			dle.options = options;
+			if (options.expectedSize) {
+				dle.fileSize = options.expectedSize;
+			}
+			dle.cancel = 0;
+			dle.attempts = 0;
+			dle.restarts = 0;
+			dle.requestedAt = std::chrono::steady_clock::now();
+			dle.timings.enqueueToFirstByte = 0.0;
+			dle.status = Status::QUEUED;
+			fillEntry(e, dle);
+		}
+		post({CommandType::START, dle.id, url});
+		publishSnapshot();
+		return e;
+	}
+
+	size_t id = allocateId();
+	auto dlentry = std::make_shared<DownloadEntry>(this, id, url, targetPath,
+						       pc, cc, callbackDat,
+						       options);
+	slots[slotIndex(id)].entry = dlentry;
+	{
+		std::unique_lock el(dlentry->lock);
+		journal(dlentry->journalRecord());
+		fillEntry(e, *dlentry);
+	}
+	post({CommandType::START, id, ""});
+	publishSnapshot();
+	return e;
+}
+
+void Downloader::SetBandwidthLimit(uint64_t bytesPerSecond)
+{
+	std::unique_lock l(lock);
+	if (bandwidthLimit == bytesPerSecond) {
+		return;
+	}
+	obs_log(LOG_INFO, "Download bandwidth limit set to %llu bytes/s",
+		(unsigned long long)bytesPerSecond);
+	bandwidthLimit = bytesPerSecond;
+	bandwidthDirty = true;
+	curl_multi_wakeup(handle);
+}
+
+// Lookup, Enumerate and Entry::Update read the published snapshot and don't
+// wait for the worker
+Downloader::Entry Downloader::Lookup(size_t id)
+{
+	auto current = std::atomic_load(&snapshot);
+	size_t index = slotIndex(id);
+	if (current && index < current->size() &&
+	    (*current)[index].id == id) {
+		return (*current)[index];
+	}
+	return Entry{};
+}
+
+std::vector<Downloader::Entry> Downloader::Enumerate(size_t limit)
+{
+	auto current = std::atomic_load(&snapshot);
+	std::vector<Entry> result;
+	if (!current) {
+		return result;
+	}
+	for (auto &entry : *current) {
+		if (result.size() >= limit) {
+			break;
+		}
+		if (entry.id != 0) {
+			result.push_back(entry);
+		}
+	}
+	return result;
+}
+
+size_t Downloader::allocateId()
+{
+	uint32_t index;
+	if (!freeSlots.empty()) {
+		index = freeSlots.back();
+		freeSlots.pop_back();
+	} else {
+		index = (uint32_t)slots.size();
+		slots.push_back({});
+	}
+	return (size_t)slots[index].generation << 32 | index;
+}
+
+// The entry behind id, or nullptr if it has been reclaimed
+std::shared_ptr<Downloader::DownloadEntry> Downloader::find(size_t id) const
+{
+	size_t index = slotIndex(id);
+	if (index >= slots.size() ||
+	    slots[index].generation != (uint32_t)(id >> 32)) {
+		return nullptr;
+	}
+	return slots[index].entry;
+}
+
+// Frees the slot right away. Ids held elsewhere stop resolving, the entry
+// itself goes once the worker's lists let go of it.
+void Downloader::reclaim(size_t id)
+{
+	size_t index = slotIndex(id);
+	if (!find(id)) {
+		return;
+	}
+	slots[index].entry.reset();
+	slots[index].generation++;
+	freeSlots.push_back((uint32_t)index);
+}
+
+// Frees the slot of a finished entry once its callbacks have run, so
+// finished downloads don't pile up in the slots and the snapshot
+void Downloader::release(size_t id)
+{
+	std::unique_lock l(lock);
+	reclaim(id);
+	publishSnapshot();
+}
+
+// Must be called with lock held, without entry locks
+void Downloader::publishSnapshot()
+{
+	auto next = std::make_shared<std::vector<Entry>>(slots.size());
+	for (size_t i = 0; i < slots.size(); ++i) {
+		auto &dle = slots[i].entry;
+		if (!dle || dle->removed) {
+			continue;
+		}
+		std::unique_lock el(dle->lock);
+		fillEntry((*next)[i], *dle);
+	}
+	std::atomic_store(&snapshot,
+			  std::shared_ptr<const std::vector<Entry>>(
+				  std::move(next)));
+}
+
+// Must be called with lock held
+void Downloader::post(Command command)
+{
+	commands.push_back(std::move(command));
+	curl_multi_wakeup(handle);
+}
+
+// Must be called with lock held, on the worker thread
+void Downloader::processCommands()
+{
+	while (!commands.empty()) {
+		snapshotDirty = true;
+		auto command = std::move(commands.front());
+		commands.pop_front();
+		auto dle = find(command.id);
+		if (!dle) {
+			continue;
+		}
+		switch (command.type) {
+		case CommandType::START:
+			// A stop or remove arrived after this was posted
+			if (dle->cancel || dle->removed) {
+				break;
+			}
+			if (!command.url.empty()) {
+				std::unique_lock el(dle->lock);
+				dle->url = command.url;
+			}
+			if (std::find(active.begin(), active.end(), dle) ==
+				    active.end() &&
+			    std::find(pending.begin(), pending.end(), dle) ==
+				    pending.end()) {
+				dle->queuedAt = std::chrono::steady_clock::now();
+				pending.push_back(dle);
+			}
+			break;
+		case CommandType::STOP:
+			if (!dle->segments.empty()) {
+				dle->Abort();
+				deactivate(dle.get());
+			}
+			break;
+		case CommandType::REMOVE:
+			if (!dle->segments.empty()) {
+				dle->Abort();
+				deactivate(dle.get());
+			}
+			reclaim(command.id);
+			break;
+		}
+	}
+}
+
+// Must be called with lock held, on the worker thread. Starts pending
+// downloads, most urgent first, while there are free transfer slots.
+void Downloader::schedule()
+{
+	pending.erase(std::remove_if(pending.begin(), pending.end(),
+				     [](auto &e) {
+					     return e->cancel || e->removed;
+				     }),
+		      pending.end());
+
+	auto now = std::chrono::steady_clock::now();
+	auto effectivePriority = [now](const DownloadEntry &e) {
+		auto waited = std::chrono::duration_cast<std::chrono::seconds>(
+				      now - e.queuedAt)
+				      .count();
+		long long level = (long long)e.options.priority -
+				  waited / SCHEDULER_AGING_SECONDS;
+		return level > 0 ? level : 0;
+	};
+
+	while (!pending.empty() && active.size() < concurrentLimit) {
+		auto best = pending.begin();
+		for (auto iter = pending.begin(); iter != pending.end();
+		     ++iter) {
+			auto a = effectivePriority(**iter);
+			auto b = effectivePriority(**best);
+			if (a < b || (a == b &&
+				      (*iter)->queuedAt < (*best)->queuedAt)) {
+				best = iter;
+			}
+		}
+		if (effectivePriority(**best) > 0 &&
+		    active.size() + SCHEDULER_INTERACTIVE_RESERVE >=
+			    concurrentLimit) {
+			break;
+		}
+		auto dle = *best;
+		pending.erase(best);
+		{
+			// Size handed in by the caller, before a connection
+			// is opened for it
+			std::unique_lock el(dle->lock);
+			if (!dle->preflight()) {
+				dle->suspend();
+				snapshotDirty = true;
+				continue;
+			}
+		}
+		if (dle->Resume()) {
+			activate(dle);
+		}
+	}
+}
+
+void Downloader::activate(std::shared_ptr<DownloadEntry> entry)
+{
+	if (std::find(active.begin(), active.end(), entry) == active.end()) {
+		snapshotDirty = true;
+		active.push_back(entry);
+		bandwidthDirty = bandwidthLimit != 0;
+	}
+}
+
+// Must be called with lock held, on the worker thread. Splits the bandwidth
+// limit between active downloads, weighted by priority. Downloads that used
+// noticeably less than their share last time are given what they used plus
+// some headroom, and the rest goes to the others. libcurl enforces the
+// resulting rate on each connection.
+void Downloader::rebalanceBandwidth()
+{
+	auto now = std::chrono::steady_clock::now();
+	if (!bandwidthDirty &&
+	    now - lastRebalance <
+		    std::chrono::milliseconds(BANDWIDTH_REBALANCE_MS)) {
+		return;
+	}
+	double seconds = std::chrono::duration<double>(now - lastRebalance)
+				 .count();
+	lastRebalance = now;
+	bandwidthDirty = false;
+
+	struct Share {
+		DownloadEntry *entry;
+		double weight, demand, allotment;
+		bool settled;
+	};
+	std::vector<Share> shares;
+	for (auto &entry : active) {
+		std::unique_lock el(entry->lock);
+		uint64_t bytes = entry->downloaded > entry->rateSampleBytes
+					 ? entry->downloaded -
+						   entry->rateSampleBytes
+					 : 0;
+		entry->rateSampleBytes = entry->downloaded;
+		if (bandwidthLimit == 0) {
+			entry->allotment = 0;
+		} else {
+			double rate = (double)bytes / seconds;
+			bool measured = entry->allotment != 0 && seconds >= 0.5;
+			double demand = measured && rate < 0.9 * entry->allotment
+						? rate * 1.25
+						: HUGE_VAL;
+			double weight =
+				(double)(1 << (3 - (int)entry->options.priority));
+			shares.push_back(
+				{entry.get(), weight, demand, 0.0, false});
+		}
+	}
+
+	// Max-min fair split. Settle everyone whose demand fits in their
+	// weighted share, then split what's left among the rest.
+	while (true) {
+		double weights = 0.0, used = 0.0;
+		for (auto &share : shares) {
+			if (share.settled) {
+				used += share.allotment;
+			} else {
+				weights += share.weight;
+			}
+		}
+		if (weights == 0.0) {
+			break;
+		}
+		double remaining = std::max((double)bandwidthLimit - used, 0.0);
+		bool settledAny = false;
+		for (auto &share : shares) {
+			if (!share.settled &&
+			    share.demand <= remaining * share.weight / weights) {
+				share.allotment = share.demand;
+				share.settled = true;
+				settledAny = true;
+			}
+		}
+		if (!settledAny) {
+			for (auto &share : shares) {
+				if (!share.settled) {
+					share.allotment = remaining *
+							  share.weight /
+							  weights;
+				}
+			}
+			break;
+		}
+	}
+	for (auto &share : shares) {
+		std::unique_lock el(share.entry->lock);
+		share.entry->allotment =
+			std::max((uint64_t)share.allotment,
+				 (uint64_t)BANDWIDTH_MIN_RATE);
+	}
+
+	for (auto &entry : active) {
+		std::unique_lock el(entry->lock);
+		uint64_t limit = 0;
+		if (entry->allotment != 0 && !entry->segments.empty()) {
+			limit = std::max(entry->allotment /
+						 entry->segments.size(),
+					 (uint64_t)1);
+		}
+		if (limit == entry->rateLimit) {
+			continue;
+		}
+		entry->rateLimit = limit;
+		for (auto &segment : entry->segments) {
+			curl_easy_setopt(segment->handle,
+					 CURLOPT_MAX_RECV_SPEED_LARGE,
+					 (curl_off_t)limit);
+		}
+	}
+}
+
+// Runs queued file I/O in order. Never takes entry locks, entries wait for
+// their requests in drainIo() while holding theirs.
+void Downloader::ioJob()
+{
+	std::unique_lock l(ioLock);
+	while (true) {
+		ioWake.wait(l, [this]() { return !ioQueue.empty() || !ioRunning; });
+		if (ioQueue.empty()) {
+			break;
+		}
+		auto request = std::move(ioQueue.front());
+		ioQueue.pop_front();
+		l.unlock();
+
+		bool ok = true;
+		switch (request.type) {
+		case IoType::WRITE:
+			ok = write_file_at(request.file, request.offset,
+					   request.data.data(),
+					   request.data.size());
+			break;
+		case IoType::PREALLOCATE:
+			// Only an optimization, the writes will extend the file
+			if (!preallocate_file(request.file, request.offset)) {
+				obs_log(LOG_DEBUG,
+					"Could not preallocate %llu bytes",
+					(unsigned long long)request.offset);
+			}
+			break;
+		case IoType::SYNC:
+			ok = sync_file(request.file);
+			break;
+		}
+		if (!ok) {
+			obs_log(LOG_ERROR, "Writing download file failed");
+			request.entry->ioFailed = true;
+		}
+
+		l.lock();
+		if (ok && request.type == IoType::WRITE) {
+			ioResults.push_back({request.entry, request.offset,
+					     request.data.size()});
+		}
+		uint64_t before = ioQueuedBytes.fetch_sub(request.data.size());
+		if (before > WRITE_QUEUE_RESUME &&
+		    before - request.data.size() <= WRITE_QUEUE_RESUME) {
+			// Let the worker unpause transfers
+			curl_multi_wakeup(handle);
+		}
+		if (--request.entry->pendingIo == 0) {
+			ioIdle.notify_all();
+		}
+	}
+}
+
+void Downloader::submitIo(IoRequest request)
+{
+	{
+		std::unique_lock l(ioLock);
+		request.entry->pendingIo++;
+		ioQueuedBytes += request.data.size();
+		ioQueue.push_back(std::move(request));
+	}
+	ioWake.notify_one();
+}
+
+// Blocks until the I/O thread is done with everything the entry queued
+void Downloader::waitForIo(DownloadEntry *entry)
+{
+	std::unique_lock l(ioLock);
+	ioIdle.wait(l, [entry]() { return entry->pendingIo == 0; });
+}
+
+// Must be called with lock held, on the worker thread. Marks written ranges
+// as completed, the part of a download that hashing and resuming can rely on.
+void Downloader::collectIo()
+{
+	std::vector<IoResult> results;
+	{
+		std::unique_lock l(ioLock);
+		results.swap(ioResults);
+	}
+	for (auto &result : results) {
+		std::unique_lock el(result.entry->lock);
+		result.entry->markCompleted(result.offset,
+					    result.offset + result.size);
+	}
+}
+
+// Must be called with lock held, on the worker thread. Segments are worker
+// thread state, and unpausing may deliver data to write_data right away, which
+// can take the entry lock, so entry locks aren't held here.
+void Downloader::resumePausedTransfers()
+{
+	if (ioQueuedBytes > WRITE_QUEUE_RESUME) {
+		return;
+	}
+	for (auto &entry : active) {
+		for (auto &segment : entry->segments) {
+			if (segment->paused) {
+				segment->paused = false;
+				{
+					std::unique_lock el(entry->lock);
+					entry->timings.diskStall +=
+						std::chrono::duration<double>(
+							std::chrono::steady_clock::now() -
+							segment->pausedAt)
+							.count();
+				}
+				curl_easy_pause(segment->handle, CURLPAUSE_CONT);
+			}
+		}
+	}
+}
+
+// Must be called with lock held, on the worker thread. Decides whether a
+// failed attempt gets another go. Transient failures wait with jittered
+// exponential backoff and then resume from what is on disk, refused links
+// are refreshed first. Returns false when the entry should be finished.
+bool Downloader::retry(DownloadEntry &entry, CURLcode result)
+{
+	auto dle = find(entry.id);
+	if (!dle) {
+		return false;
+	}
+	std::unique_lock el(entry.lock);
+	if (entry.cancel || entry.removed ||
+	    entry.status != Status::DOWNLOADING) {
+		return false;
+	}
+	result = entry.settle(result);
+	if (result == CURLE_OK) {
+		return false;
+	}
+	Failure failure = entry.classify(result);
+	if (failure == Failure::PERMANENT) {
+		return false;
+	}
+	entry.closePartial();
+	// Bytes of an attempt that has to start over aren't progress
+	if (entry.downloaded > entry.attemptBytes && !entry.restart) {
+		entry.attempts = 0;
+	}
+	entry.attemptBytes = entry.downloaded;
+	if (++entry.attempts > RETRY_MAX_ATTEMPTS) {
+		return false;
+	}
+	entry.status = Status::QUEUED;
+	journal(entry.journalRecord());
+
+	if (failure == Failure::EXPIRED) {
+		obs_log(LOG_INFO, "Link for %s was refused (HTTP %ld), refreshing",
+			url_without_query(entry.url).c_str(), entry.httpStatus);
+		refreshUrl(entry);
+		return true;
+	}
+	uint64_t delay = std::min((uint64_t)RETRY_MAX_MS,
+				  (uint64_t)RETRY_BASE_MS
+					  << (entry.attempts - 1));
+	// Spread out retries of downloads that failed together
+	std::uniform_int_distribution<uint64_t> jitter(delay / 2, delay);
+	delay = jitter(retryJitter);
+	std::string reason = entry.httpStatus != 0
+				     ? "HTTP " + std::to_string(entry.httpStatus)
+				     : curl_easy_strerror(result);
+	obs_log(LOG_INFO, "Download of %s failed (%s), retry %u in %.1fs",
+		url_without_query(entry.url).c_str(), reason.c_str(),
+		entry.attempts, (double)delay / 1000.0);
+	entry.retryAt = std::chrono::steady_clock::now() +
+			std::chrono::milliseconds(delay);
+	retrying.push_back(dle);
+	return true;
+}
+
+// Must be called with lock held, on the worker thread. Queues retries whose
+// backoff has passed.
+void Downloader::requeueRetries()
+{
+	auto now = std::chrono::steady_clock::now();
+	for (auto iter = retrying.begin(); iter != retrying.end();) {
+		auto &dle = *iter;
+		if (dle->cancel || dle->removed) {
+			iter = retrying.erase(iter);
+		} else if (dle->retryAt <= now) {
+			dle->queuedAt = now;
+			pending.push_back(dle);
+			iter = retrying.erase(iter);
+		} else {
+			++iter;
+		}
+	}
+}
+
+// Asks the owner for a new link on the UI thread and restarts the entry once
+// it arrives. Without one the next attempt runs with the old link and counts
+// as another failure.
+void Downloader::refreshUrl(DownloadEntry &entry)
+{
+	std::weak_ptr<Downloader> weak = instance;
+	size_t id = entry.id;
+	RefreshUrlFn refresh = entry.options.refreshUrl;
+	void *data = entry.callbackData;
+	auto owner = entry.options.owner;
+	QMetaObject::invokeMethod(
+		QCoreApplication::instance()->thread(),
+		[weak, id, refresh, data, owner]() {
+			refresh(data, [weak, id](const std::string &url) {
+				auto self = weak.lock();
+				if (!self) {
+					return;
+				}
+				std::unique_lock l(lock);
+				if (url.empty()) {
+					obs_log(LOG_WARNING,
+						"Could not refresh the link of download %zu",
+						id);
+				}
+				self->post({CommandType::START, id, url});
+			});
+		});
+}
+
+// Runs finalize jobs. A job waits while another one for the same entry is
+// running, so an entry's steps happen in the order they were queued.
+void Downloader::completionJob()
+{
+	std::unique_lock l(completionLock);
+	while (true) {
+		auto next = completions.end();
+		completionWake.wait(l, [this, &next]() {
+			next = std::find_if(
+				completions.begin(), completions.end(),
+				[this](const Completion &c) {
+					return completing.count(c.id) == 0;
+				});
+			return next != completions.end() || !completionRunning;
+		});
+		if (next == completions.end()) {
+			break;
+		}
+		auto completion = std::move(*next);
+		completions.erase(next);
+		completing.insert(completion.id);
+		l.unlock();
+
+		completion.job();
+		// May hold the last reference to the entry, whose destructor
+		// takes locks that are taken before completionLock elsewhere
+		completion.job = nullptr;
+
+		l.lock();
+		completing.erase(completion.id);
+		// Another thread may be waiting for this entry's next job
+		completionWake.notify_all();
+	}
+}
+
+void Downloader::complete(size_t id, std::function<void()> job)
+{
+	{
+		std::unique_lock l(completionLock);
+		completions.push_back({id, std::move(job)});
+	}
+	completionWake.notify_one();
+}
+
+// For changes made off the worker thread
+void Downloader::republish()
+{
+	std::unique_lock l(lock);
+	publishSnapshot();
+}
+
+void Downloader::deactivate(DownloadEntry *entry)
+{
+	snapshotDirty = true;
+	active.erase(std::remove_if(active.begin(), active.end(),
+				    [entry](auto &e) {
+					    return e.get() == entry;
+				    }),
+		     active.end());
+}
+
+void Downloader::workerJob()
+{
+	int active_transfers;
+	auto nextTick = std::chrono::steady_clock::now();
+	auto nextProgress = nextTick;
+	while (true) {
+		std::unique_lock l(lock);
+		if (!working) {
+			break;
+		}
+		processCommands();
+		schedule();
+		l.unlock();
+
+		curl_multi_perform(handle, &active_transfers);
+
+		l.lock();
+		collectIo();
+		resumePausedTransfers();
+		auto now = std::chrono::steady_clock::now();
+		if (now >= nextProgress) {
+			for (auto &entry : active) {
+				entry->publishProgress();
+			}
+			nextProgress = now + std::chrono::milliseconds(
+						     PROGRESS_INTERVAL_MS);
+			snapshotDirty = snapshotDirty || !active.empty();
+		}
+		if (now >= nextTick) {
+			for (auto &entry : active) {
+				entry->updateDownloadedHistory();
+				entry->Rebalance();
+			}
+			nextTick = now + std::chrono::milliseconds(
+						 WORKER_TICK_MS);
+		}
+		int msgs = 0;
+		CURLMsg *msg = nullptr;
+		while (true) {
+			msg = curl_multi_info_read(handle, &msgs);
+			if (!msg) {
+				break;
+			}
+			if (msg->msg == CURLMSG_DONE) {
+				void *info;
+				curl_easy_getinfo(msg->easy_handle,
+						  CURLINFO_PRIVATE, &info);
+				if (info == nullptr) {
+					continue;
+				}
+				Segment *segment = (Segment *)info;
+				DownloadEntry &dle = *segment->owner;
+				CURLcode result;
+				if (!dle.SegmentDone(segment, msg->data.result,
+						     result)) {
+					continue;
+				}
+				if (dle.restart && dle.restarts < RESTART_MAX) {
+					dle.restarts++;
+					if (!dle.Resume()) {
+						deactivate(&dle);
+					}
+					continue;
+				}
+				if (dle.restart) {
+					// Backs off like any other failure, the
+					// next attempt still starts over
+					obs_log(LOG_WARNING,
+						"%s keeps starting over, retrying later",
+						dle.tmpTargetName.c_str());
+					result = CURLE_RANGE_ERROR;
+				}
+				if (dle.suspendRequested) {
+					std::unique_lock el(dle.lock);
+					dle.suspend();
+					el.unlock();
+					deactivate(&dle);
+					continue;
+				}
+				if (result != CURLE_OK && retry(dle, result)) {
+					deactivate(&dle);
+					continue;
+				}
+				dle.Finish(result);
+				deactivate(&dle);
+			}
+		}
+		requeueRetries();
+		schedule();
+		rebalanceBandwidth();
+		if (journalRecords > JOURNAL_COMPACT_RECORDS) {
+			dumpConfig();
+		}
+		if (snapshotDirty) {
+			publishSnapshot();
+			snapshotDirty = false;
+		}
+		bool idle = active.empty() && commands.empty() &&
+			    retrying.empty();
+		l.unlock();
+
+		// Sleeps until there is socket activity, a curl timer fires,
+		// the next progress update is due or a command is posted.
+		curl_multi_poll(handle, NULL, 0,
+				idle ? WORKER_IDLE_MS : PROGRESS_INTERVAL_MS,
+				NULL);
+	}
+}
+
+void Downloader::fillEntry(Downloader::Entry &dst,
+			   Downloader::DownloadEntry &src)
+{
+	dst.id = src.id;
+	dst.fileName = src.fileName;
+	dst.url = src.url;
+	dst.fileSize = src.fileSize;
+	dst.downloaded = src.downloaded;
+	dst.status = src.status;
+	dst.priority = src.options.priority;
+	dst.parent = src.parent;
+	dst.timings = src.timings;
+	dst.validator = src.validator;
+
+	bool running = src.status == Status::DOWNLOADING;
+	dst.speedBps = running ? (uint64_t)src.speed : 0;
+	dst.etaSeconds = -1.0;
+	if (running && src.speed >= 1.0 && src.fileSize > dst.downloaded) {
+		dst.etaSeconds =
+			(double)(src.fileSize - dst.downloaded) / src.speed;
+	}
+}
+
+bool Downloader::loadCacheMetadata(const std::string &path,
+				   CacheMetadata &metadata)
+{
+	std::ifstream f(path + ".meta.json");
+	if (!f.is_open()) {
+		return false;
+	}
+	try {
+		auto record = nlohmann::json::parse(f);
+		metadata.etag = record.value("etag", "");
+		metadata.lastModified = record.value("last_modified", "");
+		metadata.fetchedAt = record.value("fetched_at", (int64_t)0);
+		metadata.maxAge = record.value("max_age", (int64_t)-1);
+	} catch (...) {
+		return false;
+	}
+	return true;
+}
+
+void Downloader::saveCacheMetadata(const std::string &path,
+				   const CacheMetadata &metadata)
+{
+	nlohmann::json record = {{"etag", metadata.etag},
+				 {"last_modified", metadata.lastModified},
+				 {"fetched_at", metadata.fetchedAt},
+				 {"max_age", metadata.maxAge}};
+	std::ofstream f(path + ".meta.json", std::ios::trunc);
+	f << record.dump();
+}
+
+bool Downloader::IsFresh(const std::string &path, int64_t defaultMaxAge)
+{
+	CacheMetadata metadata;
+	if (!os_file_exists(path.c_str()) ||
+	    !loadCacheMetadata(path, metadata)) {
+		return false;
+	}
+	int64_t now = std::chrono::duration_cast<std::chrono::seconds>(
+			      std::chrono::system_clock::now()
+				      .time_since_epoch())
+			      .count();
+	int64_t maxAge = metadata.maxAge >= 0 ? metadata.maxAge
+					      : defaultMaxAge;
+	return now >= metadata.fetchedAt && now - metadata.fetchedAt < maxAge;
+}
+
+std::string Downloader::DumpMetrics()
+{
+	std::unique_lock l(lock);
+	nlohmann::json downloads = nlohmann::json::array();
+	for (auto &slot : slots) {
+		if (!slot.entry || slot.entry->removed) {
+			continue;
+		}
+		auto &dle = *slot.entry;
+		Entry e{};
+		std::unique_lock el(dle.lock);
+		fillEntry(e, dle);
+		downloads.push_back(
+			{{"id", dle.id},
+			 {"url", url_without_query(dle.url)},
+			 {"status", status_name(dle.status)},
+			 {"size", dle.fileSize},
+			 {"bytes", e.downloaded},
+			 {"speed_bps", e.speedBps},
+			 {"eta_seconds", e.etaSeconds},
+			 {"connections", dle.segments.size()},
+			 {"timings",
+			  {{"dns", dle.timings.dns},
+			   {"connect", dle.timings.connect},
+			   {"tls", dle.timings.tls},
+			   {"first_byte", dle.timings.firstByte},
+			   {"enqueue_to_first_byte",
+			    dle.timings.enqueueToFirstByte},
+			   {"total", dle.timings.total},
+			   {"requests", dle.timings.requests},
+			   {"disk_stall", dle.timings.diskStall}}}});
+	}
+	nlohmann::json metrics = {
+		{"downloads", downloads},
+		{"active", active.size()},
+		{"pending", pending.size()},
+		{"bandwidth_limit", bandwidthLimit},
+		{"write_queue_bytes", ioQueuedBytes.load()}};
+	return metrics.dump();
+}
+
+void Downloader::Entry::Update()
+{
+	if (!parent) {
+		return;
+	}
+	auto current = std::atomic_load(&parent->snapshot);
+	size_t index = slotIndex(id);
+	if (current && index < current->size() &&
+	    (*current)[index].id == id) {
+		*this = (*current)[index];
+	}
+}
+
+void Downloader::Entry::Stop()
+{
+	if (!parent) {
+		return;
+	}
+	std::unique_lock l(parent->lock);
+	auto dle = parent->find(id);
+	if (!dle) {
+		return;
+	}
+	{
+		// Checked under the entry's lock, a completion thread may be
+		// finishing it
+		std::unique_lock el(dle->lock);
+		if (dle->status != Status::DOWNLOADING &&
+		    dle->status != Status::QUEUED) {
+			return;
+		}
+		// Callbacks are kept for a later Start(), the stopped
+		// transfer won't invoke them.
+		dle->cancel = 1;
+		dle->status = Status::STOPPED;
+	}
+	parent->post({CommandType::STOP, id, ""});
+	parent->publishSnapshot();
+}
+void Downloader::Entry::Start()
+{
+	if (!parent) {
+		return;
+	}
+	std::unique_lock l(parent->lock);
+	auto dle = parent->find(id);
+	if (!dle) {
+		return;
+	}
+	{
+		std::unique_lock el(dle->lock);
+		if (dle->removed || (dle->status != Status::STOPPED &&
+				     dle->status != Status::ERRORED &&
+				     dle->status != Status::SUSPENDED)) {
+			return;
+		}
+		if (dle->status == Status::SUSPENDED) {
+			dle->preflightConfirmed = true;
+		}
+		dle->cancel = 0;
+		dle->attempts = 0;
+		dle->restarts = 0;
+		dle->requestedAt = std::chrono::steady_clock::now();
+		dle->timings.enqueueToFirstByte = 0.0;
+		dle->status = Status::QUEUED;
+	}
+	parent->post({CommandType::START, id, ""});
+	parent->publishSnapshot();
+}
+void Downloader::Entry::Remove()
+{
+	if (!parent) {
+		return;
+	}
+	std::unique_lock l(parent->lock);
+	auto dle = parent->find(id);
+	if (dle) {
+		{
+			std::unique_lock el(dle->lock);
+			dle->removed = true;
+			dle->cancel = 1;
+		}
+		nlohmann::json record = {{"id", id}, {"removed", true}};
+		parent->journal(record.dump());
+		parent->post({CommandType::REMOVE, id, ""});
+		parent->publishSnapshot();
 	}
 }
 
-Downloader::Entry::~Entry()
+void Downloader::Entry::SetPriority(DownloadPriority priority)
 {
 	if (!parent) {
 		return;
 	}
 	std::unique_lock l(parent->lock);
-	auto dlentry = parent->queue.find(id);
-	if (dlentry != parent->queue.end()) {
-		dlentry->second->references--;
-		parent->tryDelete(dlentry);
+	auto dle = parent->find(id);
+	if (dle) {
+		std::unique_lock el(dle->lock);
+		dle->options.priority = priority;
+		this->priority = priority;
 	}
 }
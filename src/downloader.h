@@ -25,9 +25,16 @@ with this program. If not, see <https://www.gnu.org/licenses/>
 #include <chrono>
 #include <thread>
 #include <mutex>
+#include <condition_variable>
 #include <memory>
+#include <atomic>
+#include <random>
+#include <functional>
+#include <set>
 #include <curl/curl.h>
 
+#include "sha256.hpp"
+
 // Requirements:
 // Download to tmp file, move to final location
 // Configurable automatic suspension if there is an attempt to download a file above a certain size threshold
@@ -44,11 +51,108 @@ typedef void (*ProgressCallbackFn)(void *, bool, bool, uint64_t, uint64_t,
 
 typedef void (*CompleteCallbackFn)(std::string, void* data);
 
+// Asks for a new URL for a download whose link was refused, e.g. an expired
+// signed CDN link. Runs on the UI thread and must not block, done takes the
+// new URL or "" if there is none, on any thread.
+typedef void (*RefreshUrlFn)(void *data,
+			     std::function<void(const std::string &)> done);
+
+// A download was suspended before its data was written, either because it is
+// larger than DownloadOptions::suspendAbove or because it won't fit on disk.
+// needed and available are 0 when space wasn't the problem. Runs on the
+// worker thread.
+typedef void (*SuspendCallbackFn)(void *data, size_t id, uint64_t fileSize,
+				  uint64_t needed, uint64_t available);
+
+// What happened to the partial file of a download, for readers that consume
+// it while it is being written
+enum class RangeEvent : char {
+	WRITTEN, // [begin, end) reached the file
+	TRUNCATED, // Cut back to begin bytes, 0 if the data was dropped
+	FINISHED, // Complete and about to be moved. Stop reading before returning.
+	MOVED // Moved into place, path is where it stays
+};
+
+// Called with the callback data and the partial file's path. WRITTEN and
+// TRUNCATED run with the download's lock held and must not block, FINISHED
+// and MOVED run on the completion executor. FINISHED may wait for the reader
+// to close the file, but not for much longer.
+typedef void (*RangeCallbackFn)(void *data, RangeEvent event,
+				const std::string &path, uint64_t begin,
+				uint64_t end);
+
+// Scheduling classes, most urgent first
+enum class DownloadPriority : char {
+	INTERACTIVE, // The user clicked something and is waiting on it
+	VISIBLE, // Shown on screen right now
+	OFFSCREEN, // Will be shown once scrolled to
+	PREFETCH // Nobody is waiting
+};
+
+// Optional per-download settings for Downloader::Enqueue
+struct DownloadOptions {
+	DownloadPriority priority = DownloadPriority::VISIBLE;
+	// Size reported ahead of the transfer (e.g. by the direct-link API), 0 if unknown
+	uint64_t expectedSize = 0;
+	// Allow large files to be fetched over several ranged connections
+	bool segmented = false;
+	// Expected SHA-256 of the file in hex, empty if the caller doesn't know it
+	std::string sha256;
+	// Flush the file to disk before it is moved into place
+	bool durable = false;
+	// Called with the callback data when the server refuses the URL
+	RefreshUrlFn refreshUrl = nullptr;
+	// Checked once the size is known. Without a callback nobody could
+	// confirm the download, so it is never suspended.
+	SuspendCallbackFn suspendCallback = nullptr;
+	// Suspend files larger than this until confirmed, 0 for no limit
+	uint64_t suspendAbove = 0;
+	// Where the file gets extracted afterwards, "" if it isn't
+	std::string installDirectory;
+	// Space the extracted file takes up, 0 for the file size
+	uint64_t installSize = 0;
+	// Refresh the file at the target rather than download a copy next to
+	// it. Its validators are kept in a sidecar and sent along, a 304 leaves
+	// the file as it is. Needs a file name in the target path.
+	bool revalidate = false;
+	// Follows the bytes as they reach the partial file
+	RangeCallbackFn rangeCallback = nullptr;
+	// Held for as long as the download may call back, usually whatever the
+	// callback data points at
+	std::shared_ptr<void> owner;
+};
+
+// Where the time of a download went, to tell server latency apart from slow
+// disks. Times are in seconds.
+struct DownloadTimings {
+	// Phases of the most recently completed request, each measured from
+	// its start. Zero for steps a reused connection skipped.
+	double dns = 0.0, connect = 0.0, tls = 0.0, firstByte = 0.0,
+	       total = 0.0;
+	// From Enqueue or Start to the first byte of the file, including the
+	// wait for the worker and a transfer slot
+	double enqueueToFirstByte = 0.0;
+	uint32_t requests = 0; // Completed requests, one per segment chunk
+	double diskStall = 0.0; // Transfers paused waiting for the disk
+};
+
+// Callbacks of a request that was merged into an identical one in flight
+struct DownloadSubscriber {
+	ProgressCallbackFn progressCallback;
+	CompleteCallbackFn completeCallback;
+	void *data;
+	std::shared_ptr<void> owner; // DownloadOptions::owner of the request
+};
+
 struct MoveRequestData {
 	std::string first;
 	std::string second;
 	void *data;
 	CompleteCallbackFn callback;
+	std::vector<DownloadSubscriber> subscribers;
+	bool replace = false; // Overwrite an existing file at second
+	std::shared_ptr<void> owner; // Keeps data alive for the callbacks
+	RangeCallbackFn rangeCallback = nullptr; // Told where the file went
 };
 
 class Downloader {
@@ -59,40 +163,143 @@ public:
 		STOPPED,
 		DOWNLOADING,
 		FINISHED,
-		FAILED
+		FAILED,
+		SUSPENDED // Waiting for the user to confirm, see Entry::Start()
 	};
 
 private:
-	class DownloadEntry {
+	class DownloadEntry;
+
+	// What a failed attempt means for the next one
+	enum class Failure : char {
+		TRANSIENT, // Network trouble or a server error, try again
+		EXPIRED, // The link was refused, get a new one
+		PERMANENT // Retrying won't help
+	};
+
+	// Sidecar of a file kept fresh with DownloadOptions::revalidate
+	struct CacheMetadata {
+		std::string etag, lastModified;
+		int64_t fetchedAt = 0; // Seconds since the epoch
+		int64_t maxAge = -1; // From Cache-Control, -1 if not sent
+	};
+
+	// One connection's worth of a download. Plain downloads use a single
+	// open-ended segment, segmented ones several ranged segments.
+	struct Segment {
+		DownloadEntry *owner = nullptr;
+		CURL *handle = nullptr;
+		struct curl_slist *headers = nullptr;
+		uint64_t begin = 0, end = 0; // [begin, end), end == 0 reads to EOF
+		uint64_t written = 0;
+		long responseCode = 0;
+		std::string responseEtag, responseLastModified;
+		bool bodyStarted = false;
+		std::string responseDigest; // SHA-256 announced in the headers, hex
+		int64_t responseMaxAge = -1;
+		std::chrono::steady_clock::time_point started;
+		std::chrono::steady_clock::time_point pausedAt;
+		std::vector<char> buffer; // Received, not yet handed to the I/O thread
+		uint64_t bufferOffset = 0; // File offset of buffer[0]
+		bool paused = false; // Waiting for the I/O queue to drain
+	};
+
+	class DownloadEntry : public std::enable_shared_from_this<DownloadEntry> {
 	public:
+		size_t id;
 		std::string url, fileName, detectedFileName;
+		std::string targetPath; // As passed to Enqueue, used to match resumable entries
 		std::string targetDirectory,
 			tmpTargetName; // Download to tmpTarget. Move to targetName unless targetName is empty
+		std::string validator; // ETag (or Last-Modified) of the object in tmpTarget
+		DownloadOptions options;
+		Sha256 hasher; // Covers the first hasher.Size() bytes of tmpTarget
+		std::string announcedSha256; // From the response headers
+		std::string verification; // "verified", "unverified" or "mismatch" once finished
 		FILE *file;
-		uint64_t fileSize, downloaded;
-		uint64_t logCalls;
-		std::deque<std::pair<std::chrono::steady_clock::time_point,
-				     uint64_t>>
-			downloadedHistory;
+		uint64_t fileSize;
+		std::atomic<uint64_t> downloaded; // Bumped by write_data without the lock
+		uint64_t publishedBytes; // downloaded as of the last progress callback
+		uint64_t resumeOffset; // Bytes already on disk when the current attempt started
+		bool restart; // Partial data belongs to a different object, start over
+		bool notModified; // Revalidated, the target is still current
+		CacheMetadata cached; // Of the copy at the target, sent with the request
+		CacheMetadata fetched; // Of the response
+		long httpStatus; // Of the response that failed the attempt, 0 if none
+		unsigned attempts; // Failed attempts in a row
+		unsigned restarts; // Times it started over since Start()
+		uint64_t attemptBytes; // contiguousOffset() after the last failure
+		std::chrono::steady_clock::time_point retryAt;
+		bool preflightConfirmed; // The user accepted the size and space
+		bool suspendRequested; // Set by beginBody(), acted on by the worker
+		uint64_t preflightNeeded, preflightAvailable; // Of the failed check
+		uint64_t logCalls = 0;
+		uint64_t journaledBytes;
+		std::chrono::steady_clock::time_point queuedAt; // Waiting for a transfer slot since
+		std::chrono::steady_clock::time_point requestedAt; // Last Enqueue or Start
+		uint64_t allotment; // Share of the bandwidth limit in bytes per second, 0 for none
+		uint64_t rateLimit; // allotment split across segments
+		uint64_t rateSampleBytes; // downloaded at the previous rebalance
+		double speed; // Smoothed bytes per second
+		uint64_t speedSampleBytes;
+		std::chrono::steady_clock::time_point speedSampleTime;
+		DownloadTimings timings;
 		Downloader::Status status;
-		size_t references;
 		bool removed;
 		std::mutex lock;
 
-		CURL *handle;
+		std::vector<std::unique_ptr<Segment>> segments;
+		std::map<uint64_t, uint64_t> completedRanges; // begin -> end, merged
+		bool segmentable; // Ranged segments allowed for this attempt
+		bool rangesConfirmed; // Server answered a range request with 206
+		uint64_t preallocatedSize; // Size last passed to preallocate_file
+		size_t pendingIo; // Requests queued on the I/O thread, guarded by parent->ioLock
+		std::atomic<bool> ioFailed; // Set by the I/O thread, checked by write_data
+		uint64_t nextOffset; // Start of the next range to hand out
+		uint64_t chunkSize;
+		size_t connections; // Target number of parallel segments
+		bool probing; // Still trying more connections
+		double probeRate;
+		uint64_t probeBytes;
+		std::chrono::steady_clock::time_point probeStart;
+
 		Downloader *parent;
 		ProgressCallbackFn progressCallback;
 		CompleteCallbackFn completeCallback;
-		int cancel;
+		std::atomic<int> cancel;
 		void *callbackData;
+		std::vector<DownloadSubscriber> subscribers; // Notified after the above
 
-		DownloadEntry(Downloader *parent, std::string url,
+		DownloadEntry(Downloader *parent, size_t id, std::string url,
 			      std::string targetPath,
 			      ProgressCallbackFn pc = nullptr,
-				  CompleteCallbackFn cc = nullptr,
-			      void *callbackDat = nullptr);
+			      CompleteCallbackFn cc = nullptr,
+			      void *callbackDat = nullptr,
+			      const DownloadOptions &options = DownloadOptions());
+		// Restored from the journal, idle until resumed
+		DownloadEntry(Downloader *parent, size_t id);
 		~DownloadEntry();
-		void Finish();
+		void Finish(CURLcode result);
+		void Abort();
+		void fail(CURLcode result);
+		void finalize();
+		void moveIntoPlace(const MoveRequestData &mr);
+		// Stops the transfers and waits for their data to be written.
+		// Returns result, or the error it turned into.
+		CURLcode settle(CURLcode result);
+		void closePartial();
+		Failure classify(CURLcode result) const;
+		// Size and free space checks, call with the lock held
+		bool preflight();
+		void suspend();
+		bool Resume(const std::string &newUrl = "");
+		// Returns true once the entry as a whole is done and should be finished
+		bool SegmentDone(Segment *segment, CURLcode result,
+				 CURLcode &entryResult);
+		// Adds connections while they improve throughput
+		void Rebalance();
+		bool Matches(const std::string &otherUrl,
+			     const std::string &otherTargetPath) const;
 		static size_t write_data(void *ptr, size_t size, size_t nmemb,
 					 void *userdata);
 		static size_t handle_header(void *ptr, size_t size,
@@ -102,20 +309,111 @@ private:
 					      curl_off_t ultotal,
 					      curl_off_t ulnow);
 		bool handleContentDisposition(const std::string &headerData);
-		bool handleContentLength(const std::string &headerData);
+		bool handleContentLength(Segment &segment,
+					 const std::string &headerData);
+		bool handleContentRange(const std::string &headerData);
+		bool handleDigest(Segment &segment, const std::string &headerName,
+				  const std::string &headerData);
+		bool handleStatusLine(Segment &segment,
+				      const std::string &headerLine);
+		bool beginBody(Segment &segment);
+		bool truncatePartial(Segment &segment);
+		void addSegment(uint64_t begin, uint64_t end);
+		void startSegment(Segment &segment);
+		void removeSegment(Segment *segment);
+		void releaseSegments();
+		void flushSegment(Segment &segment);
+		void drainIo();
+		std::pair<uint64_t, uint64_t> nextChunk();
+		void markCompleted(uint64_t begin, uint64_t end);
+		void reportRange(RangeEvent event, uint64_t begin, uint64_t end);
+		uint64_t contiguousOffset() const;
+		void catchUpHash(uint64_t maxBytes);
+		bool verify();
 		void updateDownloadedHistory();
+		void recordTimings(Segment &segment);
+		void publishProgress();
+		void notifyProgress(bool finished, bool downloading,
+				    uint64_t chunk, uint64_t current);
+		std::string journalRecord() const;
 	};
 
 	friend DownloadEntry;
 
-	std::map<size_t, std::shared_ptr<DownloadEntry>> queue;
-	//std::vector<std::pair<std::string, std::string>> moveRequests;
-	std::vector<MoveRequestData> moveRequests;
+	// Everything that touches the multi handle runs on the worker thread.
+	// Other threads post commands and wake it up.
+	enum class CommandType : char { START, STOP, REMOVE };
+	struct Command {
+		CommandType type;
+		size_t id;
+		std::string url; // START only, replaces the entry's url if set
+	};
+
+	// Generational slot map. An id is the slot's generation in the upper 32
+	// bits and its index in the lower ones. Reclaiming a slot bumps the
+	// generation, so stale ids never resolve to the slot's next entry.
+	struct Slot {
+		std::shared_ptr<DownloadEntry> entry;
+		uint32_t generation = 1;
+	};
+	std::vector<Slot> slots;
+	std::vector<uint32_t> freeSlots;
+	static_assert(sizeof(size_t) >= 8, "ids need 64 bits");
+	std::deque<Command> commands;
+	std::vector<std::shared_ptr<DownloadEntry>> active; // Worker thread only
+	std::vector<std::shared_ptr<DownloadEntry>> pending; // Worker thread only
+	std::vector<std::shared_ptr<DownloadEntry>> retrying; // Worker thread only
+	std::mt19937 retryJitter;
 
-	size_t idCounter;
 	size_t concurrentLimit;
 	std::string configLocation;
 
+	// Append-only log of entry state changes, compacted on load and unload
+	FILE *journalFile;
+	size_t journalRecords;
+	std::mutex journalLock;
+
+	// Write-behind stage. Segments buffer what they receive and hand full
+	// buffers to the I/O thread, so slow disks don't hold up transfers.
+	enum class IoType : char { WRITE, PREALLOCATE, SYNC };
+	struct IoRequest {
+		IoType type;
+		DownloadEntry *entry;
+		FILE *file;
+		uint64_t offset; // WRITE: where data goes, PREALLOCATE: the size
+		std::vector<char> data;
+	};
+	// A write that reached the file
+	struct IoResult {
+		DownloadEntry *entry;
+		uint64_t offset, size;
+	};
+	std::deque<IoRequest> ioQueue;
+	std::vector<IoResult> ioResults;
+	std::atomic<uint64_t> ioQueuedBytes;
+	bool ioRunning;
+	std::mutex ioLock;
+	std::condition_variable ioWake, ioIdle;
+	std::thread ioThread;
+
+	// Completion executor. Finished downloads are flushed, verified, moved
+	// and announced here, so a slow disk or a cross-volume copy doesn't
+	// hold up the transfers.
+	struct Completion {
+		size_t id; // Jobs of one entry run in order
+		std::function<void()> job;
+	};
+	std::deque<Completion> completions;
+	std::set<size_t> completing;
+	bool completionRunning;
+	std::mutex completionLock;
+	std::condition_variable completionWake;
+	std::vector<std::thread> completionThreads;
+
+	uint64_t bandwidthLimit; // Bytes per second over all downloads, 0 for none
+	bool bandwidthDirty;
+	std::chrono::steady_clock::time_point lastRebalance;
+
 	std::thread workerThread;
 	static std::mutex lock;
 	static std::shared_ptr<Downloader> instance;
@@ -127,41 +425,98 @@ private:
 
 	void loadConfig();
 	void dumpConfig();
+	void journal(const std::string &record);
 	void workerJob();
-	void tryDelete(decltype(queue)::iterator iter);
+	void post(Command command);
+	void processCommands();
+	void schedule();
+	void rebalanceBandwidth();
+	bool retry(DownloadEntry &entry, CURLcode result);
+	void requeueRetries();
+	void refreshUrl(DownloadEntry &entry);
+	void ioJob();
+	void submitIo(IoRequest request);
+	void waitForIo(DownloadEntry *entry);
+	void collectIo();
+	void resumePausedTransfers();
+	void completionJob();
+	void complete(size_t id, std::function<void()> job);
+	void republish();
+	void activate(std::shared_ptr<DownloadEntry> entry);
+	void deactivate(DownloadEntry *entry);
+	size_t allocateId();
+	std::shared_ptr<DownloadEntry> find(size_t id) const;
+	void reclaim(size_t id);
+	void release(size_t id);
+	void publishSnapshot();
+	static size_t slotIndex(size_t id) { return id & 0xffffffff; }
+	static bool loadCacheMetadata(const std::string &path,
+				      CacheMetadata &metadata);
+	static void saveCacheMetadata(const std::string &path,
+				      const CacheMetadata &metadata);
 
 public:
 	struct Entry {
-		size_t id;
+		size_t id = 0;
 		Downloader *parent = nullptr;
 
 		std::string fileName, url;
-		uint64_t fileSize, downloaded, speedBps; // bytes per second
-		Status status;
+		uint64_t fileSize = 0, downloaded = 0,
+			 speedBps = 0; // bytes per second
+		double etaSeconds = -1.0; // Negative while unknown
+		DownloadTimings timings;
+		std::string validator; // ETag or Last-Modified of what is being fetched
+		Status status = Status::QUEUED;
+		DownloadPriority priority = DownloadPriority::VISIBLE;
 		// Update the data in this struct
 		void Update();
 		// Stop the download
 		void Stop();
-		// Start or attempt to resume the download
+		// Start or attempt to resume the download. Also confirms a
+		// suspended one.
 		void Start();
 		// Removes a download entirely from the list of downloads
 		void Remove();
-
-		~Entry();
+		// Moves a queued download ahead of or behind others, e.g. when
+		// the widget waiting on it scrolls into view
+		void SetPriority(DownloadPriority priority);
 	};
 	friend Entry;
 	~Downloader();
 
+private:
+	// Copies of all entries, indexed by slot, republished by the worker
+	// every progress interval and after changes made through the public
+	// interface. Read with std::atomic_load, so polling the list doesn't
+	// wait for the transfer loop.
+	std::shared_ptr<const std::vector<Entry>> snapshot;
+	bool snapshotDirty; // Worker thread, publish before sleeping
+
+public:
+
 	static std::shared_ptr<Downloader> getInstance(std::string configPath);
 
 	// If targetPath is empty, the file will remain as a temporary file
 	// If targetPath ends with a / or \ character, the name will be automatically set
+	// Enqueuing a URL and target that are already queued or downloading
+	// subscribes to that transfer instead of starting another one
 	Entry Enqueue(std::string url, std::string targetPath = "",
 		      ProgressCallbackFn pc = nullptr,
 		      CompleteCallbackFn cc = nullptr,
-		      void *callbackDat = nullptr);
+		      void *callbackDat = nullptr,
+		      const DownloadOptions &options = DownloadOptions());
 	Entry Lookup(size_t id);
 	std::vector<Entry> Enumerate(size_t limit = -1);
+	// Caps the combined download rate in bytes per second, 0 removes the cap.
+	// Higher priority downloads get a larger share.
+	void SetBandwidthLimit(uint64_t bytesPerSecond);
+	// Rates, timings and write queue state of all downloads as JSON, for
+	// diagnosing slow downloads
+	std::string DumpMetrics();
+	// Whether a file kept with DownloadOptions::revalidate was fetched
+	// within its max-age, or within defaultMaxAge seconds if the server
+	// didn't send one. Stale files should be revalidated.
+	static bool IsFresh(const std::string &path, int64_t defaultMaxAge);
 
 private:
 	void fillEntry(Entry &dst, DownloadEntry &src);
@@ -25,6 +25,7 @@ with this program. If not, see <https://www.gnu.org/licenses/>
 #include "elgato-widgets.hpp"
 #include "elgato-cloud-config.hpp"
 #include "elgato-cloud-data.hpp"
+#include "pack-cache.hpp"
 #include "util.h"
 #include <plugin-support.h>
 #include "obs-utils.hpp"
@@ -515,7 +516,7 @@ ElgatoCloudConfig::ElgatoCloudConfig(QWidget *parent) : QDialog(parent)
 	std::string imageBaseDir = GetDataPath();
 	imageBaseDir += "/images/";
 
-	setFixedSize(QSize(680, 528));
+	setFixedSize(QSize(680, 600));
 	setAttribute(Qt::WA_DeleteOnClose);
 	setWindowTitle(obs_module_text("MarketplaceWindow.Settings.Title"));
 
@@ -602,6 +603,78 @@ ElgatoCloudConfig::ElgatoCloudConfig(QWidget *parent) : QDialog(parent)
 	filePickerLayout->addWidget(filePicker);
 	layout->addLayout(filePickerLayout);
 
+	// Download bandwidth caps while live, in KB/s. 0 disables the cap.
+	auto limitsLayout = new QHBoxLayout();
+	limitsLayout->setContentsMargins(0, 0, 0, 0);
+	limitsLayout->setSpacing(16);
+	auto addLimit = [this, limitsLayout](const char *label, int64_t value) {
+		auto limitLayout = new QVBoxLayout();
+		limitLayout->setContentsMargins(0, 0, 0, 0);
+		limitLayout->setSpacing(4);
+		auto limitLabel = new QLabel(obs_module_text(label), this);
+		limitLabel->setStyleSheet(EWizardFieldLabel);
+		auto limit = new QSpinBox(this);
+		limit->setRange(0, 1024 * 1024);
+		limit->setSingleStep(256);
+		limit->setSuffix(" KB/s");
+		limit->setSpecialValueText(obs_module_text(
+			"MarketplaceWindow.Settings.DownloadLimit.Unlimited"));
+		limit->setValue((int)value);
+		limit->setStyleSheet(EWizardSpinBoxStyle);
+		limitLayout->addWidget(limitLabel);
+		limitLayout->addWidget(limit);
+		limitsLayout->addLayout(limitLayout);
+		return limit;
+	};
+	_streamingLimit = addLimit(
+		"MarketplaceWindow.Settings.DownloadLimit.Streaming",
+		obs_data_get_int(config, "DownloadLimitStreaming"));
+	_recordingLimit = addLimit(
+		"MarketplaceWindow.Settings.DownloadLimit.Recording",
+		obs_data_get_int(config, "DownloadLimitRecording"));
+	layout->addLayout(limitsLayout);
+
+	// Downloads larger than this, in MB, wait for confirmation. 0 never asks.
+	auto confirmLabel = new QLabel(
+		obs_module_text("MarketplaceWindow.Settings.DownloadConfirmAbove"),
+		this);
+	confirmLabel->setStyleSheet(EWizardFieldLabel);
+	_confirmAbove = new QSpinBox(this);
+	_confirmAbove->setRange(0, 1024 * 1024);
+	_confirmAbove->setSingleStep(100);
+	_confirmAbove->setSuffix(" MB");
+	_confirmAbove->setSpecialValueText(obs_module_text(
+		"MarketplaceWindow.Settings.DownloadConfirmAbove.Never"));
+	_confirmAbove->setValue(
+		(int)obs_data_get_int(config, "DownloadConfirmAbove"));
+	_confirmAbove->setStyleSheet(EWizardSpinBoxStyle);
+	auto confirmLayout = new QVBoxLayout();
+	confirmLayout->setContentsMargins(0, 0, 0, 0);
+	confirmLayout->setSpacing(4);
+	confirmLayout->addWidget(confirmLabel);
+	confirmLayout->addWidget(_confirmAbove);
+	layout->addLayout(confirmLayout);
+
+	// Downloaded packs are kept for reinstalling, up to this many MB
+	auto cacheLabel = new QLabel(
+		obs_module_text("MarketplaceWindow.Settings.PackCacheSize"), this);
+	cacheLabel->setStyleSheet(EWizardFieldLabel);
+	_packCacheSize = new QSpinBox(this);
+	_packCacheSize->setRange(0, 1024 * 1024);
+	_packCacheSize->setSingleStep(1024);
+	_packCacheSize->setSuffix(" MB");
+	_packCacheSize->setSpecialValueText(obs_module_text(
+		"MarketplaceWindow.Settings.PackCacheSize.Disabled"));
+	_packCacheSize->setValue(
+		(int)obs_data_get_int(config, "PackCacheSize"));
+	_packCacheSize->setStyleSheet(EWizardSpinBoxStyle);
+	auto cacheLayout = new QVBoxLayout();
+	cacheLayout->setContentsMargins(0, 0, 0, 0);
+	cacheLayout->setSpacing(4);
+	cacheLayout->addWidget(cacheLabel);
+	cacheLayout->addWidget(_packCacheSize);
+	layout->addLayout(cacheLayout);
+
 	// Maker Tools toggle.
 	bool makerTools = obs_data_get_bool(config, "MakerTools");
 	_makerCheckbox = new QCheckBox(
@@ -671,8 +744,19 @@ ElgatoCloudConfig::ElgatoCloudConfig(QWidget *parent) : QDialog(parent)
 				    _installDirectory.c_str());
 		obs_data_set_bool(config, "MakerTools",
 				  _makerCheckbox->isChecked());
+		obs_data_set_int(config, "DownloadLimitStreaming",
+				 _streamingLimit->value());
+		obs_data_set_int(config, "DownloadLimitRecording",
+				 _recordingLimit->value());
+		obs_data_set_int(config, "DownloadConfirmAbove",
+				 _confirmAbove->value());
+		obs_data_set_int(config, "PackCacheSize",
+				 _packCacheSize->value());
+		PackCache::getInstance()->SetBudget(
+			(uint64_t)_packCacheSize->value() * 1024 * 1024);
 		obs_data_release(config);
 		_save();
+		elgatoCloud->UpdateDownloadLimit();
 		close();
 	});
 	connect(cancelButton, &QPushButton::released, this,
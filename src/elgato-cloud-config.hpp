@@ -23,6 +23,7 @@ with this program. If not, see <https://www.gnu.org/licenses/>
 #include <QLabel>
 #include <QComboBox>
 #include <QCheckBox>
+#include <QSpinBox>
 #include <QStackedWidget>
 #include <obs-frontend-api.h>
 #include <obs-module.h>
@@ -139,6 +140,10 @@ private:
 	obs_volmeter_t *_volmeter = nullptr;
 	OBSQTDisplay *_videoPreview = nullptr;
 	QCheckBox *_makerCheckbox = nullptr;
+	QSpinBox *_streamingLimit = nullptr;
+	QSpinBox *_recordingLimit = nullptr;
+	QSpinBox *_confirmAbove = nullptr;
+	QSpinBox *_packCacheSize = nullptr;
 	InfoLabel* _makerRestartMsg = nullptr;
 	std::vector<std::string> _toEnable;
 	std::string _installDirectory;
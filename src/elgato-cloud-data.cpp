@@ -17,7 +17,10 @@ with this program. If not, see <https://www.gnu.org/licenses/>
 */
 
 #include <random>
+#include <algorithm>
 #include <chrono>
+#include <fstream>
+#include <map>
 
 #include <obs-frontend-api.h>
 #include <util/config-file.h>
@@ -28,6 +31,7 @@ with this program. If not, see <https://www.gnu.org/licenses/>
 #include <QApplication>
 #include <QThread>
 #include <QMetaObject>
+#include <QTimer>
 #include <QDir>
 #include <QVersionNumber>
 #include <QMainWindow>
@@ -40,6 +44,17 @@ with this program. If not, see <https://www.gnu.org/licenses/>
 #include "platform.h"
 #include "util.h"
 #include "api.hpp"
+#include "pack-cache.hpp"
+#include "http-client.hpp"
+#include "catalog-reader.hpp"
+
+// Where the last catalog that loaded is kept, in the user data directory
+#define CATALOG_FILE "my-products.json"
+// How soon to try again while the library is shown offline
+#define CATALOG_RETRY_MS 30000
+// Products per my-products request, and how many requests run at once
+#define CATALOG_PAGE_SIZE 50
+#define CATALOG_PARALLEL_PAGES 4
 
 namespace elgatocloud {
 ElgatoCloud *elgatoCloud = nullptr;
@@ -95,6 +110,22 @@ void ElgatoCloud::FrontEndEventHandler(enum obs_frontend_event event, void* data
 				});
 		}
 		break;
+	case OBS_FRONTEND_EVENT_STREAMING_STARTED:
+		ec->_streaming = true;
+		ec->UpdateDownloadLimit();
+		break;
+	case OBS_FRONTEND_EVENT_STREAMING_STOPPED:
+		ec->_streaming = false;
+		ec->UpdateDownloadLimit();
+		break;
+	case OBS_FRONTEND_EVENT_RECORDING_STARTED:
+		ec->_recording = true;
+		ec->UpdateDownloadLimit();
+		break;
+	case OBS_FRONTEND_EVENT_RECORDING_STOPPED:
+		ec->_recording = false;
+		ec->UpdateDownloadLimit();
+		break;
 	default:
 		break;
 	}
@@ -161,6 +192,25 @@ void ElgatoCloud::SaveConfig()
 	save_module_config(_config);
 }
 
+void ElgatoCloud::UpdateDownloadLimit()
+{
+	// The tighter of the caps that apply wins, 0 means no cap
+	int64_t limit = 0;
+	auto cap = [&limit](int64_t kbps) {
+		if (kbps > 0 && (limit == 0 || kbps < limit)) {
+			limit = kbps;
+		}
+	};
+	if (_streaming) {
+		cap(obs_data_get_int(_config, "DownloadLimitStreaming"));
+	}
+	if (_recording) {
+		cap(obs_data_get_int(_config, "DownloadLimitRecording"));
+	}
+	auto dl = Downloader::getInstance("");
+	dl->SetBandwidthLimit((uint64_t)limit * 1024);
+}
+
 obs_module_t *ElgatoCloud::GetModule()
 {
 	return _modulePtr;
@@ -173,49 +223,16 @@ void ElgatoCloud::Thread()
 
 std::string ElgatoCloud::GetAccessToken()
 {
-	if (!loggedIn) {
-		return "";
-	}
-	_TokenRefresh(false, false);
-	if (loggedIn) {
-		return _accessToken;
-	} else { // Our refresh token has expired, we're not really logged in.
-		return "";
-	}
+	return loggedIn ? _accessToken : "";
 }
 
 std::string ElgatoCloud::GetRefreshToken()
 {
-	if (!loggedIn) {
-		return "";
-	}
-	_TokenRefresh(false, false);
-	if (loggedIn) {
-		return _refreshToken;
-	}
-	else { // Our refresh token has expired, we're not really logged in.
-		return "";
-	}
+	return loggedIn ? _refreshToken : "";
 }
 
-void ElgatoCloud::_TokenRefresh(bool loadData, bool loadUserDetails)
+void ElgatoCloud::_TokenRefreshRequest(std::string &url, std::string &postData)
 {
-	const auto now = std::chrono::system_clock::now();
-	const auto epoch = now.time_since_epoch();
-	const auto seconds =
-		std::chrono::duration_cast<std::chrono::seconds>(epoch);
-	if (seconds.count() < _accessTokenExpiration) {
-		loggedIn = true;
-		loading = loadData;
-		if (loadUserDetails) {
-			_LoadUserData();
-		}
-		if (loadData) {
-			LoadPurchasedProducts();
-		}
-		return;
-	}
-	obs_log(LOG_INFO, "Access Token has expired. Fetching a new token.");
 	auto api = MarketplaceApi::getInstance();
 
 	std::map<std::string, std::string> queryParams = {
@@ -224,24 +241,66 @@ void ElgatoCloud::_TokenRefresh(bool loadData, bool loadUserDetails)
 		{ID_KEY, ID}
 	};
 
-	std::string url = api->getAuthUrl(tokenEndpointSegments, queryParams);
-	std::string encodeddata = queryString(queryParams);
-	auto response = fetch_string_from_post(url, encodeddata);
-	try {
-		auto responseJson = nlohmann::json::parse(response);
-		_ProcessLogin(responseJson, loadData);
-	} catch (...) {
+	url = api->getAuthUrl(tokenEndpointSegments, queryParams);
+	postData = queryString(queryParams);
+}
+
+HttpCall ElgatoCloud::RefreshAccessToken()
+{
+	std::lock_guard<std::mutex> lock(_tokenLock);
+	if (!_tokenRefresh.Done()) {
+		return _tokenRefresh.Share();
+	}
+	const auto now = std::chrono::system_clock::now();
+	const auto epoch = now.time_since_epoch();
+	const auto seconds =
+		std::chrono::duration_cast<std::chrono::seconds>(epoch);
+	if (seconds.count() < _accessTokenExpiration) {
+		return HttpCall::Resolved(HttpResult());
+	}
+	obs_log(LOG_INFO, "Access Token has expired. Fetching a new token.");
+	std::string url;
+	std::string encodeddata;
+	_TokenRefreshRequest(url, encodeddata);
+	auto refresh = HttpClient::getInstance()->Post(url, encodeddata);
+	uint64_t login = _logins;
+	_tokenRefresh = refresh.Chain(HttpThread::MAIN, [this, login](
+							      const HttpResult &result) {
+		if (login != _logins) {
+			// Logged out meanwhile. The response goes to LogOut(),
+			// which ends the new tokens on the server.
+			return HttpCall::Resolved(result);
+		}
+		if (!result.ok() || result.status >= 500) {
+			// Says nothing about the refresh token, so the user stays
+			// logged in
+			HttpResult failed = result;
+			if (failed.code == CURLE_OK) {
+				failed.code = CURLE_COULDNT_CONNECT;
+				failed.body = "{\"error\": \"Unspecified Error\"}";
+			}
+			return HttpCall::Resolved(failed);
+		}
+		try {
+			auto responseJson = nlohmann::json::parse(result.body);
+			if (_StoreTokens(responseJson)) {
+				return HttpCall::Resolved(result);
+			}
+		} catch (...) {
+		}
 		obs_log(LOG_INFO, "There was a problem with the refresh token.  Try logging in again.");
 		loggedIn = false;
 		loading = false;
 		authorizing = false;
 		loginError = true;
 		if (mainWindowOpen && window) {
-			QMetaObject::invokeMethod(
-				QCoreApplication::instance()->thread(),
-				[this]() { window->setLoggedIn(); });
+			window->setLoggedIn();
 		}
-	}
+		HttpResult failed = result;
+		failed.code = CURLE_LOGIN_DENIED;
+		return HttpCall::Resolved(failed);
+	});
+	return _tokenRefresh.Share();
 }
 
 void ElgatoCloud::_Listen()
@@ -358,6 +417,9 @@ void ElgatoCloud::_Listen()
 void ElgatoCloud::_Initialize()
 {
 	_config = get_module_config();
+	PackCache::getInstance()->SetBudget(
+		(uint64_t)obs_data_get_int(_config, "PackCacheSize") * 1024 *
+		1024);
 	bool makerTools = obs_data_get_bool(_config, "MakerTools");
 	_makerToolsOnStart = makerTools;
 	_streamDeckInfo = getStreamDeckInfo();
@@ -377,7 +439,14 @@ void ElgatoCloud::_Initialize()
 	if (_refreshToken == "" || _refreshTokenExpiration < seconds.count()) {
 		loggedIn = false;
 	} else {
-		_TokenRefresh(false);
+		// Logged in unless the refresh token turns out to be refused
+		loggedIn = true;
+		RefreshAccessToken().Then(HttpThread::MAIN,
+					  [this](const HttpResult &refresh) {
+						  if (refresh.ok()) {
+							  _LoadUserData();
+						  }
+					  });
 		//LoadPurchasedProducts();
 	}
 }
@@ -429,6 +498,16 @@ void ElgatoCloud::LogOut()
 {
 	auto api = MarketplaceApi::getInstance();
 	api->logOut();
+	{
+		// A refresh in flight ends with logOut() rather than logging the
+		// user back in, and the next login starts its own
+		std::lock_guard<std::mutex> lock(_tokenLock);
+		_logins++;
+		_tokenRefresh = HttpCall();
+	}
+	_session.Cancel();
+	_session.Reset();
+	_ClearCatalog();
 
 	_accessToken = "";
 	_refreshToken = "";
@@ -503,92 +582,486 @@ void ElgatoCloud::SetSkipVersion(std::string version)
 	_SaveState();
 }
 
+struct ElgatoCloud::CatalogLoad {
+	HttpCancelToken token;
+	// The catalog shown when the load started, for the pages that
+	// answer 304 and the ones that haven't arrived yet
+	nlohmann::json cached;
+	std::vector<std::string> cachedEtags;
+	int64_t cachedTotal = -1;
+	int64_t total = -1;
+	size_t count = 1; // Pages known to exist, grows page by page if the
+			  // gateway doesn't tell the total
+	size_t next = 1;
+	size_t inFlight = 0;
+	size_t arrived = 0;
+	std::vector<nlohmann::json> pages = std::vector<nlohmann::json>(1);
+	std::vector<bool> done = std::vector<bool>(1, false);
+	std::vector<std::string> etags = std::vector<std::string>(1);
+	bool failed = false;
+
+	void resize(size_t pageCount)
+	{
+		count = pageCount;
+		pages.resize(count);
+		done.resize(count, false);
+		etags.resize(count);
+	}
+};
+
 void ElgatoCloud::LoadPurchasedProducts()
 {
 	if (!loggedIn || !mainWindowOpen || !window) {
 		return;
 	}
-	loading = true;
-	_TokenRefresh(false, false);
 
-	if (mainWindowOpen && window) {
+	// The library of the last load shows right away, and is brought up to
+	// date once the gateway answers
+	auto removed = std::make_shared<
+		std::vector<std::shared_ptr<ElgatoProduct>>>();
+	if (!_catalogLoaded) {
+		_LoadCatalog(*removed);
+	}
+	if (_catalogLoaded) {
+		loading = false;
+		_ShowProducts(removed);
+	} else {
+		loading = true;
+		// The items go away with the loading screen, removed after them
 		QMetaObject::invokeMethod(
 			QCoreApplication::instance()->thread(),
-			[this]() { window->setLoading(); });
+			[this, removed]() { window->setLoading(); });
 	}
 
+	// A newer load supersedes one still in flight
+	if (_catalogLoad) {
+		_catalogLoad->token.Cancel();
+	}
+	auto load = std::make_shared<CatalogLoad>();
+	load->cached = _catalog;
+	load->cachedEtags = _catalogEtags;
+	load->cachedTotal = _catalogTotal;
+	_catalogLoad = load;
+	_FetchCatalogPage(load, 0);
+}
+
+void ElgatoCloud::_FetchCatalogPage(const std::shared_ptr<CatalogLoad> &load,
+				    size_t page)
+{
 	auto api = MarketplaceApi::getInstance();
 
 	std::vector<std::string> segments = { "my-products" };
 	std::map<std::string, std::string> queryParams = {
 		{"extension", "scene-collections"},
-		{"offset", "0"},
-		{"limit", "50"}
+		{"offset", std::to_string(page * CATALOG_PAGE_SIZE)},
+		{"limit", std::to_string(CATALOG_PAGE_SIZE)}
 	};
 
 	std::string api_url = api->getGatewayUrl(segments, queryParams);
+	HttpOptions options;
+	if (page < load->cachedEtags.size()) {
+		options.ifNoneMatch = load->cachedEtags[page];
+	}
 
-	auto productsResponse = fetch_string_from_get(api_url, _accessToken);
-	products.clear();
+	auto call = RefreshAccessToken().Chain(
+		HttpThread::MAIN,
+		[this, api_url, options](const HttpResult &refresh) {
+			if (!refresh.ok()) {
+				return HttpCall::Resolved(refresh);
+			}
+			return HttpClient::getInstance()->Get(
+				api_url, _accessToken, options);
+		});
+	// Read on the client's thread, only the records kept make it to the
+	// UI thread
+	auto parsed = std::make_shared<CatalogPage>();
+	call = call.Chain(HttpThread::CLIENT, [parsed](const HttpResult &result) {
+		HttpResult read = result;
+		if (!result.notModified()) {
+			*parsed = CatalogReader::Read(result.body);
+			read.body.clear();
+		}
+		return HttpCall::Resolved(read);
+	});
+	load->inFlight++;
+	load->token.Track(call);
+	_session.Track(call);
+	if (window) {
+		window->Requests().Track(call);
+	}
+	call.Then(HttpThread::MAIN,
+		  [this, load, page, parsed](const HttpResult &result) {
+			  _ProcessCatalogPage(load, page, result, *parsed);
+		  });
+}
+
+void ElgatoCloud::_FetchCatalogPages(const std::shared_ptr<CatalogLoad> &load)
+{
+	while (load->inFlight < CATALOG_PARALLEL_PAGES &&
+	       load->next < load->count) {
+		_FetchCatalogPage(load, load->next++);
+	}
+}
+
+void ElgatoCloud::_ProcessCatalogPage(const std::shared_ptr<CatalogLoad> &load,
+				      size_t page, const HttpResult &result,
+				      CatalogPage &parsed)
+{
+	if (load != _catalogLoad || load->failed) {
+		return;
+	}
+	load->inFlight--;
+	// A failed token refresh has been shown already
+	if (result.code == CURLE_LOGIN_DENIED) {
+		load->failed = true;
+		load->token.Cancel();
+		return;
+	}
+
+	nlohmann::json results = nlohmann::json::array();
+	int64_t total = -1;
+	std::string error;
+	if (result.notModified()) {
+		size_t begin = page * CATALOG_PAGE_SIZE;
+		if (page >= load->cachedEtags.size() ||
+		    begin > load->cached.size()) {
+			error = "Unspecified Error";
+		} else {
+			size_t end = std::min(begin + CATALOG_PAGE_SIZE,
+					      load->cached.size());
+			for (size_t i = begin; i < end; ++i) {
+				results.push_back(load->cached[i]);
+			}
+			load->etags[page] = load->cachedEtags[page];
+			total = load->cachedTotal;
+		}
+	} else if (!parsed.valid) {
+		error = "General Connection Error";
+	} else if (parsed.failed) {
+		error = parsed.error;
+	} else if (result.status >= 500) {
+		error = "Unspecified Error";
+	} else {
+		results = std::move(parsed.results);
+		load->etags[page] = result.etag;
+		total = parsed.total;
+	}
+	if (error != "") {
+		_CatalogFailed(load, error);
+		return;
+	}
+
+	bool full = results.size() >= CATALOG_PAGE_SIZE;
+	if (page == 0) {
+		load->total = total;
+		if (total >= 0) {
+			load->resize(std::max<size_t>(
+				1, ((size_t)total + CATALOG_PAGE_SIZE - 1) /
+					   CATALOG_PAGE_SIZE));
+		} else {
+			load->resize(full ? 2 : 1);
+		}
+	} else if (load->total < 0 && page == load->count - 1 && full) {
+		load->resize(load->count + 1);
+	}
+	load->pages[page] = std::move(results);
+	load->done[page] = true;
+	load->arrived++;
+
+	bool complete = load->arrived == load->count;
+	if (complete) {
+		offline = false;
+	}
+	_ApplyCatalogPages(load);
+	if (load->failed) {
+		return;
+	}
+	if (!complete) {
+		_FetchCatalogPages(load);
+		return;
+	}
+	_catalogEtags = load->etags;
+	_catalogTotal = load->total;
+	_SaveCatalog();
+}
+
+void ElgatoCloud::_ApplyCatalogPages(const std::shared_ptr<CatalogLoad> &load)
+{
+	nlohmann::json results = nlohmann::json::array();
+	for (size_t page = 0; page < load->count; ++page) {
+		if (load->done[page]) {
+			for (auto &pdat : load->pages[page]) {
+				results.push_back(pdat);
+			}
+			continue;
+		}
+		size_t begin = page * CATALOG_PAGE_SIZE;
+		size_t end = std::min(begin + CATALOG_PAGE_SIZE,
+				      load->cached.size());
+		for (size_t i = begin; i < end; ++i) {
+			results.push_back(load->cached[i]);
+		}
+	}
+
+	auto removed = std::make_shared<
+		std::vector<std::shared_ptr<ElgatoProduct>>>();
+	try {
+		_ApplyProducts(results, *removed);
+	} catch (...) {
+		_CatalogFailed(load, "General Connection Error");
+		return;
+	}
+	_catalog = results;
+	_catalogLoaded = true;
+	loading = false;
+	connectionError = false;
 	_error = "";
+	_ShowProducts(removed);
+}
+
+void ElgatoCloud::_CatalogFailed(const std::shared_ptr<CatalogLoad> &load,
+				 const std::string &error)
+{
+	load->failed = true;
+	load->token.Cancel();
+	loading = false;
+	_error = error;
+	if (load->arrived > 0) {
+		// The pages shown may be from two different catalogs now
+		_catalogEtags.clear();
+	}
+
+	if (_catalogLoaded) {
+		// Still better than an error, the library stays up read-only
+		obs_log(LOG_WARNING,
+			"Could not refresh the library (%s), showing the last one loaded.",
+			_error.c_str());
+		offline = true;
+		connectionError = false;
+		if (mainWindowOpen && window) {
+			QTimer::singleShot(CATALOG_RETRY_MS, window,
+					   [this]() { LoadPurchasedProducts(); });
+		}
+	} else {
+		connectionError = true;
+	}
+	_ShowProducts(nullptr);
+}
+
+void ElgatoCloud::_ApplyProducts(
+	const nlohmann::json &results,
+	std::vector<std::shared_ptr<ElgatoProduct>> &removed)
+{
+	if (_catalogLoaded && results == _catalog) {
+		return;
+	}
+
+	std::map<std::string, const nlohmann::json *> previous;
+	for (auto &pdat : _catalog) {
+		if (pdat.contains("id") && pdat["id"].is_string()) {
+			previous[pdat["id"]] = &pdat;
+		}
+	}
+	std::map<std::string, std::shared_ptr<ElgatoProduct>> current;
+	for (auto &product : products) {
+		if (current.count(product->id)) {
+			removed.push_back(std::move(product));
+		} else {
+			current[product->id] = std::move(product);
+		}
+	}
+	products.clear();
+
+	// Made before products is filled again, so a bad entry leaves the
+	// products that were there in current rather than half replaced
+	std::vector<std::string> ids;
+	std::vector<std::shared_ptr<ElgatoProduct>> made(results.size());
 	try {
-		auto productsJson = nlohmann::json::parse(productsResponse);
-		if (productsJson["results"].is_array()) {
-			for (auto &pdat : productsJson["results"]) {
-				products.emplace_back(
-					std::make_unique<ElgatoProduct>(pdat));
+		for (size_t i = 0; i < results.size(); ++i) {
+			nlohmann::json pdat = results[i];
+			std::string id = pdat.at("id");
+			auto before = previous.find(id);
+			bool unchanged = before != previous.end() &&
+					 *before->second == pdat &&
+					 current.count(id) &&
+					 std::find(ids.begin(), ids.end(), id) ==
+						 ids.end();
+			ids.push_back(id);
+			if (!unchanged) {
+				made[i] = std::make_shared<ElgatoProduct>(pdat);
 			}
 		}
-		if (productsJson.contains("error")) {
-			connectionError = true;
-			_error = productsJson["error"];
+	} catch (...) {
+		for (auto &left : current) {
+			products.push_back(std::move(left.second));
 		}
-		loading = false;
-		if (mainWindowOpen && window) {
-			QMetaObject::invokeMethod(
-				QCoreApplication::instance()->thread(),
-				[this]() {
-					window->setLoggedIn();
-					if (!connectionError) {
-						window->setupOwnedProducts();
+		throw;
+	}
+
+	for (size_t i = 0; i < ids.size(); ++i) {
+		if (!made[i]) {
+			auto found = current.find(ids[i]);
+			made[i] = std::move(found->second);
+			current.erase(found);
+		} else {
+			made[i]->RefreshThumbnail();
+		}
+		products.push_back(std::move(made[i]));
+	}
+	for (auto &left : current) {
+		removed.push_back(std::move(left.second));
+	}
+}
+
+void ElgatoCloud::_ShowProducts(
+	std::shared_ptr<std::vector<std::shared_ptr<ElgatoProduct>>> removed)
+{
+	if (!mainWindowOpen || !window) {
+		return;
+	}
+	QMetaObject::invokeMethod(
+		QCoreApplication::instance()->thread(), [this, removed]() {
+			// Products that left the library take their downloads
+			// with them, the others were replaced by a newer record
+			// and only have theirs stopped with their item
+			if (removed) {
+				for (auto &product : *removed) {
+					bool listed = std::any_of(
+						products.begin(),
+						products.end(),
+						[&product](auto &p) {
+							return p->id ==
+							       product->id;
+						});
+					if (!listed) {
+						product->Discard();
 					}
-				});
+				}
+			}
+			if (!mainWindowOpen || !window) {
+				return;
+			}
+			window->setLoggedIn();
+			if (!connectionError) {
+				window->setupOwnedProducts();
+			}
+			// removed goes with the last of these, after the items
+			// showing its products are gone
+		});
+}
+
+std::string ElgatoCloud::_CatalogPath() const
+{
+	std::string path = QDir::homePath().toStdString();
+	path += getUserDataDir();
+	os_mkdirs(path.c_str());
+	return path + "/" + CATALOG_FILE;
+}
+
+bool ElgatoCloud::_LoadCatalog(
+	std::vector<std::shared_ptr<ElgatoProduct>> &removed)
+{
+	std::string path = _CatalogPath();
+	if (!os_file_exists(path.c_str())) {
+		return false;
+	}
+	try {
+		std::ifstream f(path);
+		auto record = nlohmann::json::parse(f);
+		// Someone else's library, if the user data loaded already
+		auto api = MarketplaceApi::getInstance();
+		if (api->id() != "" && record.value("user", "") != api->id()) {
+			return false;
 		}
-	} catch (...) {
-		loading = false;
-		connectionError = true;
-		_error = "General Connection Error"; 
-		if (mainWindowOpen && window) {
-			QMetaObject::invokeMethod(
-				QCoreApplication::instance()->thread(),
-				[this]() { window->setLoggedIn(); });
+		auto results = record.at("results");
+		if (!results.is_array()) {
+			return false;
 		}
+		_ApplyProducts(results, removed);
+		_catalog = results;
+		_catalogEtags = record.value("etags", std::vector<std::string>());
+		_catalogTotal = record.value("total", (int64_t)-1);
+		_catalogLoaded = true;
+		obs_log(LOG_INFO, "Library loaded from the copy fetched at %lld.",
+			(long long)record.value("fetched_at", (int64_t)0));
+	} catch (...) {
+		obs_log(LOG_WARNING, "The saved library could not be loaded.");
+		return false;
 	}
+	return true;
 }
 
-nlohmann::json ElgatoCloud::GetPurchaseDownloadLink(std::string variantId)
+void ElgatoCloud::_SaveCatalog()
 {
-	if (!loggedIn) {
-		return nlohmann::json::parse("{\"Error\": \"Not Logged In\"}");
+	const auto now = std::chrono::system_clock::now();
+	const auto seconds = std::chrono::duration_cast<std::chrono::seconds>(
+		now.time_since_epoch());
+	auto api = MarketplaceApi::getInstance();
+	nlohmann::json record = {{"user", api->id()},
+				 {"etags", _catalogEtags},
+				 {"total", _catalogTotal},
+				 {"fetched_at", (int64_t)seconds.count()},
+				 {"results", _catalog}};
+	std::string path = _CatalogPath();
+	std::string tmp = path + ".tmp";
+	std::ofstream f(tmp, std::ios::trunc);
+	f << record.dump();
+	f.close();
+	if (f.fail()) {
+		os_unlink(tmp.c_str());
+		return;
 	}
+	if (os_safe_replace(path.c_str(), tmp.c_str(), nullptr) != 0) {
+		os_unlink(tmp.c_str());
+	}
+}
 
-	_TokenRefresh(false, false);
+void ElgatoCloud::_ClearCatalog()
+{
+	os_unlink(_CatalogPath().c_str());
+	if (_catalogLoad) {
+		_catalogLoad->token.Cancel();
+		_catalogLoad = nullptr;
+	}
+	_catalog = nullptr;
+	_catalogEtags.clear();
+	_catalogTotal = -1;
+	_catalogLoaded = false;
+	offline = false;
+}
+
+HttpCall ElgatoCloud::GetPurchaseDownloadLinkAsync(std::string variantId)
+{
+	if (!loggedIn) {
+		HttpResult result;
+		result.body = "{\"Error\": \"Not Logged In\"}";
+		return HttpCall::Resolved(result);
+	}
 
 	auto api = MarketplaceApi::getInstance();
 	std::string api_url = api->gatewayUrl();
 	api_url += "/items/" + variantId + "/direct-link";
-	auto response = fetch_string_from_get(api_url, _accessToken);
-	// Todo- Error checking
-	try {
-		auto responseJson = nlohmann::json::parse(response);
-		return responseJson;
-	} catch (...) {
-		return nlohmann::json::parse(
-			"{\"Error\": \"Invalid Response\"}");
-	}
+	auto call = RefreshAccessToken().Chain(
+		HttpThread::MAIN, [this, api_url](const HttpResult &refresh) {
+			if (!refresh.ok()) {
+				return HttpCall::Resolved(refresh);
+			}
+			return HttpClient::getInstance()->Get(api_url,
+							      _accessToken);
+		});
+	_session.Track(call);
+	return call;
 }
 
+
 void ElgatoCloud::_ProcessLogin(nlohmann::json &loginData, bool loadData)
+{
+	if (_StoreTokens(loginData)) {
+		_LoadUserData(loadData);
+	}
+}
+
+bool ElgatoCloud::_StoreTokens(nlohmann::json &loginData)
 {
 	try {
 		connectionError = false;
@@ -619,42 +1092,41 @@ void ElgatoCloud::_ProcessLogin(nlohmann::json &loginData, bool loadData)
 		loading = false;
 		connectionError = false;
 		//connectionError = true;
-		return;
+		return false;
 	} catch (...) {
 		obs_log(LOG_INFO, "Some other issue occurred");
 		connectionError = true;
-		return;
+		return false;
 	}
-	_LoadUserData(loadData);
+	return true;
 }
 
 void ElgatoCloud::_LoadUserData(bool loadData)
 {
-	try {
-		auto api = MarketplaceApi::getInstance();
-		std::string api_url = api->gatewayUrl();
-		api_url += "/user";
-		auto userResponse =
-			fetch_string_from_get(api_url, _accessToken);
-		auto userData = nlohmann::json::parse(userResponse);
-		api->setUserDetails(userData);
+	auto api = MarketplaceApi::getInstance();
+	std::string api_url = api->gatewayUrl();
+	api_url += "/user";
+	auto userCall = HttpClient::getInstance()->Get(api_url, _accessToken);
+	_session.Track(userCall);
+	userCall.Then(HttpThread::MAIN, [this, loadData](const HttpResult &result) {
+		try {
+			auto userData = nlohmann::json::parse(result.body);
+			MarketplaceApi::getInstance()->setUserDetails(userData);
+		} catch (...) {
+			obs_log(LOG_INFO, "Invalid response from server");
+			loginError = true;
+			return;
+		}
 		if (mainWindowOpen && window) {
-			QMetaObject::invokeMethod(
-				QCoreApplication::instance()->thread(),
-				[this, loadData]() {
-					if (loadData) {
-						loading = true;
-					}
-					window->setLoggedIn();
-					if (loadData) {
-						LoadPurchasedProducts();
-					}
-				});
+			if (loadData) {
+				loading = true;
+			}
+			window->setLoggedIn();
+			if (loadData) {
+				LoadPurchasedProducts();
+			}
 		}
-	} catch (...) {
-		obs_log(LOG_INFO, "Invalid response from server");
-		loginError = true;
-	}
+	});
 }
 
 void ElgatoCloud::_SaveState()
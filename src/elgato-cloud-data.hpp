@@ -30,6 +30,7 @@ with this program. If not, see <https://www.gnu.org/licenses/>
 #include <nlohmann/json.hpp>
 
 #include "elgato-product.hpp"
+#include "http-client.hpp"
 #include "util.h"
 
 namespace elgatocloud {
@@ -39,6 +40,7 @@ class ElgatoCloud;
 extern ElgatoCloud *elgatoCloud;
 
 class ElgatoCloudWindow;
+struct CatalogPage;
 
 ElgatoCloud *GetElgatoCloud();
 
@@ -47,12 +49,13 @@ public:
 	ElgatoCloudThread *th = nullptr;
 	std::mutex m;
 	std::unique_lock<std::mutex> *mainLoopLock = nullptr;
-	std::vector<std::unique_ptr<ElgatoProduct>> products;
+	std::vector<std::shared_ptr<ElgatoProduct>> products;
 
 	ElgatoCloud(obs_module_t *m);
 	~ElgatoCloud();
 	void StartLogin();
 	void LogOut();
+	// Loads in the background, call from the UI thread
 	void LoadPurchasedProducts();
 	void CheckUpdates(bool forceCheck);
 	inline void SetScData(nlohmann::json data) { _scData = data; }
@@ -62,9 +65,21 @@ public:
 	obs_data_t *GetConfig();
 	void SetSkipVersion(std::string version);
 	void SaveConfig();
+	// Applies the configured download caps for the current streaming and
+	// recording state
+	void UpdateDownloadLimit();
+	// The tokens as they are, "" when logged out. Current once
+	// RefreshAccessToken() resolved.
 	std::string GetAccessToken();
 	std::string GetRefreshToken();
-	nlohmann::json GetPurchaseDownloadLink(std::string variantId);
+	// Resolves once the access token can be used. Callers share the
+	// refresh in flight, as the refresh token is spent by it. Fails with
+	// CURLE_LOGIN_DENIED, after logging the user out, if it can't be
+	// refreshed.
+	HttpCall RefreshAccessToken();
+	// Resolves with the direct-link response, refreshing the access
+	// token first if it expired
+	HttpCall GetPurchaseDownloadLinkAsync(std::string variantId);
 	StreamDeckInfo GetStreamDeckInfo() const { return _streamDeckInfo; }
 	std::string GetErrorCode() const { return _error; }
 
@@ -75,6 +90,9 @@ public:
 	bool connectionError = false;
 	bool loginError = false;
 	bool loggingIn = false;
+	// The gateway couldn't be reached, products are the ones of the last
+	// catalog that loaded and can't be downloaded
+	bool offline = false;
 
 	void Thread();
 	bool mainWindowOpen = false;
@@ -87,9 +105,38 @@ private:
 	void _Initialize();
 	void _Listen();
 	void _ProcessLogin(nlohmann::json &loginData, bool loadData = true);
+	bool _StoreTokens(nlohmann::json &loginData);
+	// One load of the catalog, in pages of CATALOG_PAGE_SIZE
+	struct CatalogLoad;
+	void _FetchCatalogPage(const std::shared_ptr<CatalogLoad> &load,
+			       size_t page);
+	void _FetchCatalogPages(const std::shared_ptr<CatalogLoad> &load);
+	void _ProcessCatalogPage(const std::shared_ptr<CatalogLoad> &load,
+				 size_t page, const HttpResult &result,
+				 CatalogPage &parsed);
+	// Shows the pages there are so far, with the last catalog standing in
+	// for the others
+	void _ApplyCatalogPages(const std::shared_ptr<CatalogLoad> &load);
+	void _CatalogFailed(const std::shared_ptr<CatalogLoad> &load,
+			    const std::string &error);
+	// Makes products match results, keeping the products that didn't
+	// change. The ones replaced or gone are moved to removed, as the
+	// window's items may still point at them.
+	void _ApplyProducts(const nlohmann::json &results,
+			    std::vector<std::shared_ptr<ElgatoProduct>> &removed);
+	// Shows products in the window, once it's done with removed
+	void _ShowProducts(
+		std::shared_ptr<std::vector<std::shared_ptr<ElgatoProduct>>>
+			removed);
+	// The last catalog that loaded, kept on disk so the library shows up
+	// before, or without, the gateway answering
+	std::string _CatalogPath() const;
+	bool _LoadCatalog(std::vector<std::shared_ptr<ElgatoProduct>> &removed);
+	void _SaveCatalog();
+	void _ClearCatalog();
 	void _SaveState();
 	void _GetSavedState();
-	void _TokenRefresh(bool loadData, bool loadUserDetails = true);
+	void _TokenRefreshRequest(std::string &url, std::string &postData);
 	void _LoadUserData(bool loadData = false);
 
 	obs_module_t *_modulePtr = nullptr;
@@ -107,10 +154,25 @@ private:
 	bool _makerToolsOnStart;
 	bool _openOnLaunch;
 	bool _obsReady;
+	bool _streaming = false;
+	bool _recording = false;
 	nlohmann::json _scData;
 	bool _elgatoCollectionActive;
 	StreamDeckInfo _streamDeckInfo;
 	std::string _error;
+	std::shared_ptr<CatalogLoad> _catalogLoad; // The latest
+	nlohmann::json _catalog; // The "results" products were made from
+	// Of each page of _catalog, empty unless all of them came from the
+	// same load
+	std::vector<std::string> _catalogEtags;
+	int64_t _catalogTotal = -1; // -1 if the gateway didn't say
+	bool _catalogLoaded = false;
+	// Everything requested for the logged in user, cancelled on logout
+	HttpCancelToken _session;
+	std::mutex _tokenLock; // Guards the two below
+	HttpCall _tokenRefresh; // The refresh in flight, if it isn't done
+	// Bumped on logout, so a refresh in flight doesn't log the user back in
+	uint64_t _logins = 0;
 };
 
 class ElgatoCloudThread : public QThread {
@@ -20,6 +20,7 @@ with this program. If not, see <https://www.gnu.org/licenses/>
 #include "elgato-styles.hpp"
 #include "scene-collection-info.hpp"
 
+#include <map>
 #include <curl/curl.h>
 #include <obs-frontend-api.h>
 #include <QMainWindow>
@@ -36,6 +37,7 @@ with this program. If not, see <https://www.gnu.org/licenses/>
 #include <QPalette>
 #include <QPainterPath>
 #include <QProgressBar>
+#include <QScrollBar>
 #include <QtConcurrent/QtConcurrent>
 #include <QApplication>
 #include <QThread>
@@ -410,17 +412,38 @@ ProductGrid::~ProductGrid() {}
 
 size_t ProductGrid::loadProducts()
 {
+	// Items of products that are still there stay as they are, with their
+	// thumbnail and download
+	std::map<ElgatoProduct *, QWidget *> items;
 	QLayoutItem *item;
 	while ((item = layout()->takeAt(0)) != NULL) {
-		delete item->widget();
+		auto productItem =
+			dynamic_cast<ElgatoProductItem *>(item->widget());
+		if (productItem) {
+			items[productItem->product()] = productItem;
+		} else {
+			delete item->widget();
+		}
 		delete item;
 	}
 
 	for (auto &product : elgatoCloud->products) {
-		auto widget = new ElgatoProductItem(this, product.get());
+		auto found = items.find(product.get());
+		QWidget *widget;
+		if (found != items.end()) {
+			widget = found->second;
+			items.erase(found);
+		} else {
+			widget = new ElgatoProductItem(this, product.get());
+		}
 		layout()->addWidget(widget);
 	}
+	for (auto &left : items) {
+		delete left.second;
+	}
 	repaint();
+	// Items only know whether they're visible once laid out
+	QTimer::singleShot(0, this, [this]() { updateVisibility(); });
 	return elgatoCloud->products.size();
 }
 
@@ -453,6 +476,17 @@ void ProductGrid::resetDownloads()
 	}
 }
 
+// Called when the scroll area moves or resizes, so thumbnails that came into
+// view are fetched before the ones still offscreen.
+void ProductGrid::updateVisibility()
+{
+	for (int i = 0; i < layout()->count(); ++i) {
+		auto item = dynamic_cast<ElgatoProductItem *>(
+			layout()->itemAt(i)->widget());
+		item->updateVisibility();
+	}
+}
+
 void ProductGrid::closing() {
 	for (int i = 0; i < layout()->count(); ++i) {
 		auto item = dynamic_cast<ElgatoProductItem*>(
@@ -652,11 +686,23 @@ OwnedProducts::OwnedProducts(QWidget *parent) : QWidget(parent)
 	npLayout->addLayout(hLayout);
 	npLayout->addStretch();
 	scroll->setWidget(_purchased);
+	connect(scroll->verticalScrollBar(), &QScrollBar::valueChanged, this,
+		[this]() { _purchased->updateVisibility(); });
+	connect(scroll->verticalScrollBar(), &QScrollBar::rangeChanged, this,
+		[this]() { _purchased->updateVisibility(); });
 	_content->addWidget(scroll);
 	_content->addWidget(_installed);
 	_content->addWidget(noProducts);
+	_offlineNotice = new QLabel(
+		obs_module_text("MarketplaceWindow.Purchased.Offline"), this);
+	_offlineNotice->setStyleSheet(EBlankSlateSubTitleStyle);
+	_offlineNotice->setWordWrap(true);
+	_offlineNotice->setHidden(true);
+	auto contentLayout = new QVBoxLayout();
+	contentLayout->addWidget(_offlineNotice);
+	contentLayout->addWidget(_content);
 	_layout->addLayout(sideLayout);
-	_layout->addWidget(_content);
+	_layout->addLayout(contentLayout);
 	setLayout(_layout);
 }
 
@@ -666,6 +712,14 @@ void OwnedProducts::refreshProducts()
 {
 	if (elgatoCloud->loggedIn) {
 		_numProducts = _purchased->loadProducts();
+		// Offline the library is only there to look at
+		if (elgatoCloud->offline) {
+			_purchased->disableDownload();
+		} else if (_offline) {
+			_purchased->enableDownload();
+		}
+		_offline = elgatoCloud->offline;
+		_offlineNotice->setHidden(!_offline);
 		if (_numProducts == 0) {
 			_content->setCurrentIndex(2);
 		} else {
@@ -691,8 +745,7 @@ ElgatoCloudWindow::ElgatoCloudWindow(QWidget *parent) : QDialog(parent)
 	elgatoCloud->window = this;
 	if (elgatoCloud->loggedIn) {
 		loading = true;
-		QFuture<void> future = QtConcurrent::run(
-			[]() { elgatoCloud->LoadPurchasedProducts(); });
+		elgatoCloud->LoadPurchasedProducts();
 	} else {
 		loading = false;
 	}
@@ -703,6 +756,7 @@ ElgatoCloudWindow::ElgatoCloudWindow(QWidget *parent) : QDialog(parent)
 
 ElgatoCloudWindow::~ElgatoCloudWindow()
 {
+	_requests.Cancel();
 	if (elgatoCloud) {
 		elgatoCloud->loggingIn = false;
 		elgatoCloud->mainWindowOpen = false;
@@ -793,6 +847,8 @@ void ElgatoCloudWindow::closeEvent(QCloseEvent* event)
 	//       to close the window if an active download is in
 	//       progress?
 	_ownedProducts->closing();
+	_requests.Cancel();
+	_requests.Reset();
 	event->accept();
 }
 
@@ -1202,12 +1258,21 @@ ElgatoProductItem::ElgatoProductItem(QWidget *parent, ElgatoProduct *product)
 
 ElgatoProductItem::~ElgatoProductItem() {
 	_product->StopProductDownload();
+	// The product may outlive its item while a download holds on to it
+	if (_product->ProductItem() == this) {
+		_product->SetProductItem(nullptr);
+	}
 }
 
 void ElgatoProductItem::closing() {
 	_product->StopProductDownload();
 }
 
+void ElgatoProductItem::updateVisibility()
+{
+	_product->SetThumbnailVisible(!visibleRegion().isEmpty());
+}
+
 void ElgatoProductItem::resetDownload()
 {
 	//_labelDownload->setCurrentIndex(0);
@@ -1665,6 +1730,8 @@ extern void InitElgatoCloud(obs_module_t *module)
 
 extern void ShutDown()
 {
+	// Pending requests would otherwise call back into what is deleted
+	HttpClient::ShutDown();
 	delete elgatoCloud;
 }
 
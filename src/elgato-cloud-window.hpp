@@ -169,6 +169,8 @@ public:
 	void disableDownload();
 	void enableDownload();
 	void closing();
+	void updateVisibility();
+	inline ElgatoProduct *product() const { return _product; }
 
 private:
 	ElgatoProduct* _product;
@@ -210,6 +212,7 @@ public:
 	void enableDownload();
 	void resetDownloads();
 	void closing();
+	void updateVisibility();
 
 private:
 	FlowLayout *_layout;
@@ -247,7 +250,9 @@ private:
 	QStackedWidget *_content = nullptr;
 	Placeholder *_installed = nullptr;
 	ProductGrid *_purchased = nullptr;
+	QLabel *_offlineNotice = nullptr;
 	size_t _numProducts = 0;
+	bool _offline = false;
 };
 
 class LoginNeeded : public QWidget {
@@ -303,6 +308,8 @@ public:
 	void setLoading();
 	void setupOwnedProducts();
 	void resetDownloads();
+	// Requests made for what the window shows, cancelled when it closes
+	inline HttpCancelToken &Requests() { return _requests; }
 
 	static ElgatoCloudWindow *window;
 
@@ -323,6 +330,7 @@ private:
 	OwnedProducts *_ownedProducts = nullptr;
 	ElgatoCloudConfig *_config = nullptr;
 	int _retries = 2;
+	HttpCancelToken _requests;
 };
 
 void OpenElgatoCloudWindow();
@@ -30,6 +30,7 @@ with this program. If not, see <https://www.gnu.org/licenses/>
 #include <QMetaObject>
 #include <QInputDialog>
 #include <QDir>
+#include <QLocale>
 #include "scene-bundle.hpp"
 
 #include <obs-frontend-api.h>
@@ -38,9 +39,19 @@ with this program. If not, see <https://www.gnu.org/licenses/>
 #include "elgato-cloud-data.hpp"
 #include "elgato-cloud-window.hpp"
 #include "util.h"
+#include "platform.h"
 #include "setup-wizard.hpp"
+#include "pack-cache.hpp"
+#include "pack-stream.hpp"
 
 
+// Revalidate cached product art after this many seconds, unless the CDN
+// says otherwise
+#define THUMBNAIL_MAX_AGE (24 * 60 * 60)
+// Packs at least this big are extracted while they download, so the setup
+// wizard opens before the download is done
+#define PACK_STREAM_MIN_SIZE (64ULL * 1024 * 1024)
+
 namespace elgatocloud {
 
 ElgatoProduct::ElgatoProduct(nlohmann::json &productData) : _fileSize(0)
@@ -68,11 +79,9 @@ ElgatoProduct::ElgatoProduct(nlohmann::json &productData) : _fileSize(0)
 	auto filename = thumbnailUrl.substr(found + 1);
 	thumbnailPath = thumbnailPath + "/" + filename;
 
-	if (!os_file_exists(thumbnailPath.c_str())) {
-		_downloadThumbnail();
-	} else {
-		_thumbnailReady = true;
-	}
+	// A cached thumbnail is shown right away and revalidated in the
+	// background once stale, see RefreshThumbnail()
+	_thumbnailReady = os_file_exists(thumbnailPath.c_str());
 }
 
 ElgatoProduct::ElgatoProduct(std::string collectionName)
@@ -88,9 +97,34 @@ ElgatoProduct::ElgatoProduct(std::string collectionName)
 
 bool ElgatoProduct::DownloadProduct()
 {
+	// The download starts once the link arrives, without holding up the
+	// UI in the meantime
 	auto ec = GetElgatoCloud();
-	nlohmann::json dlData = ec->GetPurchaseDownloadLink(variantId);
-	if (dlData.contains("error")) {
+	_linkCall.Cancel();
+	_linkCall = ec->GetPurchaseDownloadLinkAsync(variantId);
+	// The product item it reports back to goes away with the window
+	auto window = GetElgatoCloudWindow();
+	if (window) {
+		window->Requests().Track(_linkCall);
+	}
+	_linkCall.Then(HttpThread::MAIN, [this](const HttpResult &result) {
+		nlohmann::json dlData;
+		try {
+			dlData = nlohmann::json::parse(result.body);
+		} catch (...) {
+			dlData = {{"error", "Invalid Response"}};
+		}
+		if (!_startDownload(dlData) && _productItem) {
+			_productItem->resetDownload();
+		}
+	});
+	return true;
+}
+
+bool ElgatoProduct::_startDownload(nlohmann::json &dlData)
+{
+	if (dlData.contains("error") || !dlData.contains("direct_link") ||
+	    !dlData["direct_link"].is_string()) {
 		// Pop up a modal telling the user the download couldn't happen.
 		QMessageBox msgBox;
 		msgBox.setText(
@@ -121,15 +155,211 @@ bool ElgatoProduct::DownloadProduct()
 	savePath += getUserDataDir() + "/Downloads/";
 	os_mkdirs(savePath.c_str());
 
+	_sha256 = "";
+	if (dlData.contains("sha256") && dlData["sha256"].is_string()) {
+		_sha256 = dlData["sha256"];
+	}
+	std::atomic_store(&_stream, std::shared_ptr<PackStream>());
+	// Installed or merged before. The wizard deletes the archive it is
+	// given once done, so it gets a link to the cached copy. A copy
+	// without a digest is checked with the server first, without
+	// holding up the UI.
+	std::weak_ptr<ElgatoProduct> weak = weak_from_this();
+	_linkCall = PackCache::getInstance()->Find(
+		variantId, _sha256, url,
+		[weak, url, savePath](const std::string &cached) {
+			auto ep = weak.lock();
+			if (!ep) {
+				return;
+			}
+			std::string link = savePath + "cached-" +
+					   random_name() + ".elgatoscene";
+			if (cached != "" && link_file(cached, link)) {
+				ep->downloadId_ = 0;
+				ep->downloading_ = false;
+				Install(link, ep.get(), true);
+				return;
+			}
+			ep->_enqueueDownload(url, savePath);
+		});
+	auto window = GetElgatoCloudWindow();
+	if (window) {
+		window->Requests().Track(_linkCall);
+	}
+	return true;
+}
+
+void ElgatoProduct::_enqueueDownload(const std::string &url,
+				     const std::string &savePath)
+{
+	auto ec = GetElgatoCloud();
+	DownloadOptions options;
+	options.priority = DownloadPriority::INTERACTIVE;
+	options.expectedSize = _fileSize;
+	options.segmented = true;
+	// Installed straight after the move, so it has to survive a crash
+	options.durable = true;
+	// The direct link is signed and expires
+	options.refreshUrl = ElgatoProduct::RefreshDownloadLink;
+	// Verified while downloading when the API sends a checksum
+	options.sha256 = _sha256;
+	// Checked against free space up front, so a full disk shows up
+	// before the download rather than halfway through the install.
+	// The extracted pack takes about as much room as the archive.
+	obs_data_t *config = ec->GetConfig();
+	options.suspendCallback = ElgatoProduct::DownloadSuspended;
+	options.suspendAbove =
+		(uint64_t)obs_data_get_int(config, "DownloadConfirmAbove") *
+		1024 * 1024;
+	options.installDirectory =
+		obs_data_get_string(config, "InstallLocation");
+	obs_data_release(config);
+
+	if (_fileSize >= PACK_STREAM_MIN_SIZE && options.installDirectory != "") {
+		_startStream(url, options.installDirectory);
+		options.rangeCallback = ElgatoProduct::DownloadRange;
+	}
+
+	options.owner = shared_from_this();
+
 	std::shared_ptr<Downloader> dl = Downloader::getInstance("");
-	auto download = dl->Enqueue(url, savePath, ElgatoProduct::DownloadProgress, nullptr, this);
+	auto download = dl->Enqueue(url, savePath, ElgatoProduct::DownloadProgress, nullptr, this, options);
 	downloadId_ = download.id;
 	downloading_ = true;
-	return true;
+	_downloadPercent = -1;
+}
+
+void ElgatoProduct::_startStream(const std::string &url,
+				 const std::string &installDirectory)
+{
+	// Staged next to where the pack gets installed, the install only has
+	// to move the directory then
+	auto stream = std::make_shared<PackStream>(
+		url, _fileSize, installDirectory + "/.pack-" + random_name());
+	std::atomic_store(&_stream, stream);
+	PackStream *raw = stream.get();
+	// The stream may finish after the product is gone
+	std::weak_ptr<ElgatoProduct> weak = weak_from_this();
+	stream->Start(
+		[weak, raw]() {
+			QMetaObject::invokeMethod(
+				QCoreApplication::instance()->thread(),
+				[weak, raw]() {
+					if (auto ep = weak.lock()) {
+						ep->_streamReady(raw);
+					}
+				});
+		},
+		[raw](bool complete) {
+			// Goes to the wizard, which may outlive the product
+			QMetaObject::invokeMethod(
+				QCoreApplication::instance()->thread(),
+				[raw, complete]() { _streamDone(raw, complete); });
+		});
+}
+
+void ElgatoProduct::_streamReady(PackStream *stream)
+{
+	auto current = std::atomic_load(&_stream);
+	if (current.get() != stream || !downloading_ || GetSetupWizard()) {
+		return;
+	}
+	_openWizard(this, "", true, current);
+}
+
+void ElgatoProduct::_streamDone(PackStream *stream, bool complete)
+{
+	auto setupWizard = GetSetupWizard();
+	if (setupWizard && setupWizard->Stream() == stream) {
+		setupWizard->StreamDone(complete);
+	}
+}
+
+void ElgatoProduct::DownloadRange(void *data, RangeEvent event,
+				  const std::string &path, uint64_t begin,
+				  uint64_t end)
+{
+	auto ep = static_cast<ElgatoProduct *>(data);
+	auto stream = std::atomic_load(&ep->_stream);
+	if (stream) {
+		stream->Update(event, path, begin, end);
+	}
+}
+
+void ElgatoProduct::RefreshDownloadLink(
+	void *data, std::function<void(const std::string &)> done)
+{
+	auto ep = static_cast<ElgatoProduct *>(data);
+	auto ec = GetElgatoCloud();
+	// Answered on the client's thread, which also runs it when the call
+	// was cancelled, so the download always hears back
+	ec->GetPurchaseDownloadLinkAsync(ep->variantId)
+		.Then(HttpThread::CLIENT, [done](const HttpResult &result) {
+			std::string url;
+			try {
+				auto dlData = nlohmann::json::parse(result.body);
+				if (dlData.contains("direct_link") &&
+				    dlData["direct_link"].is_string()) {
+					url = dlData["direct_link"];
+				}
+			} catch (...) {
+			}
+			done(url);
+		});
+}
+
+void ElgatoProduct::DownloadSuspended(void *data, size_t id,
+				      uint64_t fileSize, uint64_t needed,
+				      uint64_t available)
+{
+	auto ep = static_cast<ElgatoProduct *>(data)->shared_from_this();
+	QMetaObject::invokeMethod(
+		QCoreApplication::instance()->thread(),
+		[ep, id, fileSize, needed, available]() {
+			QMessageBox msgBox;
+			QString details;
+			if (needed > 0) {
+				msgBox.setText(obs_module_text(
+					"MarketplaceWindow.DownloadProduct.LowDiskSpace.Title"));
+				details = QString(obs_module_text(
+						  "MarketplaceWindow.DownloadProduct.LowDiskSpace.Subtitle"))
+						  .arg(QLocale().formattedDataSize(
+							  (qint64)needed))
+						  .arg(QLocale().formattedDataSize(
+							  (qint64)available));
+			} else {
+				msgBox.setText(obs_module_text(
+					"MarketplaceWindow.DownloadProduct.LargeFile.Title"));
+				details = QString(obs_module_text(
+						  "MarketplaceWindow.DownloadProduct.LargeFile.Subtitle"))
+						  .arg(QLocale().formattedDataSize(
+							  (qint64)fileSize));
+			}
+			msgBox.setInformativeText(details);
+			msgBox.setStandardButtons(QMessageBox::Yes |
+						  QMessageBox::No);
+			msgBox.setDefaultButton(QMessageBox::No);
+			std::shared_ptr<Downloader> dl =
+				Downloader::getInstance("");
+			auto download = dl->Lookup(id);
+			download.id = id;
+			if (msgBox.exec() == QMessageBox::Yes) {
+				download.Start();
+				return;
+			}
+			// Kept suspended, downloading the product again
+			// asks again
+			ep->downloading_ = false;
+			if (ep->_productItem) {
+				ep->_productItem->resetDownload();
+			}
+		});
 }
 
 void ElgatoProduct::StopProductDownload()
 {
+	// Still asking for the link or checking the pack cache
+	_linkCall.Cancel();
 	if (downloading_) {
 		std::shared_ptr<Downloader> dl = Downloader::getInstance("");
 		auto download = dl->Lookup(downloadId_);
@@ -139,13 +369,67 @@ void ElgatoProduct::StopProductDownload()
 	}
 }
 
+void ElgatoProduct::Discard()
+{
+	_linkCall.Cancel();
+	std::shared_ptr<Downloader> dl = Downloader::getInstance("");
+	for (size_t id : {downloadId_, _thumbnailDownloadId}) {
+		if (id == 0) {
+			continue;
+		}
+		auto download = dl->Lookup(id);
+		download.id = id;
+		download.Remove();
+	}
+	downloadId_ = 0;
+	_thumbnailDownloadId = 0;
+	downloading_ = false;
+	auto stream = std::atomic_exchange(&_stream,
+					   std::shared_ptr<PackStream>());
+	if (stream) {
+		stream->Cancel();
+	}
+}
+
+// Costs a 304 when the cached one hasn't changed
+void ElgatoProduct::RefreshThumbnail()
+{
+	if (thumbnailUrl == "" ||
+	    Downloader::IsFresh(thumbnailPath, THUMBNAIL_MAX_AGE)) {
+		return;
+	}
+	_downloadThumbnail();
+}
+
 void ElgatoProduct::_downloadThumbnail()
 {
-	std::string savePath = QDir::homePath().toStdString();
-	savePath += getUserDataDir() + "/Thumbnails/";
+	// Queued behind everything on screen until the grid reports the
+	// product item as visible. Refreshing one that is already shown
+	// waits for everything else.
+	DownloadOptions options;
+	options.priority = _thumbnailReady ? DownloadPriority::PREFETCH
+					   : DownloadPriority::OFFSCREEN;
+	options.revalidate = true;
+	options.owner = shared_from_this();
 	std::shared_ptr<Downloader> dl = Downloader::getInstance("");
-	dl->Enqueue(thumbnailUrl, savePath, ElgatoProduct::ThumbnailProgress, ElgatoProduct::SetThumbnail,
-		    this);
+	auto download = dl->Enqueue(thumbnailUrl, thumbnailPath,
+				    ElgatoProduct::ThumbnailProgress,
+				    ElgatoProduct::SetThumbnail, this, options);
+	_thumbnailDownloadId = download.id;
+}
+
+void ElgatoProduct::SetThumbnailVisible(bool visible)
+{
+	if (_thumbnailReady || _thumbnailDownloadId == 0 ||
+	    _thumbnailVisible == visible) {
+		return;
+	}
+	_thumbnailVisible = visible;
+	std::shared_ptr<Downloader> dl = Downloader::getInstance("");
+	auto download = dl->Lookup(_thumbnailDownloadId);
+	download.id = _thumbnailDownloadId;
+	download.SetPriority(visible ? DownloadPriority::VISIBLE
+				     : DownloadPriority::OFFSCREEN);
 }
 
 void ElgatoProduct::ThumbnailProgress(void *ptr, bool finished,
@@ -164,51 +448,129 @@ void ElgatoProduct::DownloadProgress(void *ptr, bool finished, bool downloading,
 				     uint64_t fileSize, uint64_t chunkSize,
 				     uint64_t downloaded)
 {
-	UNUSED_PARAMETER(finished);
-	UNUSED_PARAMETER(downloading);
 	UNUSED_PARAMETER(chunkSize);
-	double percent = 100.0 * static_cast<double>(downloaded) /
-			 static_cast<double>(fileSize);
-	int pct = static_cast<int>(percent);
-	ElgatoProduct &self = *static_cast<ElgatoProduct *>(ptr);
+	// Runs on the downloader's threads. State changes go to the UI
+	// thread, with a reference of their own to the product.
+	auto ep = static_cast<ElgatoProduct *>(ptr)->shared_from_this();
+	if (!finished && !downloading) {
+		// Interrupted. The partial file is kept, so clicking download
+		// again resumes where this left off.
+		QMetaObject::invokeMethod(
+			QCoreApplication::instance()->thread(), [ep]() {
+				ep->downloading_ = false;
+				if (ep->_productItem) {
+					ep->_productItem->resetDownload();
+				}
+				// A wizard opened early has nothing to install
+				auto stream = std::atomic_exchange(
+					&ep->_stream,
+					std::shared_ptr<PackStream>());
+				auto setupWizard = GetSetupWizard();
+				if (stream && setupWizard &&
+				    setupWizard->Stream() == stream.get()) {
+					setupWizard->DownloadFailed();
+				}
+			});
+		return;
+	}
+	int pct = fileSize > 0 ? static_cast<int>(100.0 *
+						  static_cast<double>(downloaded) /
+						  static_cast<double>(fileSize))
+			       : 0;
+	// The downloader already batches updates, only bother the GUI
+	// thread when the bar actually moves.
+	if (pct == ep->_downloadPercent.exchange(pct)) {
+		return;
+	}
 	QMetaObject::invokeMethod(QCoreApplication::instance()->thread(),
-				  [self, downloading, pct]() {
-					  self._productItem->UpdateDownload(
-						  downloading, pct);
+				  [ep, downloading, pct]() {
+					  if (ep->_productItem) {
+						  ep->_productItem->UpdateDownload(
+							  downloading, pct);
+					  }
 				  });
 }
 
 void ElgatoProduct::SetThumbnail(std::string filename, void *data)
 {
 	UNUSED_PARAMETER(filename);
+	auto ep = static_cast<ElgatoProduct *>(data)->shared_from_this();
+	QMetaObject::invokeMethod(QCoreApplication::instance()->thread(),
+				  [ep]() {
+					  ep->_thumbnailReady = true;
+					  if (ep->_productItem) {
+						  ep->_productItem->updateImage();
+					  }
+				  });
+}
+
+void ElgatoProduct::Install(std::string filename_utf8, void *data,
+			    bool fromDownload)
+{
 	auto ep = static_cast<ElgatoProduct *>(data);
-	ep->_thumbnailReady = true;
+	ep->downloading_ = false;
+	if (fromDownload && ep->downloadId_ != 0) {
+		// Kept for the next install of the same pack
+		std::shared_ptr<Downloader> dl = Downloader::getInstance("");
+		auto download = dl->Lookup(ep->downloadId_);
+		PackCache::getInstance()->Add(ep->variantId, ep->_sha256,
+					      download.validator,
+					      filename_utf8);
+		ep->downloadId_ = 0;
+	}
 	if (ep->_productItem) {
-		QMetaObject::invokeMethod(
-			QCoreApplication::instance()->thread(),
-			[ep]() { ep->_productItem->updateImage(); });
+		ep->_productItem->resetDownload();
+	}
+	auto stream = std::atomic_exchange(&ep->_stream,
+					   std::shared_ptr<PackStream>());
+	if (fromDownload && stream) {
+		auto setupWizard = GetSetupWizard();
+		if (stream->Claimed()) {
+			// Already installed from the extracted pack
+			os_unlink(filename_utf8.c_str());
+		} else if (setupWizard &&
+			   setupWizard->Stream() == stream.get()) {
+			setupWizard->SetArchive(filename_utf8);
+		} else {
+			// The wizard opens from the archive, nothing is waiting
+			// for the rest of the extraction
+			stream->Cancel();
+			_openWizard(ep, filename_utf8, true);
+		}
+		return;
 	}
+	_openWizard(ep, filename_utf8, fromDownload);
 }
 
-void ElgatoProduct::Install(std::string filename_utf8, void *data,
-			    bool fromDownload)
+void ElgatoProduct::DownloadShared(void *data)
 {
 	auto ep = static_cast<ElgatoProduct *>(data);
 	ep->downloading_ = false;
-	const auto mainWindow =
-		static_cast<QMainWindow *>(obs_frontend_get_main_window());
+	ep->downloadId_ = 0;
+	auto stream = std::atomic_exchange(&ep->_stream,
+					   std::shared_ptr<PackStream>());
+	if (stream) {
+		stream->Cancel();
+	}
 	if (ep->_productItem) {
-		QMetaObject::invokeMethod(
-			QCoreApplication::instance()->thread(),
-			[ep]() { ep->_productItem->resetDownload(); });
+		ep->_productItem->resetDownload();
 	}
+}
+
+void ElgatoProduct::_openWizard(ElgatoProduct *ep, std::string filename,
+				bool fromDownload,
+				std::shared_ptr<PackStream> stream)
+{
+	const auto mainWindow =
+		static_cast<QMainWindow *>(obs_frontend_get_main_window());
 	const QRect &hostRect = mainWindow->geometry();
 	if (GetSetupWizard()) {
 		return;
 	}
 	StreamPackageSetupWizard *setupWizard = new StreamPackageSetupWizard(
-		mainWindow, ep, filename_utf8, fromDownload);
+		mainWindow, ep, filename, fromDownload);
 	setupWizard->setAttribute(Qt::WA_DeleteOnClose);
+	setupWizard->SetStream(stream);
 	setupWizard->show();
 	setupWizard->move(hostRect.center() - setupWizard->rect().center());
 	setupWizard->OpenArchive();
@@ -19,17 +19,23 @@ with this program. If not, see <https://www.gnu.org/licenses/>
 #pragma once
 #include <string>
 #include <vector>
+#include <atomic>
+#include <memory>
 
 #include <nlohmann/json.hpp>
 
 #include "downloader.h"
+#include "http-client.hpp"
 
 namespace elgatocloud {
 
 class ElgatoProductItem;
 class StreamPackageSetupWizard;
+class PackStream;
 
-class ElgatoProduct {
+// Owned through a shared_ptr: its downloads hold on to it for as long as
+// they may call back.
+class ElgatoProduct : public std::enable_shared_from_this<ElgatoProduct> {
 public:
 	std::string name;
 	std::string id;
@@ -46,27 +52,66 @@ public:
 	{
 		_productItem = item;
 	}
-	inline ~ElgatoProduct() {};
+	inline ElgatoProductItem *ProductItem() const { return _productItem; }
+	inline ~ElgatoProduct() { _linkCall.Cancel(); };
 	inline bool ready() { return _thumbnailReady; }
 	bool DownloadProduct();
 	void StopProductDownload();
+	// Downloads the thumbnail unless the cached one is fresh
+	void RefreshThumbnail();
+	// The product left the library. Removes its downloads and cancels
+	// its stream, so they stop calling back into it.
+	void Discard();
 	static void DownloadProgress(void *ptr, bool finished, bool downloading,
 				     uint64_t fileSize, uint64_t chunkSize,
 				     uint64_t downloaded);
+	// Runs on the UI thread
 	static void Install(std::string filename_utf8, void *data,
 			    bool fromDownload = true);
+	// The pack was downloaded for another product, which installs it.
+	// Runs on the UI thread.
+	static void DownloadShared(void *data);
+	// Fetches a new signed link when the current one expired mid-download
+	static void RefreshDownloadLink(
+		void *data, std::function<void(const std::string &)> done);
+	static void DownloadSuspended(void *data, size_t id, uint64_t fileSize,
+				      uint64_t needed, uint64_t available);
+	// Feeds the written ranges of a streamed download to its PackStream
+	static void DownloadRange(void *data, RangeEvent event,
+				  const std::string &path, uint64_t begin,
+				  uint64_t end);
 	static void ThumbnailProgress(void *ptr, bool finished,
 				      bool downloading, uint64_t fileSize,
 				      uint64_t chunkSize, uint64_t downloaded);
 	static void SetThumbnail(std::string filename, void *data);
+	// Bumps a pending thumbnail download while its item is on screen
+	void SetThumbnailVisible(bool visible);
 
 private:
 	void _downloadThumbnail();
+	bool _startDownload(nlohmann::json &dlData);
+	void _enqueueDownload(const std::string &url,
+			      const std::string &savePath);
+	void _startStream(const std::string &url,
+			  const std::string &installDirectory);
+	void _streamReady(PackStream *stream);
+	static void _streamDone(PackStream *stream, bool complete);
+	static void _openWizard(ElgatoProduct *ep, std::string filename,
+				bool fromDownload,
+				std::shared_ptr<PackStream> stream = nullptr);
 	bool _thumbnailReady;
+	bool _thumbnailVisible = false;
+	size_t _thumbnailDownloadId = 0;
 	size_t _fileSize;
 	ElgatoProductItem *_productItem = nullptr;
-	size_t downloadId_;
-	bool downloading_;
+	size_t downloadId_ = 0;
+	std::string _sha256; // Of the pack being downloaded, if the API sent one
+	bool downloading_ = false; // Only touched on the UI thread
+	std::atomic<int> _downloadPercent{-1};
+	// Extracts the pack being downloaded, read by the download's workers
+	// through std::atomic_load
+	std::shared_ptr<PackStream> _stream;
+	HttpCall _linkCall; // The direct link, then the pack cache check
 };
 
 } // namespace elgatocloud
@@ -434,6 +434,14 @@ inline const QString EIconOnlySmButtonStyle =
 		"border-radius: 8px;"
 		"}";
 
+	inline const QString EWizardSpinBoxStyle = "QSpinBox {"
+		"background-color: #232323;"
+		"border: none;"
+		"padding: 6px 12px 6px 12px;"
+		"font-size: 14px;"
+		"border-radius: 8px;"
+		"}";
+
 	inline const QString EWizardButtonStyle =
 		"QPushButton {"
 		"background: #204CFE;"
@@ -0,0 +1,672 @@
+/*
+Elgato Deep-Linking OBS Plug-In
+Copyright (C) 2024 Corsair Memory Inc. oss.elgato@corsair.com
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program. If not, see <https://www.gnu.org/licenses/>
+*/
+
+#include "http-client.hpp"
+
+#include <algorithm>
+#include <QCoreApplication>
+#include <QMetaObject>
+#include <QThread>
+#include <obs-module.h>
+#include <plugin-support.h>
+
+#include "api.hpp"
+#include "util.h"
+#include <nlohmann/json.hpp>
+
+// Longest the client sleeps without socket activity, cancellations and new
+// requests wake it up sooner
+#define HTTP_IDLE_MS 1000
+
+namespace elgatocloud {
+
+struct HttpCall::State {
+	std::mutex lock;
+	std::condition_variable wake;
+	bool done = false;
+	bool cancelled = false;
+	bool chain = false; // Resolved by its last step instead of a request
+	HttpResult result;
+	std::vector<std::pair<HttpThread,
+			      std::function<void(const HttpResult &)>>>
+		continuations;
+	std::shared_ptr<State> inner; // The chain's step in flight
+};
+
+struct HttpClient::Request {
+	std::shared_ptr<HttpCall::State> state;
+	CURL *handle = nullptr;
+	bool post = false;
+	std::string url;
+	std::string postdata;
+	std::string token;
+	std::string useragent;
+	std::string body;
+	size_t bodyLimit = 0;
+	std::string etag;
+	std::string lastModified;
+	curl_slist *headers = nullptr;
+	std::chrono::steady_clock::time_point deadline; // Unset for none
+	bool deadlineHit = false;
+
+	// Only once the handle was released, which happens first everywhere
+	inline ~Request() { curl_slist_free_all(headers); }
+};
+
+HttpClient *HttpClient::_client = nullptr;
+std::once_flag HttpClient::_once;
+std::mutex HttpClient::_mtx;
+
+static const char *timeout_name(HttpTimeout timeout)
+{
+	switch (timeout) {
+	case HttpTimeout::CONNECT:
+		return "connect";
+	case HttpTimeout::STALLED:
+		return "stalled";
+	case HttpTimeout::DEADLINE:
+		return "deadline";
+	default:
+		return "";
+	}
+}
+
+static HttpResult cancelled_result()
+{
+	HttpResult result;
+	result.code = CURLE_ABORTED_BY_CALLBACK;
+	result.body = "{\"error\": \"Cancelled\"}";
+	result.cancelled = true;
+	return result;
+}
+
+// Empty calls are done already, as if cancelled
+HttpCall::HttpCall() : _state(std::make_shared<State>())
+{
+	_state->done = true;
+	_state->result = cancelled_result();
+}
+
+HttpCall::HttpCall(std::shared_ptr<State> state) : _state(state) {}
+
+HttpCall HttpCall::Resolved(HttpResult result)
+{
+	auto state = std::make_shared<State>();
+	_resolve(state, result);
+	return HttpCall(state);
+}
+
+void HttpCall::_dispatch(const std::shared_ptr<State> &state,
+			 HttpThread thread,
+			 const std::function<void(const HttpResult &)> &then,
+			 const HttpResult &result)
+{
+	if (thread == HttpThread::CLIENT) {
+		then(result);
+		return;
+	}
+	QMetaObject::invokeMethod(QCoreApplication::instance()->thread(),
+				  [state, then, result]() {
+					  {
+						  std::lock_guard<std::mutex> lock(
+							  state->lock);
+						  if (state->cancelled) {
+							  return;
+						  }
+					  }
+					  then(result);
+				  });
+}
+
+void HttpCall::_resolve(const std::shared_ptr<State> &state,
+			const HttpResult &result)
+{
+	std::unique_lock<std::mutex> lock(state->lock);
+	if (state->done) {
+		return;
+	}
+	state->done = true;
+	state->result = result;
+	state->inner = nullptr;
+	auto continuations = std::move(state->continuations);
+	state->continuations.clear();
+	state->wake.notify_all();
+	lock.unlock();
+	for (auto const &continuation : continuations) {
+		_dispatch(state, continuation.first, continuation.second,
+			  result);
+	}
+}
+
+HttpCall &HttpCall::Then(HttpThread thread,
+			 std::function<void(const HttpResult &)> then)
+{
+	std::unique_lock<std::mutex> lock(_state->lock);
+	if (!_state->done) {
+		_state->continuations.emplace_back(thread, then);
+		return *this;
+	}
+	HttpResult result = _state->result;
+	lock.unlock();
+	_dispatch(_state, thread, then, result);
+	return *this;
+}
+
+HttpCall HttpCall::Chain(HttpThread thread,
+			 std::function<HttpCall(const HttpResult &)> next)
+{
+	auto chained = std::make_shared<State>();
+	chained->chain = true;
+	chained->inner = _state;
+	auto step = [chained, next](const HttpResult &result) {
+		{
+			std::lock_guard<std::mutex> lock(chained->lock);
+			if (chained->done) { // Cancelled
+				return;
+			}
+		}
+		HttpCall call = next(result);
+		bool cancelled;
+		{
+			std::lock_guard<std::mutex> lock(chained->lock);
+			cancelled = chained->done;
+			if (!cancelled) {
+				chained->inner = call._state;
+			}
+		}
+		if (cancelled) {
+			call.Cancel();
+			return;
+		}
+		call.Then(HttpThread::CLIENT,
+			  [chained](const HttpResult &callResult) {
+				  _resolve(chained, callResult);
+			  });
+	};
+	// Always continued on the client, so the chain resolves even if the
+	// first call gets cancelled through another handle
+	Then(HttpThread::CLIENT, [chained, thread, step](const HttpResult &result) {
+		if (thread == HttpThread::CLIENT) {
+			step(result);
+			return;
+		}
+		QMetaObject::invokeMethod(
+			QCoreApplication::instance()->thread(),
+			[step, result]() { step(result); });
+	});
+	return HttpCall(chained);
+}
+
+HttpCall HttpCall::Share()
+{
+	auto shared = std::make_shared<State>();
+	shared->chain = true; // Resolved by this call, not a request of its own
+	Then(HttpThread::CLIENT, [shared](const HttpResult &result) {
+		_resolve(shared, result);
+	});
+	return HttpCall(shared);
+}
+
+HttpResult HttpCall::Wait()
+{
+	std::unique_lock<std::mutex> lock(_state->lock);
+	_state->wake.wait(lock, [this]() { return _state->done; });
+	return _state->result;
+}
+
+void HttpCall::Cancel()
+{
+	std::shared_ptr<State> inner;
+	bool chain;
+	{
+		std::lock_guard<std::mutex> lock(_state->lock);
+		_state->cancelled = true;
+		if (_state->done) {
+			return;
+		}
+		inner = _state->inner;
+		chain = _state->chain;
+	}
+	if (inner) {
+		HttpCall(inner).Cancel();
+	}
+	if (chain) {
+		_resolve(_state, cancelled_result());
+		return;
+	}
+	// Requests are taken off the multi handle by the client's thread
+	std::lock_guard<std::mutex> lock(HttpClient::_mtx);
+	if (HttpClient::_client) {
+		HttpClient::_client->_wake();
+	}
+}
+
+bool HttpCall::Done()
+{
+	std::lock_guard<std::mutex> lock(_state->lock);
+	return _state->done;
+}
+
+HttpCancelToken::HttpCancelToken() : _state(std::make_shared<State>()) {}
+
+void HttpCancelToken::Track(HttpCall call)
+{
+	std::unique_lock<std::mutex> lock(_state->lock);
+	if (_state->cancelled) {
+		lock.unlock();
+		call.Cancel();
+		return;
+	}
+	// Finished calls don't need cancelling anymore
+	_state->calls.erase(std::remove_if(_state->calls.begin(),
+					   _state->calls.end(),
+					   [](HttpCall &tracked) {
+						   return tracked.Done();
+					   }),
+			    _state->calls.end());
+	_state->calls.push_back(call);
+}
+
+void HttpCancelToken::Cancel()
+{
+	std::vector<HttpCall> calls;
+	{
+		std::lock_guard<std::mutex> lock(_state->lock);
+		_state->cancelled = true;
+		calls.swap(_state->calls);
+	}
+	for (auto &call : calls) {
+		call.Cancel();
+	}
+}
+
+void HttpCancelToken::Reset()
+{
+	std::lock_guard<std::mutex> lock(_state->lock);
+	_state->cancelled = false;
+}
+
+bool HttpCancelToken::Cancelled()
+{
+	std::lock_guard<std::mutex> lock(_state->lock);
+	return _state->cancelled;
+}
+
+HttpClient *HttpClient::getInstance()
+{
+	// _client is also read under _mtx by Cancel() and ShutDown(), which
+	// don't create the client
+	std::call_once(_once, []() {
+		std::lock_guard<std::mutex> lock(_mtx);
+		_client = new HttpClient();
+	});
+	return _client;
+}
+
+// The client stays around stopped, for threads that only get to their
+// next request after the module unloaded
+void HttpClient::ShutDown()
+{
+	HttpClient *client;
+	{
+		std::lock_guard<std::mutex> lock(_mtx);
+		client = _client;
+	}
+	if (client) {
+		client->_stop();
+	}
+}
+
+HttpClient::HttpClient() : _running(true)
+{
+	_multi = curl_multi_init();
+	_thread = std::thread(&HttpClient::_run, this);
+}
+
+void HttpClient::_stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(_lock);
+		if (!_running) {
+			return;
+		}
+		_running = false;
+	}
+	curl_multi_wakeup(_multi);
+	_thread.join();
+	// Nothing is left hanging on the calls
+	for (auto &request : _active) {
+		curl_multi_remove_handle(_multi, request->handle);
+	}
+	std::vector<std::unique_ptr<Request>> left;
+	for (auto &request : _pending) {
+		left.push_back(std::move(request));
+	}
+	for (auto &request : _active) {
+		left.push_back(std::move(request));
+	}
+	_pending.clear();
+	_active.clear();
+	for (auto &request : left) {
+		release_curl_handle(request->handle);
+		{
+			std::lock_guard<std::mutex> lock(request->state->lock);
+			request->state->cancelled = true;
+		}
+		HttpCall::_resolve(request->state, cancelled_result());
+	}
+}
+
+HttpCall HttpClient::Get(const std::string &url, const std::string &token,
+			 const HttpOptions &options)
+{
+	auto request = std::make_unique<Request>();
+	request->url = url;
+	request->token = token;
+	return _submit(std::move(request), options);
+}
+
+HttpCall HttpClient::Post(const std::string &url, const std::string &postdata,
+			  const std::string &token, const HttpOptions &options)
+{
+	auto request = std::make_unique<Request>();
+	request->post = true;
+	request->url = url;
+	request->postdata = postdata;
+	request->token = token;
+	return _submit(std::move(request), options);
+}
+
+// Also checked between transfers, this aborts the ones that are stuck in
+// curl_multi_perform
+int HttpClient::_progress(void *data, curl_off_t dltotal, curl_off_t dlnow,
+			  curl_off_t ultotal, curl_off_t ulnow)
+{
+	UNUSED_PARAMETER(dltotal);
+	UNUSED_PARAMETER(dlnow);
+	UNUSED_PARAMETER(ultotal);
+	UNUSED_PARAMETER(ulnow);
+	auto request = static_cast<Request *>(data);
+	{
+		std::lock_guard<std::mutex> lock(request->state->lock);
+		if (request->state->cancelled) {
+			return 1;
+		}
+	}
+	if (request->deadline != std::chrono::steady_clock::time_point() &&
+	    std::chrono::steady_clock::now() >= request->deadline) {
+		request->deadlineHit = true;
+		return 1;
+	}
+	return 0;
+}
+
+size_t HttpClient::_header(char *buffer, size_t size, size_t nitems,
+			   void *data)
+{
+	auto request = static_cast<Request *>(data);
+	std::string line(buffer, size * nitems);
+	if (line.rfind("HTTP/", 0) == 0) {
+		// A new response, e.g. after a redirect
+		request->etag = "";
+		request->lastModified = "";
+		return size * nitems;
+	}
+	auto colon = line.find(':');
+	if (colon == std::string::npos) {
+		return size * nitems;
+	}
+	std::string name = line.substr(0, colon);
+	for (auto &c : name) {
+		c = (char)tolower(c);
+	}
+	auto start = line.find_first_not_of(" \t", colon + 1);
+	auto end = line.find_last_not_of(" \t\r\n");
+	if (start == std::string::npos || end < start) {
+		return size * nitems;
+	}
+	if (name == "etag") {
+		request->etag = line.substr(start, end - start + 1);
+	} else if (name == "last-modified") {
+		request->lastModified = line.substr(start, end - start + 1);
+	}
+	return size * nitems;
+}
+
+size_t HttpClient::_write(char *buffer, size_t size, size_t nitems,
+			  void *data)
+{
+	auto request = static_cast<Request *>(data);
+	size_t bytes = size * nitems;
+	if (request->bodyLimit > 0 &&
+	    request->body.size() + bytes > request->bodyLimit) {
+		return 0;
+	}
+	request->body.append(buffer, bytes);
+	return bytes;
+}
+
+HttpCall HttpClient::_submit(std::unique_ptr<Request> request,
+			     const HttpOptions &options)
+{
+	request->state = std::make_shared<HttpCall::State>();
+	HttpCall call(request->state);
+	if (options.deadlineMs > 0) {
+		request->deadline = std::chrono::steady_clock::now() +
+				    std::chrono::milliseconds(options.deadlineMs);
+	}
+	request->handle = acquire_curl_handle();
+	CURL *handle = request->handle;
+	curl_easy_setopt(handle, CURLOPT_URL, request->url.c_str());
+	request->bodyLimit = options.bodyLimit;
+	curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, HttpClient::_write);
+	curl_easy_setopt(handle, CURLOPT_WRITEDATA,
+			 static_cast<void *>(request.get()));
+	request->useragent = USERAGENT " ";
+	request->useragent += PLUGIN_VERSION;
+	curl_easy_setopt(handle, CURLOPT_USERAGENT,
+			 request->useragent.c_str());
+	if (request->token != "") {
+		curl_easy_setopt(handle, CURLOPT_XOAUTH2_BEARER,
+				 request->token.c_str());
+		curl_easy_setopt(handle, CURLOPT_HTTPAUTH, CURLAUTH_BEARER);
+	}
+	if (request->post) {
+		curl_easy_setopt(handle, CURLOPT_POSTFIELDS,
+				 request->postdata.c_str());
+	}
+	if (options.ifNoneMatch != "") {
+		std::string ifNoneMatch = "If-None-Match: " + options.ifNoneMatch;
+		request->headers =
+			curl_slist_append(request->headers, ifNoneMatch.c_str());
+		curl_easy_setopt(handle, CURLOPT_HTTPHEADER, request->headers);
+	}
+	if (options.range != "") {
+		curl_easy_setopt(handle, CURLOPT_RANGE, options.range.c_str());
+	}
+	curl_easy_setopt(handle, CURLOPT_HEADERFUNCTION, HttpClient::_header);
+	curl_easy_setopt(handle, CURLOPT_HEADERDATA,
+			 static_cast<void *>(request.get()));
+	curl_easy_setopt(handle, CURLOPT_PRIVATE,
+			 static_cast<void *>(request.get()));
+	curl_easy_setopt(handle, CURLOPT_CONNECTTIMEOUT_MS,
+			 (long)options.connectTimeoutMs);
+	if (options.stallSeconds > 0) {
+		curl_easy_setopt(handle, CURLOPT_LOW_SPEED_LIMIT, 1L);
+		curl_easy_setopt(handle, CURLOPT_LOW_SPEED_TIME,
+				 options.stallSeconds);
+	}
+	curl_easy_setopt(handle, CURLOPT_XFERINFOFUNCTION,
+			 HttpClient::_progress);
+	curl_easy_setopt(handle, CURLOPT_XFERINFODATA,
+			 static_cast<void *>(request.get()));
+	curl_easy_setopt(handle, CURLOPT_NOPROGRESS, 0L);
+
+	std::unique_lock<std::mutex> lock(_lock);
+	if (!_running) {
+		lock.unlock();
+		release_curl_handle(handle);
+		request->state->cancelled = true;
+		HttpCall::_resolve(request->state, cancelled_result());
+		return call;
+	}
+	_pending.push_back(std::move(request));
+	lock.unlock();
+	_wake();
+	return call;
+}
+
+void HttpClient::_wake()
+{
+	curl_multi_wakeup(_multi);
+}
+
+// Mirrors the results and logging of fetch_string_from_get and
+// fetch_string_from_post
+void HttpClient::_finish(std::unique_ptr<Request> request, CURLcode code)
+{
+	HttpResult result;
+	result.code = code;
+	curl_easy_getinfo(request->handle, CURLINFO_RESPONSE_CODE,
+			  &result.status);
+	if (request->deadlineHit) {
+		result.code = CURLE_OPERATION_TIMEDOUT;
+		result.timeout = HttpTimeout::DEADLINE;
+	} else if (code == CURLE_OPERATION_TIMEDOUT) {
+		// Both the connect timeout and the low speed limit end up here
+		curl_off_t connectTime = 0;
+		curl_easy_getinfo(request->handle, CURLINFO_CONNECT_TIME_T,
+				  &connectTime);
+		result.timeout = connectTime > 0 ? HttpTimeout::STALLED
+						 : HttpTimeout::CONNECT;
+	}
+	release_curl_handle(request->handle);
+	bool cancelled;
+	{
+		std::lock_guard<std::mutex> lock(request->state->lock);
+		cancelled = request->state->cancelled;
+	}
+	if (cancelled) {
+		HttpCall::_resolve(request->state, cancelled_result());
+		return;
+	}
+	const char *method = request->post ? "POST" : "GET";
+	result.etag = request->etag;
+	result.lastModified = request->lastModified;
+	if (result.timeout != HttpTimeout::NONE) {
+		obs_log(LOG_WARNING, "Error in fetching %s value - Timed out (%s)",
+			method, timeout_name(result.timeout));
+		obs_log(LOG_WARNING, "   url: %s", request->url.c_str());
+		nlohmann::json error = {
+			{"error", "Connection Timed Out"},
+			{"timeout", timeout_name(result.timeout)}};
+		result.body = error.dump();
+	} else if (code == CURLE_OK && result.status == 304) {
+		// What the caller has is still current
+		result.body = "";
+	} else if (code == CURLE_OK && (request->post || request->body != "")) {
+		result.body = request->body;
+	} else if (!request->post && code == CURLE_OK) {
+		obs_log(LOG_WARNING, "Error in fetching GET value - Timed out");
+		obs_log(LOG_WARNING, "   url: %s", request->url.c_str());
+		obs_log(LOG_WARNING, "   code: %i", code);
+		obs_log(LOG_WARNING, "   response: %s", request->body.c_str());
+		result.body = "{\"error\": \"Connection Timed Out\"}";
+	} else {
+		obs_log(LOG_WARNING, "Error in fetching %s value", method);
+		obs_log(LOG_WARNING, "   url: %s", request->url.c_str());
+		obs_log(LOG_WARNING, "   curl code: %i", code);
+		obs_log(LOG_WARNING, "   http code: %i", result.status);
+		obs_log(LOG_WARNING, "   response: %s", request->body.c_str());
+		result.body = "{\"error\": \"Unspecified Error\"}";
+	}
+	HttpCall::_resolve(request->state, result);
+}
+
+void HttpClient::_run()
+{
+	while (true) {
+		std::vector<std::unique_ptr<Request>> cancelled;
+		{
+			std::lock_guard<std::mutex> lock(_lock);
+			if (!_running) {
+				break;
+			}
+			for (auto &request : _pending) {
+				curl_multi_add_handle(_multi, request->handle);
+				_active.push_back(std::move(request));
+			}
+			_pending.clear();
+			for (auto it = _active.begin(); it != _active.end();) {
+				bool isCancelled;
+				{
+					std::lock_guard<std::mutex> stateLock(
+						(*it)->state->lock);
+					isCancelled = (*it)->state->cancelled;
+				}
+				if (!isCancelled) {
+					++it;
+					continue;
+				}
+				curl_multi_remove_handle(_multi,
+							 (*it)->handle);
+				cancelled.push_back(std::move(*it));
+				it = _active.erase(it);
+			}
+		}
+		// Continuations may submit requests, so they run unlocked
+		for (auto &request : cancelled) {
+			_finish(std::move(request), CURLE_ABORTED_BY_CALLBACK);
+		}
+
+		int running = 0;
+		curl_multi_perform(_multi, &running);
+
+		int msgs = 0;
+		CURLMsg *msg = nullptr;
+		while ((msg = curl_multi_info_read(_multi, &msgs))) {
+			if (msg->msg != CURLMSG_DONE) {
+				continue;
+			}
+			CURL *handle = msg->easy_handle;
+			CURLcode code = msg->data.result;
+			curl_multi_remove_handle(_multi, handle);
+			std::unique_ptr<Request> done;
+			{
+				std::lock_guard<std::mutex> lock(_lock);
+				auto it = std::find_if(
+					_active.begin(), _active.end(),
+					[handle](const std::unique_ptr<Request>
+							 &request) {
+						return request->handle ==
+						       handle;
+					});
+				if (it == _active.end()) {
+					continue;
+				}
+				done = std::move(*it);
+				_active.erase(it);
+			}
+			_finish(std::move(done), code);
+		}
+
+		curl_multi_poll(_multi, NULL, 0, HTTP_IDLE_MS, NULL);
+	}
+}
+
+} // namespace elgatocloud
@@ -0,0 +1,197 @@
+/*
+Elgato Deep-Linking OBS Plug-In
+Copyright (C) 2024 Corsair Memory Inc. oss.elgato@corsair.com
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program. If not, see <https://www.gnu.org/licenses/>
+*/
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <functional>
+#include <condition_variable>
+#include <chrono>
+#include <curl/curl.h>
+
+// Defaults of HttpOptions
+#define HTTP_DEADLINE_MS 30000
+#define HTTP_CONNECT_TIMEOUT_MS 10000
+#define HTTP_STALL_SECONDS 15
+
+namespace elgatocloud {
+
+// Where the continuations of an HttpCall run
+enum class HttpThread : char {
+	MAIN, // The Qt GUI thread
+	CLIENT // The client's own thread, must not block
+};
+
+// Which limit a request ran into
+enum class HttpTimeout : char {
+	NONE,
+	CONNECT, // No connection within HttpOptions::connectTimeoutMs
+	STALLED, // Connected, but nothing arrived for stallSeconds
+	DEADLINE // Not done within deadlineMs
+};
+
+struct HttpOptions {
+	// From submitting the request to its last byte, 0 for no limit
+	uint32_t deadlineMs = HTTP_DEADLINE_MS;
+	uint32_t connectTimeoutMs = HTTP_CONNECT_TIMEOUT_MS;
+	// Aborts once less than a byte per second arrived for this long
+	long stallSeconds = HTTP_STALL_SECONDS;
+	// Sent as If-None-Match, a 304 then resolves with an empty body
+	std::string ifNoneMatch;
+	// Byte range to ask for, e.g. "0-0", "" for all of it
+	std::string range;
+	// Aborts with CURLE_WRITE_ERROR once the body grows past this many
+	// bytes, 0 for no limit
+	size_t bodyLimit = 0;
+};
+
+struct HttpResult {
+	CURLcode code = CURLE_OK;
+	long status = 0;
+	// The response, or the same {"error": ...} documents fetch_string_from_get
+	// and fetch_string_from_post return, so both parse alike. Timeouts
+	// add a "timeout" member naming the limit: "connect", "stalled" or
+	// "deadline".
+	std::string body;
+	bool cancelled = false;
+	HttpTimeout timeout = HttpTimeout::NONE;
+	std::string etag; // Of the response, if it had one
+	std::string lastModified; // Likewise
+	inline bool ok() const { return code == CURLE_OK && !cancelled; }
+	inline bool notModified() const { return ok() && status == 304; }
+};
+
+// Handle to a request running on the HttpClient, or to a chain of them.
+// Copies refer to the same call.
+class HttpCall {
+public:
+	HttpCall();
+
+	// Runs then with the result on thread once the call is done. Once
+	// Cancel() was called, continuations for the main thread no longer
+	// run, so objects torn down on the main thread can cancel their calls
+	// and be sure nothing calls back into them.
+	HttpCall &Then(HttpThread thread,
+		       std::function<void(const HttpResult &)> then);
+	// A call that runs this one, then the one next starts with its result,
+	// and resolves with the latter's result. next may also return
+	// HttpCall::Resolved() to end the chain early.
+	HttpCall Chain(HttpThread thread,
+		       std::function<HttpCall(const HttpResult &)> next);
+	// Blocks until the call is done. Not from the client's thread.
+	HttpResult Wait();
+	// Aborts the request, or whichever request of a chain is in flight
+	void Cancel();
+	// Another handle that resolves with this call's result. Cancelling it
+	// leaves this call running, so one request can be handed to several
+	// callers.
+	HttpCall Share();
+	bool Done();
+
+	// An already finished call, for chains that have nothing to request
+	static HttpCall Resolved(HttpResult result);
+
+private:
+	friend class HttpClient;
+	struct State;
+
+	explicit HttpCall(std::shared_ptr<State> state);
+	static void _resolve(const std::shared_ptr<State> &state,
+			     const HttpResult &result);
+	static void _dispatch(const std::shared_ptr<State> &state,
+			      HttpThread thread,
+			      const std::function<void(const HttpResult &)> &then,
+			      const HttpResult &result);
+
+	std::shared_ptr<State> _state;
+};
+
+// Cancels every call it tracks, including ones tracked after Cancel().
+// Owned by what the requests are for, like the window or the login session,
+// and replaced with a fresh token when that goes away but can come back.
+// Copies share the same state.
+class HttpCancelToken {
+public:
+	HttpCancelToken();
+	void Track(HttpCall call);
+	void Cancel();
+	// Lets calls tracked from now on run again
+	void Reset();
+	bool Cancelled();
+
+private:
+	struct State {
+		std::mutex lock;
+		bool cancelled = false;
+		std::vector<HttpCall> calls;
+	};
+	std::shared_ptr<State> _state;
+};
+
+// Runs API requests on one multi handle and thread, so no caller has to
+// block on the network.
+class HttpClient {
+public:
+	static HttpClient *getInstance();
+	// Cancels what is in flight and stops the client, if it was started.
+	// Requests made afterwards are cancelled right away.
+	static void ShutDown();
+
+	HttpCall Get(const std::string &url, const std::string &token = "",
+		     const HttpOptions &options = HttpOptions());
+	HttpCall Post(const std::string &url, const std::string &postdata,
+		      const std::string &token = "",
+		      const HttpOptions &options = HttpOptions());
+
+private:
+	friend class HttpCall;
+	struct Request;
+
+	HttpClient();
+	HttpClient(const HttpClient &cpy) = delete;
+
+	HttpCall _submit(std::unique_ptr<Request> request,
+			 const HttpOptions &options);
+	void _wake();
+	void _run();
+	void _stop();
+	void _finish(std::unique_ptr<Request> request, CURLcode code);
+	static int _progress(void *data, curl_off_t dltotal, curl_off_t dlnow,
+			     curl_off_t ultotal, curl_off_t ulnow);
+	static size_t _header(char *buffer, size_t size, size_t nitems,
+			      void *data);
+	static size_t _write(char *buffer, size_t size, size_t nitems,
+			     void *data);
+
+	CURLM *_multi;
+	std::mutex _lock;
+	std::vector<std::unique_ptr<Request>> _pending; // Not added yet
+	std::vector<std::unique_ptr<Request>> _active;
+	bool _running;
+	std::thread _thread;
+
+	static HttpClient *_client;
+	static std::mutex _mtx;
+	static std::once_flag _once;
+};
+
+} // namespace elgatocloud
@@ -0,0 +1,258 @@
+/*
+Elgato Deep-Linking OBS Plug-In
+Copyright (C) 2024 Corsair Memory Inc. oss.elgato@corsair.com
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program. If not, see <https://www.gnu.org/licenses/>
+*/
+
+#include "pack-cache.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <QDir>
+#include <obs-module.h>
+#include <util/platform.h>
+#include <nlohmann/json.hpp>
+#include <plugin-support.h>
+
+#include "platform.h"
+#include "sha256.hpp"
+#include "util.h"
+
+#define PACK_CACHE_INDEX "index.json"
+
+namespace elgatocloud {
+
+
+static int64_t now_seconds()
+{
+	return std::chrono::duration_cast<std::chrono::seconds>(
+		       std::chrono::system_clock::now().time_since_epoch())
+		.count();
+}
+
+PackCache *PackCache::getInstance()
+{
+	static PackCache *cache = new PackCache();
+	return cache;
+}
+
+PackCache::PackCache() : _budget(0)
+{
+	_directory = QDir::homePath().toStdString();
+	_directory += getUserDataDir() + "/PackCache/";
+	os_mkdirs(_directory.c_str());
+	_load();
+}
+
+// All of the cache runs on the UI thread, where packs are downloaded and
+// installed from.
+HttpCall PackCache::Find(const std::string &variantId,
+			 const std::string &sha256, const std::string &url,
+			 std::function<void(const std::string &)> found)
+{
+	if (_budget == 0) {
+		found("");
+		return HttpCall::Resolved(HttpResult());
+	}
+	Item *newest = nullptr;
+	for (auto &item : _items) {
+		if (item.variantId != variantId ||
+		    (sha256 != "" && item.sha256 != sha256)) {
+			continue;
+		}
+		if (!newest || item.lastUsed > newest->lastUsed) {
+			newest = &item;
+		}
+	}
+	if (!newest || (sha256 == "" && newest->validator == "")) {
+		found("");
+		return HttpCall::Resolved(HttpResult());
+	}
+	if (sha256 != "") {
+		found(_use(newest->file));
+		return HttpCall::Resolved(HttpResult());
+	}
+
+	// The newest copy of the variant, as long as the server still has the
+	// same object. A ranged GET rather than HEAD, signed links are only
+	// valid for GET.
+	HttpOptions options;
+	options.range = "0-0";
+	// A server ignoring the range would send the whole pack
+	options.bodyLimit = 1;
+	std::string file = newest->file;
+	std::string validator = newest->validator;
+	auto call = HttpClient::getInstance()->Get(url, "", options);
+	call.Then(HttpThread::MAIN, [this, file, validator,
+				     found](const HttpResult &result) {
+		std::string current = result.etag != "" ? result.etag
+							 : result.lastModified;
+		if (!result.ok() || result.status >= 400 ||
+		    current != validator) {
+			found("");
+			return;
+		}
+		found(_use(file));
+	});
+	return call;
+}
+
+std::string PackCache::_use(const std::string &file)
+{
+	// May have been evicted while the server was asked
+	auto item = std::find_if(_items.begin(), _items.end(),
+				 [&file](const Item &i) { return i.file == file; });
+	if (_budget == 0 || item == _items.end()) {
+		return "";
+	}
+	std::string path = _directory + file;
+	if (!os_file_exists(path.c_str())) {
+		_items.erase(item);
+		_save();
+		return "";
+	}
+	item->lastUsed = now_seconds();
+	_save();
+	obs_log(LOG_INFO, "Installing %s from the pack cache",
+		item->variantId.c_str());
+	return path;
+}
+
+void PackCache::Add(const std::string &variantId, const std::string &sha256,
+		    const std::string &validator, const std::string &filename)
+{
+	if (_budget == 0 || (sha256 == "" && validator == "")) {
+		return;
+	}
+	std::string file = _key(variantId, sha256, validator) + ".elgatoscene";
+	for (auto &item : _items) {
+		if (item.file == file) {
+			item.lastUsed = now_seconds();
+			_save();
+			return;
+		}
+	}
+	int64_t size = os_get_file_size(filename.c_str());
+	if (size <= 0 || (uint64_t)size > _budget) {
+		return;
+	}
+	std::string path = _directory + file;
+	// A link costs no extra space, the setup wizard deletes its copy
+	// once it is done
+	os_unlink(path.c_str());
+	if (!link_file(filename, path)) {
+		obs_log(LOG_INFO, "Could not add %s to the pack cache",
+			filename.c_str());
+		return;
+	}
+	_evict(_budget - (uint64_t)size);
+	_items.push_back({variantId, sha256, validator, file, (uint64_t)size,
+			  now_seconds()});
+	_save();
+}
+
+void PackCache::SetBudget(uint64_t bytes)
+{
+	_budget = bytes;
+	_evict(bytes);
+	_save();
+}
+
+void PackCache::_evict(uint64_t budget)
+{
+	std::sort(_items.begin(), _items.end(),
+		  [](const Item &a, const Item &b) {
+			  return a.lastUsed > b.lastUsed;
+		  });
+	uint64_t total = 0;
+	auto keep = _items.begin();
+	for (; keep != _items.end(); ++keep) {
+		if (total + keep->size > budget) {
+			break;
+		}
+		total += keep->size;
+	}
+	for (auto iter = keep; iter != _items.end(); ++iter) {
+		std::string path = _directory + iter->file;
+		os_unlink(path.c_str());
+	}
+	_items.erase(keep, _items.end());
+}
+
+std::string PackCache::_key(const std::string &variantId,
+			    const std::string &sha256,
+			    const std::string &validator) const
+{
+	if (sha256 != "") {
+		return sha256;
+	}
+	Sha256 hasher;
+	std::string key = variantId + "\n" + validator;
+	hasher.Update(key.data(), key.size());
+	return hasher.Digest();
+}
+
+void PackCache::_load()
+{
+	std::ifstream f(_directory + PACK_CACHE_INDEX);
+	if (!f.is_open()) {
+		return;
+	}
+	try {
+		nlohmann::json index = nlohmann::json::parse(f);
+		for (auto &entry : index) {
+			Item item{entry.value("variant_id", ""),
+				  entry.value("sha256", ""),
+				  entry.value("validator", ""),
+				  entry.value("file", ""),
+				  entry.value("size", (uint64_t)0),
+				  entry.value("last_used", (int64_t)0)};
+			std::string path = _directory + item.file;
+			if (item.file != "" && os_file_exists(path.c_str())) {
+				_items.push_back(item);
+			}
+		}
+	} catch (...) {
+		obs_log(LOG_WARNING, "Pack cache index is corrupt, ignoring it");
+	}
+}
+
+void PackCache::_save()
+{
+	nlohmann::json index = nlohmann::json::array();
+	for (auto &item : _items) {
+		index.push_back({{"variant_id", item.variantId},
+				 {"sha256", item.sha256},
+				 {"validator", item.validator},
+				 {"file", item.file},
+				 {"size", item.size},
+				 {"last_used", item.lastUsed}});
+	}
+	std::string path = _directory + PACK_CACHE_INDEX;
+	std::string tmp = path + ".tmp";
+	std::ofstream f(tmp, std::ios::trunc);
+	f << index.dump();
+	f.close();
+	if (f.fail()) {
+		os_unlink(tmp.c_str());
+		return;
+	}
+	if (os_safe_replace(path.c_str(), tmp.c_str(), nullptr) != 0) {
+		os_unlink(tmp.c_str());
+	}
+}
+
+} // namespace elgatocloud
@@ -0,0 +1,81 @@
+/*
+Elgato Deep-Linking OBS Plug-In
+Copyright (C) 2024 Corsair Memory Inc. oss.elgato@corsair.com
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program. If not, see <https://www.gnu.org/licenses/>
+*/
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <functional>
+#include <cstdint>
+
+#include "http-client.hpp"
+
+namespace elgatocloud {
+
+// Downloaded packs, kept after install so reinstalling or merging the same
+// product doesn't download it again. Files are hard links of the downloads
+// and are named after the content's SHA-256 when the API sends one, else
+// after the variant and the server's validator (ETag or Last-Modified).
+// Least recently used packs are evicted once the budget is exceeded.
+class PackCache {
+public:
+	static PackCache *getInstance();
+
+	// Calls found with the path of the cached pack, "" on a miss. Without
+	// a digest the entry is only trusted if url still reports the validator
+	// it was cached with, found runs once the server answered then, on the
+	// UI thread. Cancelling the returned call drops found.
+	HttpCall Find(const std::string &variantId, const std::string &sha256,
+		      const std::string &url,
+		      std::function<void(const std::string &)> found);
+	// Caches a freshly downloaded pack. Does nothing if it is already
+	// cached, doesn't fit the budget, or isn't on the cache's volume.
+	void Add(const std::string &variantId, const std::string &sha256,
+		 const std::string &validator, const std::string &filename);
+	// Bytes the cache may hold, 0 disables it and drops what is cached
+	void SetBudget(uint64_t bytes);
+
+private:
+	struct Item {
+		std::string variantId;
+		std::string sha256;
+		std::string validator;
+		std::string file; // Name within the cache directory
+		uint64_t size;
+		int64_t lastUsed; // Seconds since the epoch
+	};
+
+	PackCache();
+	PackCache(const PackCache &cpy) = delete;
+
+	// Marks the item as used and returns its path, "" if its file is gone
+	std::string _use(const std::string &file);
+	void _load();
+	void _save();
+	// Drops least recently used items until the rest fits
+	void _evict(uint64_t budget);
+	std::string _key(const std::string &variantId, const std::string &sha256,
+			 const std::string &validator) const;
+
+	std::string _directory;
+	std::vector<Item> _items;
+	uint64_t _budget;
+};
+
+} // namespace elgatocloud
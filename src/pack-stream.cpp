@@ -0,0 +1,583 @@
+/*
+Elgato Deep-Linking OBS Plug-In
+Copyright (C) 2024 Corsair Memory Inc. oss.elgato@corsair.com
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program. If not, see <https://www.gnu.org/licenses/>
+*/
+
+#include "pack-stream.hpp"
+
+#include <algorithm>
+#include <QDir>
+#include <obs-module.h>
+#include <util/platform.h>
+#include <plugin-support.h>
+#include <zlib.h>
+
+#include "platform.h"
+#include "util.h"
+
+#define ZIP_LOCAL_HEADER 0x04034b50
+#define ZIP_CENTRAL_HEADER 0x02014b50
+#define ZIP_END 0x06054b50
+#define ZIP64_END 0x06064b50
+#define ZIP64_LOCATOR 0x07064b50
+#define ZIP64_EXTRA 0x0001
+#define ZIP_LOCAL_HEADER_SIZE 30
+#define ZIP_CENTRAL_HEADER_SIZE 46
+#define ZIP_END_SIZE 22
+#define ZIP64_END_SIZE 56
+#define ZIP64_LOCATOR_SIZE 20
+#define ZIP_MAX_COMMENT 65535
+#define ZIP_STORED 0
+#define ZIP_DEFLATED 8
+#define ZIP_ENCRYPTED 0x0001
+#define EXTRACT_CHUNK (256 * 1024)
+
+namespace elgatocloud {
+
+static uint16_t le16(const char *p)
+{
+	auto u = reinterpret_cast<const unsigned char *>(p);
+	return (uint16_t)(u[0] | u[1] << 8);
+}
+
+static uint32_t le32(const char *p)
+{
+	auto u = reinterpret_cast<const unsigned char *>(p);
+	return (uint32_t)u[0] | (uint32_t)u[1] << 8 | (uint32_t)u[2] << 16 |
+	       (uint32_t)u[3] << 24;
+}
+
+static uint64_t le64(const char *p)
+{
+	return (uint64_t)le32(p) | (uint64_t)le32(p + 4) << 32;
+}
+
+// [offset, offset + size) of the archive, out of the already fetched tail
+// when it is in there
+static std::vector<char> read_range(const std::string &url,
+				    const std::vector<char> &tail,
+				    uint64_t tailBegin, uint64_t offset,
+				    uint64_t size)
+{
+	if (offset >= tailBegin && offset + size <= tailBegin + tail.size()) {
+		auto begin = tail.begin() + (size_t)(offset - tailBegin);
+		return std::vector<char>(begin, begin + (size_t)size);
+	}
+	return fetch_range(url, offset, offset + size);
+}
+
+// Entries may not land outside of the staging directory
+static bool safe_entry_name(const std::string &name)
+{
+	if (name == "" || name[0] == '/' || name[0] == '\\' ||
+	    name.find(':') != std::string::npos) {
+		return false;
+	}
+	size_t begin = 0;
+	while (begin <= name.size()) {
+		size_t end = name.find_first_of("/\\", begin);
+		if (end == std::string::npos) {
+			end = name.size();
+		}
+		if (name.compare(begin, end - begin, "..") == 0) {
+			return false;
+		}
+		begin = end + 1;
+	}
+	return true;
+}
+
+PackStream::PackStream(std::string url, uint64_t size, std::string directory)
+	: _url(url),
+	  _size(size),
+	  _directory(directory)
+{
+	os_mkdirs(_directory.c_str());
+}
+
+// Runs once the thread let go, which may be on the thread itself
+PackStream::~PackStream()
+{
+	if (!_claimed) {
+		QDir dir(_directory.c_str());
+		dir.removeRecursively();
+	}
+}
+
+void PackStream::Start(std::function<void()> ready,
+		       std::function<void(bool)> done)
+{
+	std::lock_guard<std::mutex> lock(_lock);
+	if (!_stopped || _cancelled) {
+		return;
+	}
+	_ready = ready;
+	_done = done;
+	_stopped = false;
+	// Detached, so nobody has to wait for a range request to give up
+	auto self = shared_from_this();
+	std::thread([self]() { self->_run(); }).detach();
+}
+
+// Called by the downloader's workers, never blocks them for long. FINISHED
+// waits for the chunk being extracted: the archive is moved into place right
+// after, which can't happen while it is still open here on Windows. The rest
+// is extracted from where MOVED says it went, without holding up the
+// download's completion.
+void PackStream::Update(RangeEvent event, const std::string &path,
+			uint64_t begin, uint64_t end)
+{
+	std::unique_lock<std::mutex> lock(_lock);
+	switch (event) {
+	case RangeEvent::WRITTEN: {
+		_partial = path;
+		auto it = _written.upper_bound(begin);
+		if (it != _written.begin() && std::prev(it)->second >= begin) {
+			--it;
+			begin = it->first;
+			end = std::max(end, it->second);
+			it = _written.erase(it);
+		}
+		while (it != _written.end() && it->first <= end) {
+			end = std::max(end, it->second);
+			it = _written.erase(it);
+		}
+		_written[begin] = end;
+		break;
+	}
+	case RangeEvent::TRUNCATED:
+		for (auto it = _written.begin(); it != _written.end();) {
+			if (it->first >= begin) {
+				it = _written.erase(it);
+				continue;
+			}
+			it->second = std::min(it->second, begin);
+			++it;
+		}
+		// Whatever was extracted from the dropped bytes may not match
+		// what gets downloaded in their place
+		for (auto const &entry : _entries) {
+			if (entry.extracted && entry.end > begin) {
+				_failed = true;
+				break;
+			}
+		}
+		break;
+	case RangeEvent::FINISHED:
+		_finished = true;
+		// Stops the entry being extracted, it starts over once the
+		// archive has moved
+		_partial = "";
+		_wake.notify_all();
+		_wake.wait(lock, [this]() { return _stopped || !_reading; });
+		return;
+	case RangeEvent::MOVED:
+		_partial = path;
+		break;
+	}
+	_wake.notify_all();
+}
+
+void PackStream::Cancel()
+{
+	std::lock_guard<std::mutex> lock(_lock);
+	_cancelled = true;
+	_wake.notify_all();
+}
+
+bool PackStream::Complete()
+{
+	std::lock_guard<std::mutex> lock(_lock);
+	return _complete && !_cancelled;
+}
+
+bool PackStream::Running()
+{
+	std::lock_guard<std::mutex> lock(_lock);
+	return !_stopped;
+}
+
+bool PackStream::Claim()
+{
+	std::lock_guard<std::mutex> lock(_lock);
+	if (!_complete || _cancelled) {
+		return false;
+	}
+	_claimed = true;
+	return true;
+}
+
+bool PackStream::Claimed()
+{
+	std::lock_guard<std::mutex> lock(_lock);
+	return _claimed;
+}
+
+bool PackStream::_readCentralDirectory()
+{
+	if (_size < ZIP_END_SIZE) {
+		return false;
+	}
+	// The end record sits behind an up to 64 KiB comment, with the zip64
+	// locator right in front of it
+	uint64_t tailSize = std::min<uint64_t>(
+		_size, ZIP64_LOCATOR_SIZE + ZIP_END_SIZE + ZIP_MAX_COMMENT);
+	uint64_t tailBegin = _size - tailSize;
+	std::vector<char> tail = fetch_range(_url, tailBegin, _size);
+	if (tail.size() < ZIP_END_SIZE) {
+		return false;
+	}
+	size_t endPos = tail.size() - ZIP_END_SIZE + 1;
+	while (endPos-- > 0) {
+		if (le32(&tail[endPos]) == ZIP_END) {
+			break;
+		}
+	}
+	if (endPos == (size_t)-1) {
+		return false;
+	}
+	const char *endRecord = &tail[endPos];
+	uint64_t count = le16(endRecord + 10);
+	uint64_t cdSize = le32(endRecord + 12);
+	uint64_t cdOffset = le32(endRecord + 16);
+	if (count == 0xFFFF || cdSize == 0xFFFFFFFF ||
+	    cdOffset == 0xFFFFFFFF) {
+		if (endPos < ZIP64_LOCATOR_SIZE) {
+			return false;
+		}
+		const char *locator = endRecord - ZIP64_LOCATOR_SIZE;
+		if (le32(locator) != ZIP64_LOCATOR) {
+			return false;
+		}
+		std::vector<char> end64 = read_range(_url, tail, tailBegin,
+						     le64(locator + 8),
+						     ZIP64_END_SIZE);
+		if (end64.size() != ZIP64_END_SIZE ||
+		    le32(end64.data()) != ZIP64_END) {
+			return false;
+		}
+		count = le64(&end64[32]);
+		cdSize = le64(&end64[40]);
+		cdOffset = le64(&end64[48]);
+	}
+	if (cdOffset > _size || cdSize > _size - cdOffset) {
+		return false;
+	}
+	std::vector<char> cd =
+		read_range(_url, tail, tailBegin, cdOffset, cdSize);
+	if (cd.size() != cdSize) {
+		return false;
+	}
+
+	std::vector<Entry> entries;
+	size_t pos = 0;
+	for (uint64_t i = 0; i < count; i++) {
+		if (cd.size() < ZIP_CENTRAL_HEADER_SIZE ||
+		    pos > cd.size() - ZIP_CENTRAL_HEADER_SIZE ||
+		    le32(&cd[pos]) != ZIP_CENTRAL_HEADER) {
+			return false;
+		}
+		const char *header = &cd[pos];
+		uint16_t nameLength = le16(header + 28);
+		uint16_t extraLength = le16(header + 30);
+		uint16_t commentLength = le16(header + 32);
+		size_t recordSize = ZIP_CENTRAL_HEADER_SIZE + nameLength +
+				    extraLength + commentLength;
+		if (recordSize > cd.size() - pos) {
+			return false;
+		}
+		Entry entry;
+		entry.flags = le16(header + 8);
+		entry.method = le16(header + 10);
+		entry.crc = le32(header + 16);
+		entry.compressedSize = le32(header + 20);
+		entry.size = le32(header + 24);
+		entry.headerOffset = le32(header + 42);
+		entry.name.assign(header + ZIP_CENTRAL_HEADER_SIZE, nameLength);
+		entry.end = 0;
+		entry.extracted = false;
+		// Zip64 values follow in the extra field, only the ones that
+		// overflowed and in this order
+		const char *extra = header + ZIP_CENTRAL_HEADER_SIZE + nameLength;
+		for (size_t x = 0; x + 4 <= extraLength;) {
+			uint16_t id = le16(extra + x);
+			uint16_t length = le16(extra + x + 2);
+			if (x + 4 + length > extraLength) {
+				break;
+			}
+			if (id == ZIP64_EXTRA) {
+				const char *field = extra + x + 4;
+				size_t used = 0;
+				if (entry.size == 0xFFFFFFFF && used + 8 <= length) {
+					entry.size = le64(field + used);
+					used += 8;
+				}
+				if (entry.compressedSize == 0xFFFFFFFF &&
+				    used + 8 <= length) {
+					entry.compressedSize = le64(field + used);
+					used += 8;
+				}
+				if (entry.headerOffset == 0xFFFFFFFF &&
+				    used + 8 <= length) {
+					entry.headerOffset = le64(field + used);
+					used += 8;
+				}
+			}
+			x += 4 + length;
+		}
+		entries.push_back(entry);
+		pos += recordSize;
+	}
+
+	std::sort(entries.begin(), entries.end(),
+		  [](const Entry &a, const Entry &b) {
+			  return a.headerOffset < b.headerOffset;
+		  });
+	bool hasBundleInfo = false;
+	bool hasCollection = false;
+	for (size_t i = 0; i < entries.size(); i++) {
+		auto &entry = entries[i];
+		entry.end = i + 1 < entries.size() ? entries[i + 1].headerOffset
+						   : cdOffset;
+		if (entry.end < entry.headerOffset ||
+		    entry.end - entry.headerOffset <
+			    ZIP_LOCAL_HEADER_SIZE + entry.compressedSize) {
+			return false;
+		}
+		if ((entry.flags & ZIP_ENCRYPTED) ||
+		    (entry.method != ZIP_STORED &&
+		     entry.method != ZIP_DEFLATED) ||
+		    !safe_entry_name(entry.name)) {
+			obs_log(LOG_INFO,
+				"Streaming install: can't extract %s early",
+				entry.name.c_str());
+			return false;
+		}
+		hasBundleInfo |= entry.name == "bundle_info.json";
+		hasCollection |= entry.name == "collection.json";
+	}
+	if (!hasBundleInfo || !hasCollection) {
+		return false;
+	}
+
+	std::lock_guard<std::mutex> lock(_lock);
+	_entries = std::move(entries);
+	return true;
+}
+
+bool PackStream::_extract(const Entry &entry, const std::string &partial)
+{
+	std::string target = _directory + "/" + entry.name;
+	if (entry.name.back() == '/') {
+		os_mkdirs(target.c_str());
+		return true;
+	}
+	os_mkdirs(target.substr(0, target.find_last_of('/')).c_str());
+
+	FILE *in = os_fopen(partial.c_str(), "rb");
+	if (!in) {
+		return false;
+	}
+	char header[ZIP_LOCAL_HEADER_SIZE];
+	if (!read_file_at(in, entry.headerOffset, header, sizeof(header)) ||
+	    le32(header) != ZIP_LOCAL_HEADER) {
+		fclose(in);
+		return false;
+	}
+	uint64_t offset = entry.headerOffset + ZIP_LOCAL_HEADER_SIZE +
+			  le16(header + 26) + le16(header + 28);
+	if (offset + entry.compressedSize > entry.end) {
+		fclose(in);
+		return false;
+	}
+	FILE *out = os_fopen(target.c_str(), "wb");
+	if (!out) {
+		fclose(in);
+		return false;
+	}
+
+	z_stream zs = {};
+	int zret = Z_OK;
+	bool ok = entry.method == ZIP_STORED ||
+		  inflateInit2(&zs, -MAX_WBITS) == Z_OK;
+	bool inflating = ok && entry.method == ZIP_DEFLATED;
+	std::vector<char> input(EXTRACT_CHUNK);
+	std::vector<char> output(EXTRACT_CHUNK);
+	uLong crc = crc32(0L, Z_NULL, 0);
+	uint64_t written = 0;
+	uint64_t remaining = entry.compressedSize;
+	while (ok && remaining > 0) {
+		{
+			// Big entries would hold up Cancel() and the move of the
+			// finished archive otherwise
+			std::lock_guard<std::mutex> lock(_lock);
+			if (_cancelled || _partial != partial) {
+				ok = false;
+				break;
+			}
+		}
+		size_t chunk =
+			(size_t)std::min<uint64_t>(remaining, input.size());
+		if (!read_file_at(in, offset, input.data(), chunk)) {
+			ok = false;
+			break;
+		}
+		offset += chunk;
+		remaining -= chunk;
+		if (!inflating) {
+			crc = crc32(crc, (const Bytef *)input.data(),
+				    (uInt)chunk);
+			ok = fwrite(input.data(), 1, chunk, out) == chunk;
+			written += chunk;
+			continue;
+		}
+		zs.next_in = (Bytef *)input.data();
+		zs.avail_in = (uInt)chunk;
+		do {
+			zs.next_out = (Bytef *)output.data();
+			zs.avail_out = (uInt)output.size();
+			zret = inflate(&zs, Z_NO_FLUSH);
+			if (zret != Z_OK && zret != Z_STREAM_END) {
+				ok = false;
+				break;
+			}
+			size_t produced = output.size() - zs.avail_out;
+			crc = crc32(crc, (const Bytef *)output.data(),
+				    (uInt)produced);
+			if (fwrite(output.data(), 1, produced, out) !=
+			    produced) {
+				ok = false;
+				break;
+			}
+			written += produced;
+		} while (zs.avail_out == 0 && zret != Z_STREAM_END);
+	}
+	if (inflating) {
+		ok = ok && zret == Z_STREAM_END;
+		inflateEnd(&zs);
+	}
+	fclose(out);
+	fclose(in);
+
+	ok = ok && crc == entry.crc && written == entry.size;
+	if (!ok) {
+		obs_log(LOG_WARNING, "Streaming install: could not extract %s",
+			entry.name.c_str());
+	}
+	return ok;
+}
+
+bool PackStream::_covered(uint64_t begin, uint64_t end) const
+{
+	auto it = _written.upper_bound(begin);
+	if (it == _written.begin()) {
+		return false;
+	}
+	--it;
+	return it->first <= begin && it->second >= end;
+}
+
+// All the setup wizard reads before the install itself
+bool PackStream::_isReady() const
+{
+	for (auto const &entry : _entries) {
+		if (!entry.extracted &&
+		    (entry.name == "bundle_info.json" ||
+		     entry.name.rfind("Assets/stream-deck/", 0) == 0)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+void PackStream::_run()
+{
+	bool read = _readCentralDirectory();
+	std::unique_lock<std::mutex> lock(_lock);
+	if (!read) {
+		obs_log(LOG_INFO,
+			"Streaming install: could not read the archive's central directory");
+		_failed = true;
+	}
+	// Entries in archive order, which is about the order they arrive in
+	while (!_failed && !_cancelled) {
+		Entry *next = nullptr;
+		bool remaining = false;
+		for (auto &entry : _entries) {
+			if (entry.extracted) {
+				continue;
+			}
+			remaining = true;
+			if (_covered(entry.headerOffset, entry.end)) {
+				next = &entry;
+				break;
+			}
+		}
+		if (!remaining) {
+			_complete = true;
+			break;
+		}
+		if (_finished && _partial == "") {
+			// Being moved into place
+			_wake.wait(lock);
+			continue;
+		}
+		if (!next) {
+			if (_finished) {
+				_failed = true;
+				break;
+			}
+			_wake.wait(lock);
+			continue;
+		}
+		std::string partial = _partial;
+		_reading = true;
+		lock.unlock();
+		bool extracted = _extract(*next, partial);
+		lock.lock();
+		_reading = false;
+		_wake.notify_all();
+		if (!extracted && _partial != partial && !_cancelled) {
+			// Moved away underneath it, again from the new place
+			continue;
+		}
+		if (!extracted) {
+			_failed = true;
+			break;
+		}
+		next->extracted = true;
+		if (!_readySent && _isReady()) {
+			_readySent = true;
+			lock.unlock();
+			_ready();
+			lock.lock();
+		}
+	}
+	bool complete = _complete;
+	bool cancelled = _cancelled;
+	_stopped = true;
+	_wake.notify_all();
+	lock.unlock();
+	if (!cancelled) {
+		if (!complete) {
+			obs_log(LOG_INFO,
+				"Streaming install: falling back to the finished download");
+		}
+		_done(complete);
+	}
+}
+
+} // namespace elgatocloud
@@ -0,0 +1,110 @@
+/*
+Elgato Deep-Linking OBS Plug-In
+Copyright (C) 2024 Corsair Memory Inc. oss.elgato@corsair.com
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program. If not, see <https://www.gnu.org/licenses/>
+*/
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <cstdint>
+
+#include "downloader.h"
+
+namespace elgatocloud {
+
+// Unpacks a .elgatoscene archive while it is still downloading. The zip's
+// central directory is fetched up front with ranged requests, then every
+// entry is extracted into a staging directory as soon as the downloader
+// reports the bytes it spans as written to the partial file. Gives up on
+// anything unexpected (encryption, unsupported compression, a CRC mismatch,
+// the download starting over); the finished archive is installed the usual
+// way then. Made with std::make_shared, its thread holds on to it.
+class PackStream : public std::enable_shared_from_this<PackStream> {
+public:
+	// directory is created and should be on the install location's volume,
+	// so the finished pack can be moved into place.
+	PackStream(std::string url, uint64_t size, std::string directory);
+	~PackStream();
+
+	// ready runs once bundle_info.json and the Stream Deck assets are
+	// extracted, which is all the setup wizard needs. done runs once
+	// everything is extracted (true) or the stream gave up (false).
+	// Both run on the stream's own thread.
+	void Start(std::function<void()> ready, std::function<void(bool)> done);
+	// Fed from the download's RangeCallbackFn
+	void Update(RangeEvent event, const std::string &path, uint64_t begin,
+		    uint64_t end);
+	// Stops extracting, doesn't wait for the stream's thread. The staging
+	// directory is deleted with the stream unless it was claimed.
+	void Cancel();
+	bool Complete();
+	// Still extracting, Complete() may turn true yet
+	bool Running();
+	// Hands the extracted pack over to the installer, which moves the
+	// staging directory away. False if it isn't complete.
+	bool Claim();
+	bool Claimed();
+	inline std::string Directory() const { return _directory; }
+
+private:
+	struct Entry {
+		std::string name;
+		uint16_t flags;
+		uint16_t method;
+		uint32_t crc;
+		uint64_t compressedSize;
+		uint64_t size;
+		uint64_t headerOffset;
+		// The next entry's local header or the central directory,
+		// everything up to here has to be on disk before extracting.
+		uint64_t end;
+		bool extracted;
+	};
+
+	bool _readCentralDirectory();
+	bool _extract(const Entry &entry, const std::string &partial);
+	bool _covered(uint64_t begin, uint64_t end) const;
+	bool _isReady() const;
+	void _run();
+
+	std::string _url;
+	uint64_t _size;
+	std::string _directory;
+	std::vector<Entry> _entries;
+	std::map<uint64_t, uint64_t> _written; // Merged [begin, end) ranges
+	std::string _partial;
+	bool _finished = false; // Fully downloaded
+	bool _failed = false;
+	bool _cancelled = false;
+	bool _complete = false;
+	bool _claimed = false;
+	bool _readySent = false;
+	bool _stopped = true; // No thread running
+	bool _reading = false; // The archive is open in _extract()
+	std::function<void()> _ready;
+	std::function<void(bool)> _done;
+	std::mutex _lock;
+	std::condition_variable _wake;
+};
+
+} // namespace elgatocloud
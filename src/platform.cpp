@@ -38,6 +38,7 @@ with this program. If not, see <https://www.gnu.org/licenses/>
 #include <errno.h>
 #include <cstring>
 #include <sys/stat.h>
+#include <fcntl.h>
 #include <CoreFoundation/CoreFoundation.h>
 #include <ApplicationServices/ApplicationServices.h>
 #endif
@@ -414,6 +415,176 @@ FILE *open_tmp_file(const char *mode, std::string &outFilename)
 #endif
 }
 
+bool write_file_at(FILE *file, uint64_t offset, const void *data, size_t size)
+{
+	const char *bytes = static_cast<const char *>(data);
+#ifdef WIN32
+	HANDLE handle = (HANDLE)_get_osfhandle(_fileno(file));
+	if (handle == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+	while (size > 0) {
+		OVERLAPPED overlapped = {};
+		overlapped.Offset = (DWORD)(offset & 0xFFFFFFFF);
+		overlapped.OffsetHigh = (DWORD)(offset >> 32);
+		DWORD chunk = size > 0x40000000 ? 0x40000000 : (DWORD)size;
+		DWORD written = 0;
+		if (!WriteFile(handle, bytes, chunk, &written, &overlapped) ||
+		    written == 0) {
+			return false;
+		}
+		bytes += written;
+		offset += written;
+		size -= written;
+	}
+	return true;
+#elif __APPLE__
+	int fd = fileno(file);
+	while (size > 0) {
+		ssize_t written = pwrite(fd, bytes, size, (off_t)offset);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		bytes += written;
+		offset += (uint64_t)written;
+		size -= (size_t)written;
+	}
+	return true;
+#endif
+}
+
+bool read_file_at(FILE *file, uint64_t offset, void *data, size_t size)
+{
+	char *bytes = static_cast<char *>(data);
+#ifdef WIN32
+	HANDLE handle = (HANDLE)_get_osfhandle(_fileno(file));
+	if (handle == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+	while (size > 0) {
+		OVERLAPPED overlapped = {};
+		overlapped.Offset = (DWORD)(offset & 0xFFFFFFFF);
+		overlapped.OffsetHigh = (DWORD)(offset >> 32);
+		DWORD chunk = size > 0x40000000 ? 0x40000000 : (DWORD)size;
+		DWORD read = 0;
+		if (!ReadFile(handle, bytes, chunk, &read, &overlapped) ||
+		    read == 0) {
+			return false;
+		}
+		bytes += read;
+		offset += read;
+		size -= read;
+	}
+	return true;
+#elif __APPLE__
+	int fd = fileno(file);
+	while (size > 0) {
+		ssize_t read = pread(fd, bytes, size, (off_t)offset);
+		if (read < 0 && errno == EINTR) {
+			continue;
+		}
+		if (read <= 0) {
+			return false;
+		}
+		bytes += read;
+		offset += (uint64_t)read;
+		size -= (size_t)read;
+	}
+	return true;
+#endif
+}
+
+bool truncate_file(FILE *file, uint64_t size)
+{
+	fflush(file);
+#ifdef WIN32
+	return _chsize_s(_fileno(file), (__int64)size) == 0;
+#elif __APPLE__
+	return ftruncate(fileno(file), (off_t)size) == 0;
+#endif
+}
+
+bool preallocate_file(FILE *file, uint64_t size)
+{
+#ifdef WIN32
+	HANDLE handle = (HANDLE)_get_osfhandle(_fileno(file));
+	if (handle == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+	FILE_ALLOCATION_INFO info = {};
+	info.AllocationSize.QuadPart = (LONGLONG)size;
+	return SetFileInformationByHandle(handle, FileAllocationInfo, &info,
+					  sizeof(info));
+#elif __APPLE__
+	// No posix_fallocate on macOS. F_PREALLOCATE reserves blocks past
+	// the physical end of file and leaves the logical size alone.
+	int fd = fileno(file);
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		return false;
+	}
+	if ((uint64_t)st.st_size >= size) {
+		return true;
+	}
+	fstore_t store = {F_ALLOCATECONTIG, F_PEOFPOSMODE, 0,
+			  (off_t)(size - (uint64_t)st.st_size), 0};
+	if (fcntl(fd, F_PREALLOCATE, &store) == -1) {
+		store.fst_flags = F_ALLOCATEALL;
+		return fcntl(fd, F_PREALLOCATE, &store) != -1;
+	}
+	return true;
+#endif
+}
+
+bool sync_file(FILE *file)
+{
+	fflush(file);
+#ifdef WIN32
+	return _commit(_fileno(file)) == 0;
+#elif __APPLE__
+	// fsync only reaches the drive's cache on macOS
+	int fd = fileno(file);
+	return fcntl(fd, F_FULLFSYNC) != -1 || fsync(fd) == 0;
+#endif
+}
+
+#ifdef __APPLE__
+static bool stat_existing(std::string path, struct stat &st)
+{
+	while (stat(path.c_str(), &st) != 0) {
+		auto slashPos = path.find_last_of('/', path.size() - 2);
+		if (path.size() < 2 || slashPos == std::string::npos) {
+			return false;
+		}
+		path.resize(slashPos + 1);
+	}
+	return true;
+}
+#endif
+
+bool same_volume(const std::string &a, const std::string &b)
+{
+#ifdef WIN32
+	TString TA = makeLongPath(a);
+	TString TB = makeLongPath(b);
+	TCHAR volumeA[MAX_PATH], volumeB[MAX_PATH];
+	if (!GetVolumePathName(TA.c_str(), volumeA, MAX_PATH) ||
+	    !GetVolumePathName(TB.c_str(), volumeB, MAX_PATH)) {
+		return false;
+	}
+	return lstrcmpi(volumeA, volumeB) == 0;
+#elif __APPLE__
+	struct stat stA, stB;
+	if (!stat_existing(a, stA) || !stat_existing(b, stB)) {
+		return false;
+	}
+	return stA.st_dev == stB.st_dev;
+#endif
+}
+
 bool move_file(const std::string &from, const std::string &to)
 {
 #ifdef WIN32
@@ -426,6 +597,18 @@ bool move_file(const std::string &from, const std::string &to)
 #endif
 }
 
+bool link_file(const std::string &from, const std::string &to)
+{
+#ifdef WIN32
+	TString TFrom = makeLongPath(from);
+	TString TTo = makeLongPath(to);
+
+	return CreateHardLink(TTo.c_str(), TFrom.c_str(), NULL);
+#elif __APPLE__
+	return link(from.c_str(), to.c_str()) == 0;
+#endif
+}
+
 std::string move_file_safe(const std::string &from, const std::string &to)
 {
 	if (move_file(from, to)) {
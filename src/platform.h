@@ -18,6 +18,8 @@ with this program. If not, see <https://www.gnu.org/licenses/>
 
 #include <string>
 #include <functional>
+#include <cstdio>
+#include <cstdint>
 
 std::string get_scene_collections_path();
 bool is_symlink(std::string path);
@@ -29,7 +31,20 @@ bool listen_on_pipe(const std::string &pipe_name,
 		    std::function<void(std::string)> callback);
 
 FILE *open_tmp_file(const char *mode, std::string &outFilename);
+// Writes at an absolute offset without going through the stdio buffer
+bool write_file_at(FILE *file, uint64_t offset, const void *data, size_t size);
+bool read_file_at(FILE *file, uint64_t offset, void *data, size_t size);
+bool truncate_file(FILE *file, uint64_t size);
+// Reserves disk space for size bytes without changing the file's length
+bool preallocate_file(FILE *file, uint64_t size);
+// Flushes the file all the way to the disk
+bool sync_file(FILE *file);
+// Whether both paths live on the same volume, i.e. a move between them is a
+// rename. Paths that don't exist yet are judged by their nearest existing parent.
+bool same_volume(const std::string &a, const std::string &b);
 bool move_file(const std::string &from, const std::string &to);
+// Hard links 'from' at 'to'. Both have to be on the same volume.
+bool link_file(const std::string &from, const std::string &to);
 
 // Moves file from 'from' to 'to' but renames it if there's a collision
 std::string move_file_safe(const std::string &from, const std::string &to);
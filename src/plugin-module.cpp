@@ -30,6 +30,7 @@ with this program. If not, see <https://www.gnu.org/licenses/>
 
 #include <scene-bundle.hpp>
 #include <export-wizard.hpp>
+#include <downloader-bench.hpp>
 #include <elgato-product.hpp>
 #include <util.h>
 
@@ -69,6 +70,11 @@ void import_collection(void *)
 	product.Install(fileName.toStdString(), &product, false);
 }
 
+void benchmark_downloader(void *)
+{
+	elgatocloud::RunDownloaderBenchmark();
+}
+
 const char* obs_module_name(void)
 {
 	return "Elgato Marketplace Connect for OBS";
@@ -88,6 +94,8 @@ bool obs_module_load(void)
 						 export_collection, NULL);
 		obs_frontend_add_tools_menu_item("Import Maker Scene Collection",
 						 import_collection, NULL);
+		obs_frontend_add_tools_menu_item("Benchmark Downloader",
+						 benchmark_downloader, NULL);
 	}
 	
 	return true;
@@ -95,7 +103,9 @@ bool obs_module_load(void)
 
 void obs_module_unload(void)
 {
+	elgatocloud::StopDownloaderBenchmark();
 	elgatocloud::ShutDown();
 	obs_log(LOG_INFO, "plugin unloaded");
+	cleanup_curl_share();
 	curl_global_cleanup();
 }
@@ -29,6 +29,7 @@ with this program. If not, see <https://www.gnu.org/licenses/>
 #include <QThread>
 #include <QMetaObject>
 #include <QTemporaryDir>
+#include <QDirIterator>
 #include <vector>
 #include <set>
 #include <string>
@@ -120,8 +121,20 @@ bool SceneBundle::FromElgatoCloudFile(std::string filePath,
 				      std::string packPath)
 {
 	_reset();
-	//Handle the ZIP archive
 	_packPath = packPath;
+	if (QFileInfo(QString::fromStdString(filePath)).isDir()) {
+		// Extracted while it downloaded, it only needs moving into place
+		QDir(QString::fromStdString(packPath)).removeRecursively();
+		if (!move_file(filePath, packPath)) {
+			return false;
+		}
+		std::string bundleInfo = packPath + "/bundle_info.json";
+		std::string collection = packPath + "/collection.json";
+		return os_file_exists(bundleInfo.c_str()) &&
+		       os_file_exists(collection.c_str());
+	}
+
+	//Handle the ZIP archive
 	ZipArchive file;
 	file.openExisting(filePath.c_str());
 
@@ -201,6 +214,52 @@ SceneCollectionInfo SceneBundle::ExtractBundleInfo(std::string filePath)
 	return result;
 }
 
+SceneCollectionInfo SceneBundle::ExtractStagedBundleInfo(std::string directory)
+{
+	SceneCollectionInfo result;
+	std::string bundleInfoPath = directory + "/bundle_info.json";
+	char *bundleInfo = os_quick_read_utf8_file(bundleInfoPath.c_str());
+	if (!bundleInfo) {
+		result.bundleInfo = "{\"Error\": \"Incompatible File\"}";
+		return result;
+	}
+	result.bundleInfo = bundleInfo;
+	bfree(bundleInfo);
+
+	QString streamDeckDir =
+		QString::fromStdString(directory + "/Assets/stream-deck");
+	if (!QDir(streamDeckDir).exists()) {
+		return result;
+	}
+
+	// Copied out like ExtractBundleInfo does, as the install moves the
+	// staging directory away while the wizard still offers these files
+	QTemporaryDir tempDir;
+	if (!tempDir.isValid()) {
+		qWarning() << "Failed to create temporary directory";
+		return result;
+	}
+
+	QString basePath = tempDir.path();
+	tempDir.setAutoRemove(false);
+
+	QDirIterator it(streamDeckDir, QDir::Files,
+			QDirIterator::Subdirectories);
+	while (it.hasNext()) {
+		QString from = it.next();
+		QString outPath = basePath + "/Assets/stream-deck/" +
+				  QDir(streamDeckDir).relativeFilePath(from);
+		QFileInfo fi(outPath);
+		QDir().mkpath(fi.path());
+		if (!QFile::copy(from, outPath)) {
+			qWarning() << "Failed to write file:" << outPath;
+		}
+	}
+	result.streamDeckPath = basePath.toStdString();
+
+	return result;
+}
+
 void SceneBundle::SceneCollectionCreated(enum obs_frontend_event event,
 					 void *obj)
 {
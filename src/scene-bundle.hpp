@@ -117,6 +117,8 @@ public:
 	}
 
 	SceneCollectionInfo ExtractBundleInfo(std::string filePath);
+	// Same, for a pack that was already extracted while it downloaded
+	SceneCollectionInfo ExtractStagedBundleInfo(std::string directory);
 
 	std::vector<std::string> FileList();
 	std::map<std::string, std::string> VideoCaptureDevices();
@@ -41,6 +41,7 @@ with this program. If not, see <https://www.gnu.org/licenses/>
 #include "elgato-styles.hpp"
 #include <plugin-support.h>
 #include "setup-wizard.hpp"
+#include "pack-stream.hpp"
 #include "elgato-product.hpp"
 #include "elgato-cloud-window.hpp"
 #include "scene-bundle.hpp"
@@ -73,6 +74,19 @@ SceneCollectionInfo GetBundleInfo(std::string filename)
 	return data;
 }
 
+SceneCollectionInfo GetStagedBundleInfo(std::string directory)
+{
+	SceneBundle bundle;
+	SceneCollectionInfo data;
+
+	try {
+		data = bundle.ExtractStagedBundleInfo(directory);
+	} catch (...) {
+		data.bundleInfo = "{\"Error\": \"Incompatible File\"}";
+	}
+	return data;
+}
+
 StepsSideBar::StepsSideBar(std::vector<std::string> const& steps, std::string name, std::string thumbnailPath, QWidget* parent)
 	: QWidget(parent)
 {
@@ -992,6 +1006,11 @@ StreamPackageSetupWizard::StreamPackageSetupWizard(QWidget *parent,
 
 StreamPackageSetupWizard::~StreamPackageSetupWizard()
 {
+	if (_stream && !_installStarted) {
+		// Nothing to extract for anymore, the finished download opens
+		// the wizard again
+		_stream->Cancel();
+	}
 	if (sdFilesPath_ != "") {
 		QDir dir(sdFilesPath_.c_str());
 		dir.removeRecursively();
@@ -1018,7 +1037,9 @@ void StreamPackageSetupWizard::OpenArchive()
 {
 	_canceled = false;
 	_future = std::async(std::launch::async, [this]() {
-		auto bundleInfoData = GetBundleInfo(_filename);
+		auto bundleInfoData =
+			_stream ? GetStagedBundleInfo(_stream->Directory())
+				: GetBundleInfo(_filename);
 		QMetaObject::invokeMethod(
 			QCoreApplication::instance()->thread(), // main GUI thread
 			[this, bundleInfoData]() {
@@ -1135,6 +1156,83 @@ void StreamPackageSetupWizard::OpenArchive()
 	});
 }
 
+void StreamPackageSetupWizard::SetStream(std::shared_ptr<PackStream> stream)
+{
+	_stream = stream;
+}
+
+void StreamPackageSetupWizard::SetArchive(std::string filename)
+{
+	_filename = filename;
+	_resumeInstall();
+}
+
+void StreamPackageSetupWizard::StreamDone(bool complete)
+{
+	// Otherwise the install waits for the archive
+	if (complete || _filename != "") {
+		_resumeInstall();
+	}
+}
+
+void StreamPackageSetupWizard::DownloadFailed()
+{
+	if (_waitDialog) {
+		_waitDialog->close();
+		_waitDialog = nullptr;
+	}
+	_pendingInstall = nullptr;
+	QMessageBox::warning(
+		this, obs_module_text("SetupWizard.DownloadFailed.Title"),
+		obs_module_text("SetupWizard.DownloadFailed.Text"),
+		QMessageBox::Ok);
+	close();
+}
+
+void StreamPackageSetupWizard::_installWhenReady(
+	std::function<void(std::string)> install)
+{
+	if (!_stream) {
+		install(_filename);
+		return;
+	}
+	if (_stream->Claim()) {
+		install(_stream->Directory());
+		if (_deleteOnClose && _filename != "") {
+			os_unlink(_filename.c_str());
+		}
+		return;
+	}
+	// A stream still extracting the finished archive gets to finish, the
+	// archive is the fallback once it gives up
+	if (_filename != "" && !_stream->Running()) {
+		install(_filename);
+		return;
+	}
+	_pendingInstall = install;
+	_waitDialog = new QProgressDialog(
+		obs_module_text("SetupWizard.WaitingForDownload"), QString(), 0,
+		0, this);
+	_waitDialog->setAttribute(Qt::WA_DeleteOnClose);
+	_waitDialog->setCancelButton(nullptr);
+	_waitDialog->setWindowModality(Qt::WindowModal);
+	_waitDialog->show();
+}
+
+void StreamPackageSetupWizard::_resumeInstall()
+{
+	if (!_pendingInstall) {
+		return;
+	}
+	auto install = _pendingInstall;
+	_pendingInstall = nullptr;
+	if (_waitDialog) {
+		_waitDialog->close();
+		_waitDialog = nullptr;
+	}
+	_installWhenReady(install);
+}
+
 bool StreamPackageSetupWizard::DisableVideoCaptureSources(void *data,
 							  obs_source_t *source)
 {
@@ -1298,10 +1396,12 @@ void StreamPackageSetupWizard::_buildNewCollectionUI(
 			_setup.audioSettings = settings;
 			// Nuke the video preview window
 			_installStarted = true;
-			installStreamPackage(_setup, _filename,
-						    _deleteOnClose, _toEnable,
-							_productName, _productId,
-							_productSlug);
+			_installWhenReady([this](std::string filename) {
+				installStreamPackage(_setup, filename,
+						     _deleteOnClose, _toEnable,
+						     _productName, _productId,
+						     _productSlug);
+			});
 		});
 	connect(aSetup, &AudioSetup::backPressed, this,
 		[this, videoSourceLabels]() {
@@ -1406,7 +1506,10 @@ void StreamPackageSetupWizard::_buildMergeCollectionUI(std::map<std::string, std
 			_setup.audioSettings = settings;
 			// Nuke the video preview window
 			_installStarted = true;
-			mergeStreamPackage(_setup, _filename, _deleteOnClose, _toEnable);
+			_installWhenReady([this](std::string filename) {
+				mergeStreamPackage(_setup, filename,
+						   _deleteOnClose, _toEnable);
+			});
 		});
 	connect(aSetup, &AudioSetup::backPressed, this,
 		[this, videoSourceLabels]() {
@@ -24,6 +24,8 @@ with this program. If not, see <https://www.gnu.org/licenses/>
 
 #include <future>
 #include <atomic>
+#include <memory>
+#include <functional>
 
 #include <obs-module.h>
 #include <obs-frontend-api.h>
@@ -36,6 +38,7 @@ with this program. If not, see <https://www.gnu.org/licenses/>
 #include <QComboBox>
 #include <QStackedWidget>
 #include <QMovie>
+#include <QProgressDialog>
 //#include <QTConcurrent>
 
 #include <nlohmann/json.hpp>
@@ -225,6 +228,8 @@ private:
 	QMovie *_indicator;
 };
 
+class PackStream;
+
 class StreamPackageSetupWizard : public QDialog {
 	Q_OBJECT
 
@@ -233,6 +238,13 @@ public:
 				 std::string filename, bool deleteOnClose);
 	~StreamPackageSetupWizard();
 	void OpenArchive();
+	// Opened while the pack downloads: the wizard reads the pack the
+	// stream extracts, the archive itself arrives through SetArchive.
+	void SetStream(std::shared_ptr<PackStream> stream);
+	inline PackStream *Stream() const { return _stream.get(); }
+	void SetArchive(std::string filename);
+	void StreamDone(bool complete);
+	void DownloadFailed();
 	static bool DisableVideoCaptureSources(void *data,
 					       obs_source_t *source);
 	static bool EnableVideoCaptureSourcesActive(void* data,
@@ -253,6 +265,10 @@ private:
 		std::vector<SDFileDetails> &streamDeckActions,
 		std::vector<SDFileDetails> &streamDeckProfiles);
 	void _buildMergeCollectionUI(std::map<std::string, std::string>& videoSourceLabels, std::vector<OutputScene>& outputScenes);
+	// Runs install with the extracted pack or the archive, whichever is
+	// there first, waiting for the download if neither is.
+	void _installWhenReady(std::function<void(std::string)> install);
+	void _resumeInstall();
 	std::string _productName;
 	std::string _productId;
 	std::string _productSlug;
@@ -273,6 +289,9 @@ private:
 	//QFuture<void> _future;
 	std::future<void> _future;
 	std::atomic<bool> _canceled{false};
+	std::shared_ptr<PackStream> _stream;
+	std::function<void(std::string)> _pendingInstall;
+	QProgressDialog *_waitDialog = nullptr;
 };
 
 void installStreamPackage(Setup setup, std::string filename, bool deleteOnClose,
@@ -286,5 +305,6 @@ void EnableVideoCaptureSourcesJson(std::vector<std::string> sourceIds, std::stri
 
 StreamPackageSetupWizard *GetSetupWizard();
 SceneCollectionInfo GetBundleInfo(std::string filename);
+SceneCollectionInfo GetStagedBundleInfo(std::string directory);
 
 } // namespace elgatocloud
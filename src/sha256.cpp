@@ -0,0 +1,220 @@
+/*
+Elgato Deep-Linking OBS Plug-In
+Copyright (C) 2024 Corsair Memory Inc. oss.elgato@corsair.com
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program. If not, see <https://www.gnu.org/licenses/>
+*/
+
+#include "sha256.hpp"
+
+#include <cstring>
+#include <cstdlib>
+
+static const uint32_t round_constants[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+	0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+	0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+	0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+	0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+	0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+static inline uint32_t rotr(uint32_t x, int n)
+{
+	return (x >> n) | (x << (32 - n));
+}
+
+static const char *hex_digits = "0123456789abcdef";
+
+static std::string to_hex(const uint8_t *data, size_t size)
+{
+	std::string result;
+	result.reserve(size * 2);
+	for (size_t i = 0; i < size; ++i) {
+		result += hex_digits[data[i] >> 4];
+		result += hex_digits[data[i] & 0xf];
+	}
+	return result;
+}
+
+static bool from_hex(const std::string &hex, uint8_t *data, size_t size)
+{
+	if (hex.size() != size * 2) {
+		return false;
+	}
+	for (size_t i = 0; i < size; ++i) {
+		char byte[3] = {hex[i * 2], hex[i * 2 + 1], 0};
+		char *end = nullptr;
+		data[i] = (uint8_t)strtoul(byte, &end, 16);
+		if (end != byte + 2) {
+			return false;
+		}
+	}
+	return true;
+}
+
+Sha256::Sha256()
+{
+	Reset();
+}
+
+void Sha256::Reset()
+{
+	static const uint32_t initial[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372,
+					    0xa54ff53a, 0x510e527f, 0x9b05688c,
+					    0x1f83d9ab, 0x5be0cd19};
+	memcpy(_state, initial, sizeof(_state));
+	memset(_block, 0, sizeof(_block));
+	_length = 0;
+}
+
+void Sha256::_transform(const uint8_t *block)
+{
+	uint32_t w[64];
+	for (int i = 0; i < 16; ++i) {
+		w[i] = (uint32_t)block[i * 4] << 24 |
+		       (uint32_t)block[i * 4 + 1] << 16 |
+		       (uint32_t)block[i * 4 + 2] << 8 | (uint32_t)block[i * 4 + 3];
+	}
+	for (int i = 16; i < 64; ++i) {
+		uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^
+			      (w[i - 15] >> 3);
+		uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^
+			      (w[i - 2] >> 10);
+		w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+	}
+
+	uint32_t a = _state[0], b = _state[1], c = _state[2], d = _state[3];
+	uint32_t e = _state[4], f = _state[5], g = _state[6], h = _state[7];
+	for (int i = 0; i < 64; ++i) {
+		uint32_t s1 = rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25);
+		uint32_t ch = (e & f) ^ (~e & g);
+		uint32_t t1 = h + s1 + ch + round_constants[i] + w[i];
+		uint32_t s0 = rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22);
+		uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+		uint32_t t2 = s0 + maj;
+		h = g;
+		g = f;
+		f = e;
+		e = d + t1;
+		d = c;
+		c = b;
+		b = a;
+		a = t1 + t2;
+	}
+	_state[0] += a;
+	_state[1] += b;
+	_state[2] += c;
+	_state[3] += d;
+	_state[4] += e;
+	_state[5] += f;
+	_state[6] += g;
+	_state[7] += h;
+}
+
+void Sha256::Update(const void *data, size_t size)
+{
+	const uint8_t *bytes = static_cast<const uint8_t *>(data);
+	size_t buffered = (size_t)(_length % 64);
+	_length += size;
+	if (buffered > 0) {
+		size_t take = 64 - buffered < size ? 64 - buffered : size;
+		memcpy(_block + buffered, bytes, take);
+		bytes += take;
+		size -= take;
+		if (buffered + take < 64) {
+			return;
+		}
+		_transform(_block);
+	}
+	while (size >= 64) {
+		_transform(bytes);
+		bytes += 64;
+		size -= 64;
+	}
+	memcpy(_block, bytes, size);
+}
+
+std::string Sha256::Digest() const
+{
+	Sha256 final = *this;
+	uint64_t bits = _length * 8;
+	uint8_t padding[72] = {0x80};
+	size_t buffered = (size_t)(_length % 64);
+	size_t padSize = buffered < 56 ? 56 - buffered : 120 - buffered;
+	for (int i = 0; i < 8; ++i) {
+		padding[padSize + i] = (uint8_t)(bits >> (56 - i * 8));
+	}
+	final.Update(padding, padSize + 8);
+
+	uint8_t digest[32];
+	for (int i = 0; i < 8; ++i) {
+		digest[i * 4] = (uint8_t)(final._state[i] >> 24);
+		digest[i * 4 + 1] = (uint8_t)(final._state[i] >> 16);
+		digest[i * 4 + 2] = (uint8_t)(final._state[i] >> 8);
+		digest[i * 4 + 3] = (uint8_t)final._state[i];
+	}
+	return to_hex(digest, sizeof(digest));
+}
+
+// "<state words>:<length>:<buffered tail>", all hex except the length
+std::string Sha256::Save() const
+{
+	uint8_t state[32];
+	for (int i = 0; i < 8; ++i) {
+		state[i * 4] = (uint8_t)(_state[i] >> 24);
+		state[i * 4 + 1] = (uint8_t)(_state[i] >> 16);
+		state[i * 4 + 2] = (uint8_t)(_state[i] >> 8);
+		state[i * 4 + 3] = (uint8_t)_state[i];
+	}
+	return to_hex(state, sizeof(state)) + ":" + std::to_string(_length) +
+	       ":" + to_hex(_block, (size_t)(_length % 64));
+}
+
+bool Sha256::Restore(const std::string &saved)
+{
+	auto first = saved.find(':');
+	auto second = saved.find(':', first + 1);
+	if (first == std::string::npos || second == std::string::npos) {
+		return false;
+	}
+	uint8_t state[32];
+	if (!from_hex(saved.substr(0, first), state, sizeof(state))) {
+		return false;
+	}
+	std::string length = saved.substr(first + 1, second - first - 1);
+	char *end = nullptr;
+	uint64_t parsedLength = strtoull(length.c_str(), &end, 10);
+	if (length.empty() || *end != '\0') {
+		return false;
+	}
+	uint8_t block[64] = {};
+	if (!from_hex(saved.substr(second + 1), block,
+		      (size_t)(parsedLength % 64))) {
+		return false;
+	}
+	for (int i = 0; i < 8; ++i) {
+		_state[i] = (uint32_t)state[i * 4] << 24 |
+			    (uint32_t)state[i * 4 + 1] << 16 |
+			    (uint32_t)state[i * 4 + 2] << 8 |
+			    (uint32_t)state[i * 4 + 3];
+	}
+	memcpy(_block, block, sizeof(_block));
+	_length = parsedLength;
+	return true;
+}
@@ -0,0 +1,46 @@
+/*
+Elgato Deep-Linking OBS Plug-In
+Copyright (C) 2024 Corsair Memory Inc. oss.elgato@corsair.com
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program. If not, see <https://www.gnu.org/licenses/>
+*/
+
+#pragma once
+
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+// Incremental SHA-256. Unlike QCryptographicHash the intermediate state can
+// be saved and restored, so hashing a download can continue across sessions.
+class Sha256 {
+public:
+	Sha256();
+	void Reset();
+	void Update(const void *data, size_t size);
+	// Lowercase hex digest of everything added so far
+	std::string Digest() const;
+	// Number of bytes added so far
+	inline uint64_t Size() const { return _length; }
+
+	std::string Save() const;
+	bool Restore(const std::string &saved);
+
+private:
+	void _transform(const uint8_t *block);
+
+	uint32_t _state[8];
+	uint64_t _length;
+	uint8_t _block[64];
+};
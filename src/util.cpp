@@ -33,6 +33,7 @@ with this program. If not, see <https://www.gnu.org/licenses/>
 #include <functional>
 
 #include <thread>
+#include <mutex>
 #include <QMessageBox>
 #include <QEventLoop>
 #include <QFileSystemWatcher>
@@ -41,6 +42,7 @@ with this program. If not, see <https://www.gnu.org/licenses/>
 #include "platform.h"
 #include "util.h"
 #include "api.hpp"
+#include "http-client.hpp"
 
 #ifdef WIN32
 #pragma comment(lib, "crypt32.lib")
@@ -91,6 +93,14 @@ obs_data_t *get_module_config()
 	obs_data_set_default_string(config, "InstallLocation", path.c_str());
 	obs_data_set_default_bool(config, "MakerTools", false);
 
+	// Download caps in KB/s while live, 0 for no cap
+	obs_data_set_default_int(config, "DownloadLimitStreaming", 1024);
+	obs_data_set_default_int(config, "DownloadLimitRecording", 0);
+	// Packs larger than this many MB ask before downloading, 0 never asks
+	obs_data_set_default_int(config, "DownloadConfirmAbove", 0);
+	// Room for downloaded packs kept for reinstalling, in MB. 0 disables.
+	obs_data_set_default_int(config, "PackCacheSize", 10240);
+
 	obs_data_set_default_string(config, "DefaultAudioCaptureSettings", "");
 	obs_data_set_default_string(config, "DefaultVideoCaptureSettings", "");
 
@@ -177,52 +187,103 @@ std::string get_current_scene_collection_filename()
 	return filename;
 }
 
-std::string fetch_string_from_get(std::string url, std::string token)
+// Process-wide DNS cache and TLS session cache. API calls and downloads all
+// go to a handful of hosts, so after the first request they skip the lookup
+// and usually the full TLS handshake. Connections aren't shared, libcurl
+// doesn't support one pool for several multi handles and easy handles in
+// flight at once. Each multi handle keeps its own, and pooled easy handles
+// keep theirs between blocking requests.
+static CURLSH *curl_share = nullptr;
+static std::mutex curl_share_locks[CURL_LOCK_DATA_LAST];
+static std::mutex curl_pool_lock;
+static std::vector<CURL *> curl_pool;
+#define CURL_POOL_SIZE 4
+
+static void lock_curl_share(CURL *handle, curl_lock_data data,
+			    curl_lock_access access, void *userptr)
 {
-	std::string result;
-	CURL *curl_instance = nullptr;
-	curl_instance = curl_easy_init();
-	curl_easy_setopt(curl_instance, CURLOPT_URL, url.c_str());
-	curl_easy_setopt(curl_instance, CURLOPT_WRITEFUNCTION,
-			 write_data_string);
-	curl_easy_setopt(curl_instance, CURLOPT_WRITEDATA,
-			 static_cast<void *>(&result));
-	std::string useragent = USERAGENT " ";
-	useragent += PLUGIN_VERSION;
-	curl_easy_setopt(curl_instance, CURLOPT_USERAGENT, useragent.c_str());
-	if (token != "") {
-		curl_easy_setopt(curl_instance, CURLOPT_XOAUTH2_BEARER,
-				 token.c_str());
-		curl_easy_setopt(curl_instance, CURLOPT_HTTPAUTH,
-				 CURLAUTH_BEARER);
-	}
-	curl_easy_setopt(curl_instance, CURLOPT_CONNECTTIMEOUT, 0);
-	curl_easy_setopt(curl_instance, CURLOPT_TIMEOUT, 0);
-	CURLcode res = curl_easy_perform(curl_instance);
-	
-	if (res == CURLE_OK && result != "") {
-		long http_code = 0;
-		curl_easy_getinfo(curl_instance, CURLINFO_RESPONSE_CODE,
-				  &http_code);
-		curl_easy_cleanup(curl_instance);
-		return result;
-	} else if (res == CURLE_OPERATION_TIMEDOUT || (res == CURLE_OK && result == "")) {
-		obs_log(LOG_WARNING, "Error in fetching GET value - Timed out");
-		obs_log(LOG_WARNING, "   url: %s", url.c_str());
-		obs_log(LOG_WARNING, "   code: %i", res);
-		obs_log(LOG_WARNING, "   response: %s", result.c_str());
-		curl_easy_cleanup(curl_instance);
-		return "{\"error\": \"Connection Timed Out\"}";
+	UNUSED_PARAMETER(handle);
+	UNUSED_PARAMETER(access);
+	UNUSED_PARAMETER(userptr);
+	curl_share_locks[data].lock();
+}
+
+static void unlock_curl_share(CURL *handle, curl_lock_data data, void *userptr)
+{
+	UNUSED_PARAMETER(handle);
+	UNUSED_PARAMETER(userptr);
+	curl_share_locks[data].unlock();
+}
+
+CURLSH *get_curl_share()
+{
+	std::lock_guard<std::mutex> l(curl_pool_lock);
+	if (!curl_share) {
+		curl_share = curl_share_init();
+		curl_share_setopt(curl_share, CURLSHOPT_LOCKFUNC,
+				  lock_curl_share);
+		curl_share_setopt(curl_share, CURLSHOPT_UNLOCKFUNC,
+				  unlock_curl_share);
+		curl_share_setopt(curl_share, CURLSHOPT_SHARE,
+				  CURL_LOCK_DATA_DNS);
+		curl_share_setopt(curl_share, CURLSHOPT_SHARE,
+				  CURL_LOCK_DATA_SSL_SESSION);
+	}
+	return curl_share;
+}
+
+// Returns an easy handle attached to the shared caches. Hand it back with
+// release_curl_handle() instead of curl_easy_cleanup() so the next request
+// can reuse it.
+CURL *acquire_curl_handle()
+{
+	CURLSH *share = get_curl_share();
+	CURL *handle = nullptr;
+	{
+		std::lock_guard<std::mutex> l(curl_pool_lock);
+		if (!curl_pool.empty()) {
+			handle = curl_pool.back();
+			curl_pool.pop_back();
+		}
+	}
+	if (!handle) {
+		handle = curl_easy_init();
+	}
+	curl_easy_setopt(handle, CURLOPT_SHARE, share);
+	return handle;
+}
+
+void release_curl_handle(CURL *handle)
+{
+	// Drops the options of the previous request, the caches stay
+	curl_easy_reset(handle);
+	std::lock_guard<std::mutex> l(curl_pool_lock);
+	if (curl_pool.size() < CURL_POOL_SIZE) {
+		curl_pool.push_back(handle);
+		return;
+	}
+	curl_easy_cleanup(handle);
+}
+
+// Frees pooled handles and, unless a download still uses it, the share
+void cleanup_curl_share()
+{
+	std::lock_guard<std::mutex> l(curl_pool_lock);
+	for (auto handle : curl_pool) {
+		curl_easy_cleanup(handle);
+	}
+	curl_pool.clear();
+	if (curl_share && curl_share_cleanup(curl_share) == CURLSHE_OK) {
+		curl_share = nullptr;
 	}
-	long http_code = 0;
-	curl_easy_getinfo(curl_instance, CURLINFO_RESPONSE_CODE, &http_code);
-	obs_log(LOG_WARNING, "Error in fetching GET value");
-	obs_log(LOG_WARNING, "   url: %s", url.c_str());
-	obs_log(LOG_WARNING, "   curl code: %i", res);
-	obs_log(LOG_WARNING, "   http code: %i", http_code);
-	obs_log(LOG_WARNING, "   response: %s", result.c_str());
-	curl_easy_cleanup(curl_instance);
-	return "{\"error\": \"Unspecified Error\"}";
+}
+
+// Blocking, for threads of their own. Runs on the HttpClient, so the request
+// has a deadline and is cancelled when the module unloads.
+std::string fetch_string_from_get(std::string url, std::string token)
+{
+	auto client = elgatocloud::HttpClient::getInstance();
+	return client->Get(url, token).Wait().body;
 }
 
 
@@ -251,38 +312,8 @@ std::string postBody(std::map<std::string, std::string> params)
 
 std::string fetch_string_from_post(std::string url, std::string postdata, std::string token)
 {
-	std::string result;
-	CURL *curl_instance = curl_easy_init();
-	curl_easy_setopt(curl_instance, CURLOPT_URL, url.c_str());
-	curl_easy_setopt(curl_instance, CURLOPT_WRITEFUNCTION,
-			 write_data<std::string>);
-	curl_easy_setopt(curl_instance, CURLOPT_WRITEDATA,
-			 static_cast<void *>(&result));
-	if (token != "") {
-		curl_easy_setopt(curl_instance, CURLOPT_XOAUTH2_BEARER,
-			token.c_str());
-		curl_easy_setopt(curl_instance, CURLOPT_HTTPAUTH,
-			CURLAUTH_BEARER);
-	}
-	curl_easy_setopt(curl_instance, CURLOPT_POSTFIELDS, postdata.c_str());
-	std::string useragent = USERAGENT " ";
-	useragent += PLUGIN_VERSION;
-	curl_easy_setopt(curl_instance, CURLOPT_USERAGENT, useragent.c_str());
-	CURLcode res = curl_easy_perform(curl_instance);
-	if (res == CURLE_OK) {
-		curl_easy_cleanup(curl_instance);
-		return result;
-	}
-
-	long http_code = 0;
-	curl_easy_getinfo(curl_instance, CURLINFO_RESPONSE_CODE, &http_code);
-	obs_log(LOG_WARNING, "Error in fetching POST value");
-	obs_log(LOG_WARNING, "   url: %s", url.c_str());
-	obs_log(LOG_WARNING, "   curl code: %i", res);
-	obs_log(LOG_WARNING, "   http code: %i", http_code);
-	obs_log(LOG_WARNING, "   response: %s", result.c_str());
-	curl_easy_cleanup(curl_instance);
-	return "{\"error\": \"Unspecified Error\"}";
+	auto client = elgatocloud::HttpClient::getInstance();
+	return client->Post(url, postdata, token).Wait().body;
 }
 
 std::string url_encode(const std::string& decoded)
@@ -296,7 +327,7 @@ std::string url_encode(const std::string& decoded)
 std::vector<char> fetch_bytes_from_url(std::string url)
 {
 	std::vector<char> result;
-	CURL *curl_instance = curl_easy_init();
+	CURL *curl_instance = acquire_curl_handle();
 	curl_easy_setopt(curl_instance, CURLOPT_URL, url.c_str());
 	curl_easy_setopt(curl_instance, CURLOPT_WRITEFUNCTION,
 			 write_data<std::vector<char>>);
@@ -307,13 +338,61 @@ std::vector<char> fetch_bytes_from_url(std::string url)
 	curl_easy_setopt(curl_instance, CURLOPT_USERAGENT, useragent.c_str());
 	CURLcode res = curl_easy_perform(curl_instance);
 
-	curl_easy_cleanup(curl_instance);
+	release_curl_handle(curl_instance);
 	if (res == CURLE_OK) {
 		return result;
 	}
 	return std::vector<char>();
 }
 
+struct RangeResponse {
+	CURL *handle;
+	std::vector<char> data;
+	size_t limit;
+};
+
+static size_t collect_range(char *ptr, size_t size, size_t nmemb,
+			    void *userdata)
+{
+	auto &response = *static_cast<RangeResponse *>(userdata);
+	long http_code = 0;
+	curl_easy_getinfo(response.handle, CURLINFO_RESPONSE_CODE, &http_code);
+	// A server ignoring the range would send the whole file
+	if (http_code != 206 ||
+	    response.data.size() + size * nmemb > response.limit) {
+		return 0;
+	}
+	response.data.insert(response.data.end(), ptr, ptr + size * nmemb);
+	return size * nmemb;
+}
+
+std::vector<char> fetch_range(std::string url, uint64_t begin, uint64_t end)
+{
+	if (end <= begin) {
+		return std::vector<char>();
+	}
+	RangeResponse response{acquire_curl_handle(), {}, (size_t)(end - begin)};
+	std::string range = std::to_string(begin) + "-" + std::to_string(end - 1);
+	curl_easy_setopt(response.handle, CURLOPT_URL, url.c_str());
+	curl_easy_setopt(response.handle, CURLOPT_RANGE, range.c_str());
+	// Callers wait on this to cancel, don't hang on a stalled server
+	curl_easy_setopt(response.handle, CURLOPT_CONNECTTIMEOUT, 15L);
+	curl_easy_setopt(response.handle, CURLOPT_LOW_SPEED_LIMIT, 1L);
+	curl_easy_setopt(response.handle, CURLOPT_LOW_SPEED_TIME, 15L);
+	curl_easy_setopt(response.handle, CURLOPT_WRITEFUNCTION, collect_range);
+	curl_easy_setopt(response.handle, CURLOPT_WRITEDATA,
+			 static_cast<void *>(&response));
+	std::string useragent = USERAGENT " ";
+	useragent += PLUGIN_VERSION;
+	curl_easy_setopt(response.handle, CURLOPT_USERAGENT, useragent.c_str());
+	CURLcode res = curl_easy_perform(response.handle);
+	release_curl_handle(response.handle);
+	if (res != CURLE_OK || response.data.size() != end - begin) {
+		return std::vector<char>();
+	}
+	return response.data;
+}
+
 // Replaces all instances of needle in haystack with word.
 void replace_all(std::string &haystack, std::string needle, std::string word)
 {
@@ -24,6 +24,7 @@ with this program. If not, see <https://www.gnu.org/licenses/>
 #include <nlohmann/json.hpp>
 #include <QHBoxLayout>
 #include <QWidget>
+#include <curl/curl.h>
 
 template<class T>
 static size_t write_data(void *ptr, size_t size, size_t nmemb, void *userdata)
@@ -64,6 +65,13 @@ std::string postBody(std::map<std::string, std::string> params);
 std::string fetch_string_from_get(std::string url, std::string token);
 std::string fetch_string_from_post(std::string url, std::string postdata, std::string token="");
 std::vector<char> fetch_bytes_from_url(std::string url);
+// Bytes [begin, end) of the object at url. Empty if the server doesn't
+// answer with exactly that range.
+std::vector<char> fetch_range(std::string url, uint64_t begin, uint64_t end);
+CURLSH *get_curl_share();
+CURL *acquire_curl_handle();
+void release_curl_handle(CURL *handle);
+void cleanup_curl_share();
 std::string url_encode(const std::string& decoded);
 
 void replace_all(std::string &haystack, std::string needle, std::string word);